@@ -0,0 +1,179 @@
+#pragma once
+
+#include <ivmg/codecs/errors.hpp>
+#include <ivmg/codecs/options.hpp>
+#include <ivmg/core/image.hpp>
+#include <ivmg/core/rect.hpp>
+
+#include <cstdint>
+#include <expected>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <span>
+#include <vector>
+
+namespace ivmg {
+
+class PngDecoder;
+class PngEncoder;
+
+
+/**
+ * @brief What happens to the region of a frame once it has been shown, before the next frame is drawn
+ */
+enum class ApngDispose : uint8_t {
+    NONE,           // The canvas stays as it is
+    BACKGROUND,     // The region is cleared to transparent black
+    PREVIOUS        // The region goes back to what it was before the frame was drawn
+};
+
+
+/**
+ * @brief How a frame is drawn onto the canvas
+ */
+enum class ApngBlend : uint8_t {
+    SOURCE,     // The frame replaces the pixels of its region, alpha included
+    OVER        // The frame is alpha composited over the pixels of its region
+};
+
+
+/**
+ * @brief Placement and timing of one frame of an animation
+ */
+struct ApngFrame {
+    Rect region;            // Part of the canvas the frame covers
+    uint16_t delay_num;     // Time the frame stays on screen, delay_num / delay_den seconds
+    uint16_t delay_den;     // 0 is read as 100
+    ApngDispose dispose;
+    ApngBlend blend;
+};
+
+
+/**
+ * @brief Canvas and frame count of an animation
+ */
+struct ApngInfo {
+    uint32_t width;         // Of the canvas, in pixels
+    uint32_t height;
+    ColorType color;        // Of the canvas, as the decoding settings give it
+    uint8_t bit_depth;
+    uint32_t nb_frames;
+    uint32_t nb_plays;      // 0 loops forever
+};
+
+
+
+/**
+ * @brief Plays an animated PNG frame by frame onto a single canvas.
+ *
+ * Every call to next_frame applies the dispose operation of the previous
+ * frame, then decodes the next one straight into its region of the canvas,
+ * so only the pixels a frame covers are touched. A PNG without animation
+ * plays as a single frame. The canvas and scratch buffers are reused from
+ * one frame, and one file, to the next. Not thread safe.
+ */
+class ApngReader {
+private:
+    std::unique_ptr<PngDecoder> decoder;
+    std::optional<Image> canvas_img;
+    ApngInfo info;
+    size_t next;                        // Index of the next frame to decode
+    std::optional<ApngFrame> pending;   // Frame shown last, whose dispose operation is still to apply
+    std::vector<uint8_t> saved;         // Region of the canvas under the pending frame, for ApngDispose::PREVIOUS
+    std::vector<uint8_t> frame_pixels;  // Frames blended over the canvas are decoded here first
+
+public:
+    ApngReader();
+    ~ApngReader();
+
+    ApngReader(const ApngReader&) = delete;
+    ApngReader& operator=(const ApngReader&) = delete;
+
+    /**
+     * @brief Reads the chunks of an animated PNG and clears the canvas.
+     *
+     * roi, scale, adam7_passes and streaming are ignored: frames are always decoded whole.
+     *
+     * @param data the content of the file, which must outlive the reader or the next call to open
+     * @param opts the decoding settings
+     * @return std::expected with the animation metadata as the expected value, an error code otherwise
+     */
+    std::expected<ApngInfo, IVMG_DEC_ERR> open(std::span<const uint8_t> data, const DecodeOptions& opts = {});
+
+    /**
+     * @brief Draws the next frame onto the canvas
+     *
+     * @return std::expected with the placement and timing of the frame as the expected value, an error code otherwise
+     */
+    std::expected<ApngFrame, IVMG_DEC_ERR> next_frame();
+
+    /**
+     * @brief The animation as it looks after the last frame drawn
+     */
+    inline const Image& canvas() const { return *canvas_img; }
+
+    inline bool has_next_frame() const { return canvas_img.has_value() && next < info.nb_frames; }
+
+private:
+    void dispose(const ApngFrame& frame);
+};
+
+
+
+/**
+ * @brief Builds an animated PNG from full frames, storing only what changed in each.
+ *
+ * Every frame is compared with the previous one and only the bounding box
+ * of the pixels that differ is compressed, to be drawn over the canvas
+ * with ApngBlend::SOURCE. The first frame is the default image, which
+ * viewers without APNG support show. Frames must all have the size and
+ * pixel layout of the first one. Not thread safe.
+ */
+class ApngWriter {
+private:
+    std::unique_ptr<PngEncoder> encoder;
+    std::vector<uint8_t> out;           // The file so far
+    std::vector<uint8_t> previous;      // Pixels of the last frame added
+    uint32_t width;
+    uint32_t height;
+    ColorType color;
+    uint8_t bit_depth;
+    uint32_t nb_frames;
+    uint32_t sequence;                  // Sequence number of the next fcTL or fdAT chunk
+    size_t actl_offset;                 // Where the acTL chunk is, to fill in once the frame count is known
+    size_t last_fctl_offset;            // Where the fcTL of the last frame is, to lengthen it when a frame repeats it
+
+public:
+    ApngWriter();
+    ~ApngWriter();
+
+    ApngWriter(const ApngWriter&) = delete;
+    ApngWriter& operator=(const ApngWriter&) = delete;
+
+    /**
+     * @brief Appends a frame to the animation
+     *
+     * @param frame the full frame. The first one sets the size and pixel layout of the animation
+     * @param delay_num the time the frame stays on screen is delay_num / delay_den seconds
+     * @param delay_den see delay_num
+     * @param opts the compression settings of this frame. png_idot is ignored
+     * @return std::expected with void as the expected value, IVMG_ENC_ERR::INVALID_FRAME if the frame does not match the first one
+     */
+    std::expected<void, IVMG_ENC_ERR> add_frame(const Image& frame, uint16_t delay_num, uint16_t delay_den = 1000, const EncodeOptions& opts = {});
+
+    /**
+     * @brief Ends the file. The writer can then start a new animation.
+     *
+     * @param nb_plays the number of times to play the animation, 0 to loop forever
+     * @return a view of the file, valid until the next call to add_frame
+     */
+    std::span<const uint8_t> finish(uint32_t nb_plays = 0);
+
+    /**
+     * @brief Ends the file and writes it at the given path
+     */
+    std::expected<void, IVMG_ENC_ERR> save(const std::filesystem::path& path, uint32_t nb_plays = 0);
+};
+
+}
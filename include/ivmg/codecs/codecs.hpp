@@ -2,6 +2,9 @@
 
 
 #include <ivmg/codecs/errors.hpp>
+#include <ivmg/codecs/image_info.hpp>
+#include <ivmg/codecs/options.hpp>
+#include <ivmg/core/pixel_format.hpp>
 
 #include <fstream>
 #include <unordered_map>
@@ -10,6 +13,7 @@
 #include <vector>
 #include <filesystem>
 #include <functional>
+#include <span>
 
 namespace ivmg {
 
@@ -23,9 +27,14 @@ class Decoder;
  *
  * Contains a std::vector of Decoder objects
  * Contains a map of string to Encoder objects
+ *
+ * The static decode and encode functions go through a per thread
+ * DecodeSession / EncodeSession so codec objects are reused across calls.
  */
 class CodecRegistry {
 private:
+	friend class DecodeSession;
+	friend class EncodeSession;
 
 	using DecoderFactory = std::function<std::unique_ptr<Decoder>()>;
 	using EncoderFactory = std::function<std::unique_ptr<Encoder>()>;
@@ -48,12 +57,69 @@ private:
 public:
 
 	/**
-	 * @brief Choose the appropriate decoder and use it to decode the given image.
+	 * @brief Choose the appropriate decoder and use it to decode the given image file.
+	 *
+	 * The file is memory mapped and decoded in place.
+	 *
+	 * @param imgpath the image file to decode
+	 * @param opts the decoding settings
+	 * @return std::expected with the decoded image as the expected value, an error code otherwise
+	 */
+	static std::expected<Image, IVMG_DEC_ERR> decode(const std::filesystem::path& imgpath, const DecodeOptions& opts = {});
+
+
+	/**
+	 * @brief Choose the appropriate decoder and use it to decode the given encoded image.
 	 *
-	 * @param file the binary stream of the image file to decode
+	 * @param data the content of an image file
+	 * @param opts the decoding settings
 	 * @return std::expected with the decoded image as the expected value, an error code otherwise
 	 */
-	static std::expected<Image, IVMG_DEC_ERR> decode(std::ifstream& file);
+	static std::expected<Image, IVMG_DEC_ERR> decode(std::span<const uint8_t> data, const DecodeOptions& opts = {});
+
+
+	/**
+	 * @brief Choose the appropriate decoder and decode the given image file into caller owned memory.
+	 *
+	 * @param imgpath the image file to decode
+	 * @param dst where to write the pixels, large enough for the decoded image
+	 * @param stride the distance in bytes between the start of two rows in dst
+	 * @param fmt the layout of the pixels in dst
+	 * @param opts the decoding settings
+	 * @return std::expected with void as the expected value, an error code otherwise
+	 */
+	static std::expected<void, IVMG_DEC_ERR> decode_into(const std::filesystem::path& imgpath, std::span<uint8_t> dst, size_t stride, PixelFormat fmt = PixelFormat::RGBA8, const DecodeOptions& opts = {});
+
+
+	/**
+	 * @brief Choose the appropriate decoder and decode the given encoded image into caller owned memory.
+	 *
+	 * @param data the content of an image file
+	 * @param dst where to write the pixels, large enough for the decoded image
+	 * @param stride the distance in bytes between the start of two rows in dst
+	 * @param fmt the layout of the pixels in dst
+	 * @param opts the decoding settings
+	 * @return std::expected with void as the expected value, an error code otherwise
+	 */
+	static std::expected<void, IVMG_DEC_ERR> decode_into(std::span<const uint8_t> data, std::span<uint8_t> dst, size_t stride, PixelFormat fmt = PixelFormat::RGBA8, const DecodeOptions& opts = {});
+
+
+	/**
+	 * @brief Choose the appropriate decoder and read only the header of the given image file.
+	 *
+	 * @param imgpath the image file to probe
+	 * @return std::expected with the image metadata as the expected value, an error code otherwise
+	 */
+	static std::expected<ImageInfo, IVMG_DEC_ERR> probe(const std::filesystem::path& imgpath);
+
+
+	/**
+	 * @brief Choose the appropriate decoder and read only the header of the given encoded image.
+	 *
+	 * @param data the content of an image file, or at least its header
+	 * @return std::expected with the image metadata as the expected value, an error code otherwise
+	 */
+	static std::expected<ImageInfo, IVMG_DEC_ERR> probe(std::span<const uint8_t> data);
 
 
 	/**
@@ -62,9 +128,10 @@ public:
 	 *
 	 * @param img the image to encode
 	 * @param imgpath the file to encode the image to
+	 * @param opts the encoding settings
 	 * @return std::expected with void as the expected value, an error code otherwise
 	 */
-	static std::expected<void, IVMG_ENC_ERR> encode(const Image& img, const std::filesystem::path& imgpath);
+	static std::expected<void, IVMG_ENC_ERR> encode(const Image& img, const std::filesystem::path& imgpath, const EncodeOptions& opts = {});
 
 
 	/**
@@ -1,6 +1,14 @@
 #pragma once
 
-#include <fstream>
+#include <ivmg/codecs/errors.hpp>
+#include <ivmg/codecs/image_info.hpp>
+#include <ivmg/codecs/options.hpp>
+#include <ivmg/core/pixel_format.hpp>
+
+#include <cstdint>
+#include <expected>
+#include <memory>
+#include <span>
 
 namespace ivmg {
 
@@ -16,18 +24,55 @@ public:
     /**
      * @brief Reads the first bytes of the file to tell whether it can decode it.
      *
-     * @param filestream the binary stream of the file to probe
+     * @param data the content of the file to probe
      * @return true if it can decode it, false otherwise
      */
-    virtual bool can_decode(std::ifstream& filestream) const = 0;
+    virtual bool can_decode(std::span<const uint8_t> data) const = 0;
+
+    /**
+     * @brief Reads the header of the file only, to get the image dimensions and layout.
+     *
+     * @param data the content of the file to probe. Only the first bytes are touched
+     * @return std::expected with the image metadata as the expected value, an error code otherwise
+     */
+    virtual std::expected<ImageInfo, IVMG_DEC_ERR> probe(std::span<const uint8_t> data) = 0;
 
     /**
      * @brief Decode the raw bytes of the given image file
      *
-     * @param filestream the binary stream of the file to decode
-     * @return Image the decoded image
+     * @param data the content of the file to decode, usually memory mapped
+     * @param opts the decoding settings
+     * @return std::expected with the decoded image as the expected value, an error code otherwise
+     */
+    virtual std::expected<Image, IVMG_DEC_ERR> decode(std::span<const uint8_t> data, const DecodeOptions& opts) = 0;
+
+    /**
+     * @brief Decode the raw bytes of the given image file straight into caller owned memory
+     *
+     * The destination must hold the image as decode would return it, roi and scale applied.
+     * A reused decoder does not allocate once its scratch buffers have grown to the image size.
+     *
+     * @param data the content of the file to decode, usually memory mapped
+     * @param dst where to write the pixels. Rows of 16 bits formats must be 2 bytes aligned
+     * @param stride the distance in bytes between the start of two rows in dst
+     * @param fmt the layout of the pixels in dst
+     * @param opts the decoding settings
+     * @return std::expected with void as the expected value, an error code otherwise
+     */
+    virtual std::expected<void, IVMG_DEC_ERR> decode_into(std::span<const uint8_t> data, std::span<uint8_t> dst, size_t stride, PixelFormat fmt, const DecodeOptions& opts) = 0;
+
+    /**
+     * @brief Decode a file the returned image may keep pointing to
+     *
+     * Formats storing pixels as they come out can return a view of data instead of a copy.
+     * Defaults to decode.
+     *
+     * @param data the content of the file to decode, private to the caller and writable
+     * @param owner keeps data alive, the image shares it when it views data
+     * @param opts the decoding settings
+     * @return std::expected with the decoded image as the expected value, an error code otherwise
      */
-    virtual Image decode(std::ifstream& filestream) = 0;
+    virtual std::expected<Image, IVMG_DEC_ERR> decode_shared(std::span<uint8_t> data, std::shared_ptr<void> owner, const DecodeOptions& opts);
 };
 
 
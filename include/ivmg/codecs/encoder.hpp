@@ -1,5 +1,7 @@
 #pragma once
 
+#include <ivmg/codecs/options.hpp>
+
 #include <vector>
 #include <cstdint>
 
@@ -15,12 +17,13 @@ public:
     virtual ~Encoder() = default;
 
     /**
-     * @brief Encode the given image
+     * @brief Encode the given image. Encoders reset their state on every call so they can be reused.
      *
      * @param img the image to encode
-     * @return vector of bytes encoded accordingly
+     * @param out the buffer receiving the encoded bytes. Overwritten, its capacity is reused
+     * @param opts the encoding settings
      */
-    virtual std::vector<uint8_t> encode(const Image& img) = 0;
+    virtual void encode(const Image& img, std::vector<uint8_t>& out, const EncodeOptions& opts) = 0;
 };
 
 
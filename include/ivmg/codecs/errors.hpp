@@ -1,10 +1,18 @@
 #pragma once
 
 enum class IVMG_DEC_ERR {
-    UNKNOWN_FORMAT
+    UNKNOWN_FORMAT,
+    UNREADABLE_FILE,    // The file could not be opened or read
+    INVALID_HEADER,     // Header values outside of what the format allows
+    CORRUPTED_DATA,     // Truncated or undecodable image data
+    CRC_MISMATCH,       // A checksum stored in the file does not match its content
+    INVALID_REGION,     // The requested region does not intersect the image
+    BUFFER_TOO_SMALL,   // The destination buffer cannot hold the decoded image
+    UNSUPPORTED_PIXEL_FORMAT    // The decoder cannot write pixels in the requested format, or not at that alignment
 };
 
 
 enum class IVMG_ENC_ERR {
-    UNSUPPORTED_FORMAT
+    UNSUPPORTED_FORMAT,
+    INVALID_FRAME       // An animation frame whose size or pixel layout differs from the first frame
 };
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+
+namespace ivmg {
+
+/**
+ * @brief Image metadata read from a file header, without decoding the pixels
+ */
+struct ImageInfo {
+    uint32_t width;             // In pixels
+    uint32_t height;            // In pixels
+    uint8_t channels;           // As stored in the file, 1 for palette images
+    uint8_t bit_depth;          // Bits per channel as stored in the file
+    std::string_view format;    // Short lowercase name of the format, e.g. "png"
+};
+
+}
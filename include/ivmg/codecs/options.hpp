@@ -0,0 +1,151 @@
+#pragma once
+
+#include <ivmg/core/rect.hpp>
+
+#include <cstdint>
+#include <optional>
+
+namespace ivmg {
+
+/**
+ * @brief Which chunks get their CRC verified when decoding formats that carry one
+ */
+enum class CrcPolicy : uint8_t {
+    ALL,        // Every chunk, a mismatch fails the decode
+    CRITICAL,   // Only the chunks needed to decode the image (IHDR, PLTE, IDAT, IEND for PNG)
+    NONE        // Trust the file
+};
+
+
+/**
+ * @brief Settings tuning how images are decoded. Defaults decode the whole image.
+ */
+struct DecodeOptions {
+
+    /**
+     * @brief Number of Adam7 passes to decode for interlaced PNGs, from 1 to 7.
+     *
+     * Stopping early returns a reduced image made of the pixels seen so far:
+     * 1/8 of the resolution after pass 1, 1/4 after pass 3, 1/2 after pass 5.
+     * Ignored for non interlaced images.
+     */
+    uint8_t adam7_passes = 7;
+
+    /**
+     * @brief Inflate and unfilter PNG scanlines one at a time instead of inflating the whole image first.
+     *
+     * Only a couple of scanlines are kept besides the output image, at the cost
+     * of a slower inflater. Meant for very large images on small-memory hosts.
+     */
+    bool streaming = false;
+
+    /**
+     * @brief CRC verification of PNG chunks. Corrupted chunks fail with IVMG_DEC_ERR::CRC_MISMATCH.
+     *
+     * By default the chunks the pixels come from are checked, for a few percent
+     * of the decode time. Set NONE to trust the file and skip the checks.
+     */
+    CrcPolicy crc_check = CrcPolicy::CRITICAL;
+
+    /**
+     * @brief Only decode this rectangle of the image, in full resolution coordinates.
+     *
+     * The returned image contains the requested rectangle only, clipped to the
+     * image bounds. PNG scanlines below it are not inflated at all.
+     */
+    std::optional<Rect> roi;
+
+    /**
+     * @brief Downscaling factor applied while decoding: 1, 2, 4 or 8.
+     *
+     * Every scale x scale block of pixels is averaged into one output pixel,
+     * as scanlines come out of the unfilter, so the full size image is never
+     * allocated. Applied after roi and adam7_passes. Other values are rounded
+     * down to the closest of these.
+     */
+    uint8_t scale = 1;
+
+    /**
+     * @brief Always return RGBA images.
+     *
+     * By default images come out with the channels of the source only: gray,
+     * gray alpha, RGB or RGBA. Alpha is kept only when the file can make a pixel
+     * transparent.
+     */
+    bool force_rgba = false;
+
+    /**
+     * @brief Always return 8 bits images.
+     *
+     * By default 16 bits sources give 16 bits images, in native byte order.
+     * Set this to scale them down to 8 bits.
+     */
+    bool force_8bit = false;
+};
+
+
+
+/**
+ * @brief Filter applied to PNG scanlines before compression
+ */
+enum class PngFilter : uint8_t {
+    NONE,
+    SUB,
+    UP,
+    AVG,
+    PAETH,
+    ADAPTIVE,       // Per row, the filter with the smallest sum of absolute differences, as libpng does
+    BRUTE_FORCE     // Per row, the filter whose output compresses best on its own. Several times slower
+};
+
+
+/**
+ * @brief Settings tuning how images are encoded. Formats ignore the settings they have no use for.
+ */
+struct EncodeOptions {
+
+    /**
+     * @brief Compression effort, from 0 to 12 as in libdeflate.
+     *
+     * 0 stores the data uncompressed, 12 is the slowest and gives the
+     * smallest files. Higher values are clamped to 12.
+     */
+    uint8_t compression_level = 6;
+
+    /**
+     * @brief Filter applied to PNG scanlines, or how to pick one per row. Rows are left unfiltered at compression level 0.
+     */
+    PngFilter png_filter = PngFilter::ADAPTIVE;
+
+    /**
+     * @brief Write an iDOT chunk listing the strips of large PNGs so that decoders can inflate them in parallel.
+     *
+     * PNGs holding more than a megabyte of pixels are compressed in independent
+     * strips when several cores are available. This also splits them on a
+     * single core, and starts every strip on a row that does not depend on the
+     * previous one.
+     */
+    bool png_idot = false;
+
+    /**
+     * @brief Write PNGs as fast as possible, for screenshots and previews served right away.
+     *
+     * One fixed filter, matches looked for one pixel left and one row up, plus
+     * a hash table on flat images, and Huffman tables from a single counting
+     * pass, as fpng does. 7 to 17 times faster than the default level on
+     * photos, about 5 times on flat images, for files 8 to 20% larger.
+     * compression_level and png_filter are ignored.
+     */
+    bool png_fast = false;
+
+    /**
+     * @brief Split QOI images in independent segments of this many rows, encoded and decoded on every core.
+     *
+     * Every segment starts over from a fresh QOI state, which costs a few
+     * bytes, and a table of their offsets is appended after the end marker.
+     * Plain QOI decoders still read the file. 0 writes plain QOI.
+     */
+    uint32_t qoi_segment_rows = 0;
+};
+
+}
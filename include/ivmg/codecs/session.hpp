@@ -0,0 +1,151 @@
+#pragma once
+
+#include <ivmg/codecs/errors.hpp>
+#include <ivmg/codecs/image_info.hpp>
+#include <ivmg/codecs/options.hpp>
+#include <ivmg/core/pixel_format.hpp>
+
+#include <cstdint>
+#include <expected>
+#include <filesystem>
+#include <memory>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace ivmg {
+
+class Image;
+class Encoder;
+class Decoder;
+
+/**
+ * @brief Long lived decoding context.
+ *
+ * Keeps one instance of every registered decoder, along with their inflater
+ * contexts and scratch buffers, so that decoding many images in a row only
+ * pays for their setup once. Not thread safe: use one session per thread.
+ */
+class DecodeSession {
+private:
+	std::vector<std::unique_ptr<Decoder>> decoders;    // Same order as the registry, created on first use
+
+public:
+	DecodeSession();
+	~DecodeSession();
+
+	DecodeSession(const DecodeSession&) = delete;
+	DecodeSession& operator=(const DecodeSession&) = delete;
+
+	/**
+	 * @brief Memory map and decode the given image file
+	 *
+	 * Formats that store pixels as is, such as 8 bits PAM, may return a view of the
+	 * mapping instead of copying them out. The file stays mapped until the image is gone.
+	 *
+	 * @param imgpath the image file to decode
+	 * @param opts the decoding settings
+	 * @return std::expected with the decoded image as the expected value, an error code otherwise
+	 */
+	std::expected<Image, IVMG_DEC_ERR> decode(const std::filesystem::path& imgpath, const DecodeOptions& opts = {});
+
+	/**
+	 * @brief Decode an image file already in memory
+	 *
+	 * @param data the content of an image file
+	 * @param opts the decoding settings
+	 * @return std::expected with the decoded image as the expected value, an error code otherwise
+	 */
+	std::expected<Image, IVMG_DEC_ERR> decode(std::span<const uint8_t> data, const DecodeOptions& opts = {});
+
+	/**
+	 * @brief Memory map the given image file and decode it into caller owned memory
+	 *
+	 * @param imgpath the image file to decode
+	 * @param dst where to write the pixels, large enough for the decoded image
+	 * @param stride the distance in bytes between the start of two rows in dst
+	 * @param fmt the layout of the pixels in dst
+	 * @param opts the decoding settings
+	 * @return std::expected with void as the expected value, an error code otherwise
+	 */
+	std::expected<void, IVMG_DEC_ERR> decode_into(const std::filesystem::path& imgpath, std::span<uint8_t> dst, size_t stride, PixelFormat fmt = PixelFormat::RGBA8, const DecodeOptions& opts = {});
+
+	/**
+	 * @brief Decode an image file already in memory into caller owned memory
+	 *
+	 * @param data the content of an image file
+	 * @param dst where to write the pixels, large enough for the decoded image
+	 * @param stride the distance in bytes between the start of two rows in dst
+	 * @param fmt the layout of the pixels in dst
+	 * @param opts the decoding settings
+	 * @return std::expected with void as the expected value, an error code otherwise
+	 */
+	std::expected<void, IVMG_DEC_ERR> decode_into(std::span<const uint8_t> data, std::span<uint8_t> dst, size_t stride, PixelFormat fmt = PixelFormat::RGBA8, const DecodeOptions& opts = {});
+
+	/**
+	 * @brief Read the dimensions and format of the given image file without decoding it
+	 *
+	 * @param imgpath the image file to probe
+	 * @return std::expected with the image metadata as the expected value, an error code otherwise
+	 */
+	std::expected<ImageInfo, IVMG_DEC_ERR> probe(const std::filesystem::path& imgpath);
+
+	/**
+	 * @brief Read the dimensions and format of an image file in memory without decoding it
+	 *
+	 * @param data the content of an image file, or at least its header
+	 * @return std::expected with the image metadata as the expected value, an error code otherwise
+	 */
+	std::expected<ImageInfo, IVMG_DEC_ERR> probe(std::span<const uint8_t> data);
+
+private:
+	Decoder* find_decoder(std::span<const uint8_t> data);
+};
+
+
+
+/**
+ * @brief Long lived encoding context.
+ *
+ * Keeps one instance of every encoder used so far and the output buffer,
+ * whose capacity is reused from one image to the next. Not thread safe:
+ * use one session per thread.
+ */
+class EncodeSession {
+private:
+	std::unordered_map<std::string, std::unique_ptr<Encoder>> encoders;
+	std::vector<uint8_t> buffer;
+
+public:
+	EncodeSession();
+	~EncodeSession();
+
+	EncodeSession(const EncodeSession&) = delete;
+	EncodeSession& operator=(const EncodeSession&) = delete;
+
+	/**
+	 * @brief Encode the image with the encoder matching the path's extension and write it
+	 *
+	 * @param img the image to encode
+	 * @param imgpath the file to encode the image to
+	 * @param opts the encoding settings
+	 * @return std::expected with void as the expected value, an error code otherwise
+	 */
+	std::expected<void, IVMG_ENC_ERR> encode(const Image& img, const std::filesystem::path& imgpath, const EncodeOptions& opts = {});
+
+	/**
+	 * @brief Encode the image in memory
+	 *
+	 * @param img the image to encode
+	 * @param ext the extension of the format to use, with the leading dot
+	 * @param opts the encoding settings
+	 * @return std::expected with a view of the encoded bytes, valid until the next call, an error code otherwise
+	 */
+	std::expected<std::span<const uint8_t>, IVMG_ENC_ERR> encode(const Image& img, const std::string& ext, const EncodeOptions& opts = {});
+
+private:
+	Encoder* find_encoder(const std::string& ext);
+};
+
+}
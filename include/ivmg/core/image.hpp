@@ -3,12 +3,14 @@
 #include <cstddef>
 #include <iterator>
 #include <ivmg/codecs/errors.hpp>
+#include <ivmg/codecs/options.hpp>
 #include <ivmg/imgproc/filter.hpp>
 #include <ivmg/core/pixel.hpp>
 
 #include <vector>
 #include <filesystem>
 #include <expected>
+#include <memory>
 #include <unordered_map>
 
 namespace ivmg {
@@ -16,15 +18,19 @@ namespace ivmg {
 using namespace imgproc::filt;
 
 enum class ColorType : uint8_t {
-    RGBA = 0,
-    RGB  = 1,
-    YUV  = 2
+    RGBA  = 0,
+    RGB   = 1,
+    YUV   = 2,
+    GRAY  = 3,
+    GRAYA = 4
 };
 
 const std::unordered_map<ColorType, uint8_t> colortype_to_chan_nb {
-    { ColorType::RGBA, 4 },
-    { ColorType::RGB,  3 },
-    { ColorType::YUV,  3 }
+    { ColorType::RGBA,  4 },
+    { ColorType::RGB,   3 },
+    { ColorType::YUV,   3 },
+    { ColorType::GRAY,  1 },
+    { ColorType::GRAYA, 2 }
 };
 
 
@@ -34,29 +40,53 @@ const std::unordered_map<ColorType, uint8_t> colortype_to_chan_nb {
 
 /**
 * @brief In memory buffer of raw decoded image data
+*
+* Either owns its pixels, or views pixels kept alive by someone else, such as
+* a memory mapped file. Copies of a view own their pixels.
 */
 class Image {
 
     private:
-        std::vector<uint8_t> data;  // In row major. x is col, y is row
+        std::vector<uint8_t> data;  // In row major. x is col, y is row. 16 bits samples are in native byte order
+        uint8_t* view_pixels = nullptr;     // Same layout as data, for views. data is then empty
+        std::shared_ptr<void> owner;        // Keeps view_pixels alive
         uint32_t w;     // In pixels
         uint32_t h;    // In pixels
         ColorType color_type;
         uint8_t nb_channels;
+        uint8_t depth;  // Bits per sample, 8 or 16
 
     public:
-        Image(const uint32_t w, const uint32_t h, ColorType ct = ColorType::RGBA);
+        Image(const uint32_t w, const uint32_t h, ColorType ct = ColorType::RGBA, uint8_t bit_depth = 8);
+        Image(const Image& other);
+        Image(Image&& other) noexcept = default;
 
-        Image operator=(Image& img);
+        /**
+         * @brief Wraps pixels stored elsewhere without copying them
+         *
+         * @param pixels w x h packed pixels of the given layout, 16 bits samples in native byte order
+         * @param owner whatever keeps the pixels alive, shared with the image
+         * @return an image writing to and reading from pixels
+         */
+        static Image view(uint32_t w, uint32_t h, ColorType ct, uint8_t bit_depth, uint8_t* pixels, std::shared_ptr<void> owner);
+
+        Image& operator=(const Image& other);
+        Image& operator=(Image&& other) noexcept = default;
 
         // ACCESSORS
-        inline constexpr uint8_t* get_raw_handle() { return data.data(); }
-        inline constexpr const uint8_t* get_raw_handle() const { return data.data(); }
+        inline constexpr uint8_t* get_raw_handle() { return view_pixels ? view_pixels : data.data(); }
+        inline constexpr const uint8_t* get_raw_handle() const { return view_pixels ? view_pixels : data.data(); }
+        inline uint16_t* get_raw_handle16() { return reinterpret_cast<uint16_t*>(get_raw_handle()); }
+        inline const uint16_t* get_raw_handle16() const { return reinterpret_cast<const uint16_t*>(get_raw_handle()); }
+        inline constexpr bool is_view() const { return view_pixels != nullptr; }
         inline constexpr uint32_t width() const { return w; }
         inline constexpr uint32_t height() const { return h; }
         inline constexpr uint8_t nb_chan() const { return nb_channels; }
-        inline constexpr size_t size_bytes() const { return data.size(); }
-        inline constexpr size_t size_pixels() const { return data.size() / colortype_to_chan_nb.at(color_type); }      // Assuming RGBA for now
+        inline constexpr ColorType color() const { return color_type; }
+        inline constexpr uint8_t bit_depth() const { return depth; }
+        inline constexpr uint8_t bytes_per_sample() const { return depth / 8; }
+        inline constexpr size_t size_bytes() const { return size_pixels() * nb_channels * bytes_per_sample(); }
+        inline constexpr size_t size_pixels() const { return static_cast<size_t>(w) * h; }
 
         /**
          * @brief Save the image at the given path.
@@ -64,25 +94,27 @@ class Image {
          * Extrapolates the wanted format from the extension
          *
          * @param imgpath the path where to save the image
+         * @param opts the encoding settings
          * @return std::expected object, empty if ok, an error code otherwise
          */
-        std::expected<void, IVMG_ENC_ERR> save(const std::filesystem::path& imgpath);
+        std::expected<void, IVMG_ENC_ERR> save(const std::filesystem::path& imgpath, const EncodeOptions& opts = {});
 
 
         Image operator|(const Conv& f);
 
 
         /**
-         * @brief Iterator for image
+         * @brief Iterator for image, one pixel at a time whatever the number of channels
          *
-         * TODO: Support other color types than just RGBA
+         * 8 bits images only
          */
         class iterator {
         private:
         	uint8_t* ptr;
+        	uint8_t step;
 
         public:
-        	explicit iterator(uint8_t* p): ptr(p) {}
+        	explicit iterator(uint8_t* p, uint8_t nb_chan = 4): ptr(p), step(nb_chan) {}
 
         	using iterator_category = std::forward_iterator_tag;
          	using value_type = Pixel;
@@ -90,41 +122,41 @@ class Image {
            	using pointer = Pixel*;
             using reference = Pixel;
 
-            reference operator*() { return Pixel(ptr); }
+            reference operator*() { return Pixel(ptr, step); }
 
             iterator& operator++() {
-            	ptr += 4;
+            	ptr += step;
              	return *this;
             }
 
             iterator& operator++(int i) {
             	iterator& tmp = *this;
-             	ptr += 4;
+             	ptr += step;
               	return tmp;
             }
 
             bool operator==(const iterator& other) { return ptr == other.ptr; }
             bool operator!=(const iterator& other) { return ptr != other.ptr; }
 
-            iterator operator+(difference_type n) const { return iterator(ptr + n * 4); }
+            iterator operator+(difference_type n) const { return iterator(ptr + n * step, step); }
             iterator& operator+=(difference_type n) {
-            	ptr += n * 4;
+            	ptr += n * step;
              	return *this;
             }
 
-            iterator operator-(difference_type n) const { return iterator(ptr - n * 4); }
+            iterator operator-(difference_type n) const { return iterator(ptr - n * step, step); }
             iterator& operator-=(difference_type n) {
-            	ptr -= n * 4;
+            	ptr -= n * step;
              	return *this;
             }
 
             difference_type operator-(const iterator& other) {
-            	return (ptr - other.ptr) / 4;
+            	return (ptr - other.ptr) / step;
             }
         };
 
-        inline iterator begin() { return iterator(data.data()); }
-        inline iterator end() { return iterator(data.data() + size_pixels() * nb_channels); }
+        inline iterator begin() { return iterator(get_raw_handle(), nb_channels); }
+        inline iterator end() { return iterator(get_raw_handle() + size_pixels() * nb_channels, nb_channels); }
 
 
 };
@@ -12,13 +12,13 @@ private:
 
 public:
 
-	// TODO: Support other color types
-	explicit Pixel(uint8_t* start): data(start, 4) {}
+	// Gray pixels read as equal r, g and b. Pixels without alpha read as opaque
+	explicit Pixel(uint8_t* start, uint8_t nb_chan = 4): data(start, nb_chan) {}
 
 	inline uint8_t r() const { return data[0]; }
-	inline uint8_t g() const { return data[1]; }
-	inline uint8_t b() const { return data[2]; }
-	inline uint8_t a() const { return data[3]; }
+	inline uint8_t g() const { return data.size() >= 3 ? data[1] : data[0]; }
+	inline uint8_t b() const { return data.size() >= 3 ? data[2] : data[0]; }
+	inline uint8_t a() const { return (data.size() % 2 == 0) ? data.back() : 255; }
 
 
 	bool operator==(const Pixel& other) {
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+
+namespace ivmg {
+
+/**
+ * @brief Memory layout of the pixels written to a caller provided buffer
+ */
+enum class PixelFormat : uint8_t {
+    RGBA8 = 0,      // 4 bytes per pixel, R first
+    RGB8 = 1,       // 3 bytes per pixel, R first
+    GRAY8 = 2,      // 1 byte per pixel. Color sources are converted to luma
+    GRAYA8 = 3,     // 2 bytes per pixel, gray then alpha
+    RGBA16 = 4,     // Same layouts with 16 bits samples in native byte order
+    RGB16 = 5,
+    GRAY16 = 6,
+    GRAYA16 = 7,
+};
+
+
+/**
+ * @brief Number of channels of one pixel of the given format
+ */
+constexpr uint8_t channels(PixelFormat fmt) {
+    switch (fmt) {
+        case PixelFormat::RGBA8:  case PixelFormat::RGBA16:  return 4;
+        case PixelFormat::RGB8:   case PixelFormat::RGB16:   return 3;
+        case PixelFormat::GRAYA8: case PixelFormat::GRAYA16: return 2;
+        case PixelFormat::GRAY8:  case PixelFormat::GRAY16:  return 1;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Bits per sample of the given format
+ */
+constexpr uint8_t bit_depth(PixelFormat fmt) {
+    return (static_cast<uint8_t>(fmt) >= static_cast<uint8_t>(PixelFormat::RGBA16)) ? 16 : 8;
+}
+
+
+/**
+ * @brief Size in bytes of one pixel of the given format
+ */
+constexpr uint8_t bytes_per_pixel(PixelFormat fmt) {
+    return channels(fmt) * bit_depth(fmt) / 8;
+}
+
+}
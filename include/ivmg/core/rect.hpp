@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstdint>
+
+namespace ivmg {
+
+/**
+ * @brief Axis aligned rectangle in pixels. x is col, y is row
+ */
+struct Rect {
+    uint32_t x;
+    uint32_t y;
+    uint32_t w;
+    uint32_t h;
+};
+
+}
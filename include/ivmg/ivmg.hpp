@@ -1,14 +1,19 @@
 #pragma once
 
 #include <ivmg/core/image.hpp>
+#include <ivmg/codecs/image_info.hpp>
+#include <ivmg/codecs/options.hpp>
+#include <span>
 #include <string>
 
 
 namespace ivmg {
 
 
-Image open(const std::string& imgpath);
-std::expected<void, IVMG_ENC_ERR> save(const Image &img, const std::filesystem::path &imgpath);
+Image open(const std::string& imgpath, const DecodeOptions& opts = {});
+std::expected<ImageInfo, IVMG_DEC_ERR> probe(const std::filesystem::path& imgpath);
+std::expected<ImageInfo, IVMG_DEC_ERR> probe(std::span<const uint8_t> data);
+std::expected<void, IVMG_ENC_ERR> save(const Image &img, const std::filesystem::path &imgpath, const EncodeOptions& opts = {});
 
 
 }
@@ -1,4 +1,5 @@
 #include <ivmg/codecs/codecs.hpp>
+#include <ivmg/codecs/session.hpp>
 #include <ivmg/core/image.hpp>
 
 #include "pam/pam.hpp"
@@ -11,8 +12,11 @@ namespace ivmg {
 
 	CodecRegistry::CodecRegistry() {
 		decoders.emplace_back([]() { return std::make_unique<PngDecoder>(); });
+		decoders.emplace_back([]() { return std::make_unique<QoiDecoder>(); });
+		decoders.emplace_back([]() { return std::make_unique<PamDecoder>(); });
 
 		encoders.emplace(".pam", []() { return std::make_unique<PamEncoder>(); });
+		encoders.emplace(".png", []() { return std::make_unique<PngEncoder>(); });
 		encoders.emplace(".qoi", []() { return std::make_unique<QoiEncoder>(); });
 	}
 
@@ -23,33 +27,46 @@ namespace ivmg {
 	}
 
 
-	std::expected<Image, IVMG_DEC_ERR> CodecRegistry::decode(std::ifstream &file) {
-		CodecRegistry& registry = get_instance();
+	// One session per thread shared by every entry point, so that its decoders are reused whatever the call
+	static DecodeSession& thread_decode_session() {
+		thread_local DecodeSession session;
+		return session;
+	}
 
-		for (const auto& factory: registry.decoders) {
-			std::unique_ptr<Decoder> dec = factory();
-			if (dec->can_decode(file))
-				return dec->decode(file);
-		}
 
-		return std::unexpected(IVMG_DEC_ERR::UNKNOWN_FORMAT);
+	std::expected<Image, IVMG_DEC_ERR> CodecRegistry::decode(const std::filesystem::path& imgpath, const DecodeOptions& opts) {
+		return thread_decode_session().decode(imgpath, opts);
 	}
 
 
-	std::expected<void, IVMG_ENC_ERR> CodecRegistry::encode(const Image& img, const std::filesystem::path& imgpath) {
-		CodecRegistry& registry = get_instance();
+	std::expected<Image, IVMG_DEC_ERR> CodecRegistry::decode(std::span<const uint8_t> data, const DecodeOptions& opts) {
+		return thread_decode_session().decode(data, opts);
+	}
+
 
-		std::string ext = imgpath.extension();
+	std::expected<void, IVMG_DEC_ERR> CodecRegistry::decode_into(const std::filesystem::path& imgpath, std::span<uint8_t> dst, size_t stride, PixelFormat fmt, const DecodeOptions& opts) {
+		return thread_decode_session().decode_into(imgpath, dst, stride, fmt, opts);
+	}
+
+
+	std::expected<void, IVMG_DEC_ERR> CodecRegistry::decode_into(std::span<const uint8_t> data, std::span<uint8_t> dst, size_t stride, PixelFormat fmt, const DecodeOptions& opts) {
+		return thread_decode_session().decode_into(data, dst, stride, fmt, opts);
+	}
+
+
+	std::expected<ImageInfo, IVMG_DEC_ERR> CodecRegistry::probe(const std::filesystem::path& imgpath) {
+		return thread_decode_session().probe(imgpath);
+	}
+
+
+	std::expected<ImageInfo, IVMG_DEC_ERR> CodecRegistry::probe(std::span<const uint8_t> data) {
+		return thread_decode_session().probe(data);
+	}
 
-		if (registry.encoders.contains(ext)) {
-			std::unique_ptr<Encoder> enc = registry.encoders.at(ext)();
-			std::vector<uint8_t> encoded = enc->encode(img);
-			std::ofstream outfile(imgpath);
-			outfile.write(reinterpret_cast<char*>(encoded.data()), encoded.size());
-			return {};
-		}
 
-		return std::unexpected(IVMG_ENC_ERR::UNSUPPORTED_FORMAT);
+	std::expected<void, IVMG_ENC_ERR> CodecRegistry::encode(const Image& img, const std::filesystem::path& imgpath, const EncodeOptions& opts) {
+		thread_local EncodeSession session;
+		return session.encode(img, imgpath, opts);
 	}
 
 
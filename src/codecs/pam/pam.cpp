@@ -1,30 +1,305 @@
 #include <ivmg/core/image.hpp>
 
 #include "pam.hpp"
+#include "png/expand.hpp"
+#include "common/byteswap.hpp"
+#include "common/logger.hpp"
 
+#include <algorithm>
+#include <bit>
+#include <charconv>
 #include <cstring>
+#include <optional>
 #include <sstream>
-#include <print>
 
 
-std::vector<uint8_t> ivmg::PamEncoder::encode(const Image& img) {
-
-	std::println("Encoding in PAM");
+void ivmg::PamEncoder::encode(const Image& img, std::vector<uint8_t>& out, const EncodeOptions&) {
+	const char* tupltype =
+		(img.nb_chan() == 1) ? "GRAYSCALE" :
+		(img.nb_chan() == 2) ? "GRAYSCALE_ALPHA" :
+		(img.nb_chan() == 3) ? "RGB" : "RGB_ALPHA";
 
 	std::stringstream ss;
 	ss << "P7\n"
         << "WIDTH " << img.width() << "\n"
         << "HEIGHT " << img.height() << "\n"
-        << "DEPTH " << 4 << "\n"
-        << "MAXVAL 255\n"
-        << "TUPLTYPE RGB_ALPHA\n"
+        << "DEPTH " << static_cast<int>(img.nb_chan()) << "\n"
+        << "MAXVAL " << ((img.bit_depth() == 16) ? 65535 : 255) << "\n"
+        << "TUPLTYPE " << tupltype << "\n"
         << "ENDHDR\n";
 
     std::string hdr = ss.str();
 
-    std::vector<uint8_t> out(hdr.length() + img.size_bytes());
+    out.resize(hdr.length() + img.size_bytes());
     std::memcpy(out.data(), hdr.data(), hdr.length());
-    std::memcpy(out.data() + hdr.length(), img.get_raw_handle(), img.size_bytes());
+    // 16 bits samples are stored big endian
+    if (img.bit_depth() == 16)
+        byteswap16(img.get_raw_handle(), out.data() + hdr.length(), img.size_bytes() / 2);
+    else
+        std::memcpy(out.data() + hdr.length(), img.get_raw_handle(), img.size_bytes());
+}
+
+
+
+namespace ivmg {
+
+//======================================================
+// DECODING
+//======================================================
+
+static inline bool is_space(uint8_t c) {
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+
+/**
+ * @brief Next whitespace separated token of a Netpbm header. Comments run from # to the end of the line
+ *
+ * @param pos where to start, left on the byte following the token
+ * @return the token, empty at the end of the data
+ */
+static std::string_view next_token(std::span<const uint8_t> data, size_t& pos) {
+	while (pos < data.size() && (is_space(data[pos]) || data[pos] == '#')) {
+		if (data[pos] == '#')
+			while (pos < data.size() && data[pos] != '\n')
+				pos++;
+		else
+			pos++;
+	}
+
+	const size_t start = pos;
+	while (pos < data.size() && !is_space(data[pos]))
+		pos++;
+
+	return { reinterpret_cast<const char*>(data.data()) + start, pos - start };
+}
+
+
+static std::optional<uint32_t> parse_number(std::string_view token) {
+	uint32_t val;
+	const auto [end, err] = std::from_chars(token.data(), token.data() + token.size(), val);
+
+	if (err != std::errc() || end != token.data() + token.size())
+		return std::nullopt;
+	return val;
+}
+
+
+// Rows of 8 and 16 bits Netpbm files are laid out as unfiltered PNG scanlines without palette or color key
+using ExpandFn = void (*)(const uint8_t* in, uint8_t* out, size_t first, size_t count, const PngColorInfo& info, uint8_t out_chan, uint8_t sample_size);
+
+static ExpandFn select_expand(uint8_t depth, uint8_t bit_depth) {
+	switch (depth * 100 + bit_depth) {
+		case 108: return expand_row<PNG_COLOR_TYPE::GSC, 8>;
+		case 116: return expand_row<PNG_COLOR_TYPE::GSC, 16>;
+		case 208: return expand_row<PNG_COLOR_TYPE::GSCA, 8>;
+		case 216: return expand_row<PNG_COLOR_TYPE::GSCA, 16>;
+		case 308: return expand_row<PNG_COLOR_TYPE::RGB, 8>;
+		case 316: return expand_row<PNG_COLOR_TYPE::RGB, 16>;
+		case 408: return expand_row<PNG_COLOR_TYPE::RGBA, 8>;
+		default:  return expand_row<PNG_COLOR_TYPE::RGBA, 16>;
+	}
+}
+
+static const PngColorInfo no_color_key {};
+
+
+bool PamDecoder::can_decode(std::span<const uint8_t> data) const {
+	return data.size() >= 3 && data[0] == 'P' && data[1] >= '5' && data[1] <= '7' && is_space(data[2]);
+}
+
+
+std::expected<ImageInfo, IVMG_DEC_ERR> PamDecoder::probe(std::span<const uint8_t> data) {
+	if (auto res = this->read_header(data); !res.has_value())
+		return std::unexpected(res.error());
+
+	return ImageInfo { width, height, depth, bit_depth, format };
+}
+
+
+std::expected<Image, IVMG_DEC_ERR> PamDecoder::decode(std::span<const uint8_t> data, const DecodeOptions& opts) {
+	if (auto res = this->read_header(data); !res.has_value())
+		return std::unexpected(res.error());
+	if (auto res = this->set_output(opts); !res.has_value())
+		return std::unexpected(res.error());
+
+	Image img (out_width, out_height, out_color, out_depth);
+	this->write_pixels(PixelView::of(img));
+	return img;
+}
+
+
+std::expected<Image, IVMG_DEC_ERR> PamDecoder::decode_shared(std::span<uint8_t> data, std::shared_ptr<void> owner, const DecodeOptions& opts) {
+	if (auto res = this->read_header(data); !res.has_value())
+		return std::unexpected(res.error());
+	if (auto res = this->set_output(opts); !res.has_value())
+		return std::unexpected(res.error());
+
+	// The file already holds the pixels of the image: 8 bits samples, or 16 bits ones on big endian hosts
+	uint8_t* pixels = data.data() + (raster.data() - data.data());
+	const bool whole = window.x == 0 && window.y == 0 && window.w == width && window.h == height && scale == 1;
+	const bool same_layout = out_color == this->native_color_type() && out_depth == bit_depth
+		&& (bit_depth == 8 || (std::endian::native == std::endian::big && reinterpret_cast<uintptr_t>(pixels) % 2 == 0));
+
+	if (whole && same_layout) {
+		Logger::log(LOG_LEVEL::INFO, "Viewing the {}x{} pixels of the {} file in place", width, height, format);
+		return Image::view(width, height, out_color, out_depth, pixels, std::move(owner));
+	}
+
+	Image img (out_width, out_height, out_color, out_depth);
+	this->write_pixels(PixelView::of(img));
+	return img;
+}
+
+
+std::expected<void, IVMG_DEC_ERR> PamDecoder::decode_into(std::span<const uint8_t> data, std::span<uint8_t> dst, size_t stride, PixelFormat fmt, const DecodeOptions& opts) {
+	if (bytes_per_pixel(fmt) == 0)
+		return std::unexpected(IVMG_DEC_ERR::UNSUPPORTED_PIXEL_FORMAT);
+
+	// 16 bits samples are written as uint16_t
+	const uint8_t sample_size = ivmg::bit_depth(fmt) / 8;
+	if (sample_size == 2 && (reinterpret_cast<uintptr_t>(dst.data()) % 2 != 0 || stride % 2 != 0)) {
+		Logger::log(LOG_LEVEL::ERROR, "16 bits pixels need 2 bytes aligned rows");
+		return std::unexpected(IVMG_DEC_ERR::UNSUPPORTED_PIXEL_FORMAT);
+	}
+
+	if (auto res = this->read_header(data); !res.has_value())
+		return std::unexpected(res.error());
+	if (auto res = this->set_output(opts); !res.has_value())
+		return std::unexpected(res.error());
+
+	// The last row does not need the padding of the stride
+	const size_t row_size = static_cast<size_t>(out_width) * bytes_per_pixel(fmt);
+	if (stride < row_size || dst.size() < stride * (out_height - 1) + row_size) {
+		Logger::log(LOG_LEVEL::ERROR, "Buffer of {} bytes with stride {} is too small for {}x{} pixels", dst.size(), stride, out_width, out_height);
+		return std::unexpected(IVMG_DEC_ERR::BUFFER_TOO_SMALL);
+	}
+
+	this->write_pixels(PixelView { dst.data(), stride, out_width, out_height, ivmg::channels(fmt), sample_size });
+	return {};
+}
+
+
+/**
+ * @brief Reads the header of P5, P6 and P7 files, up to the first byte of the pixels
+ */
+std::expected<void, IVMG_DEC_ERR> PamDecoder::read_header(std::span<const uint8_t> data) {
+	if (!this->can_decode(data))
+		return std::unexpected(IVMG_DEC_ERR::INVALID_HEADER);
+
+	size_t pos = 2;
+	std::optional<uint32_t> w, h, d, maxval;
+
+	if (data[1] != '7') {
+		// Width, height and maxval, then a single whitespace before the pixels
+		w = parse_number(next_token(data, pos));
+		h = parse_number(next_token(data, pos));
+		maxval = parse_number(next_token(data, pos));
+		d = (data[1] == '5') ? 1 : 3;
+		format = (data[1] == '5') ? "pgm" : "ppm";
+
+		if (pos >= data.size() || !is_space(data[pos]))
+			return std::unexpected(IVMG_DEC_ERR::INVALID_HEADER);
+	}
+	else {
+		// One field per line up to ENDHDR. TUPLTYPE only names the channels that DEPTH counts
+		format = "pam";
+
+		for (std::string_view key = next_token(data, pos); key != "ENDHDR"; key = next_token(data, pos)) {
+			if (key.empty()) {
+				Logger::log(LOG_LEVEL::ERROR, "PAM header without ENDHDR");
+				return std::unexpected(IVMG_DEC_ERR::INVALID_HEADER);
+			}
+
+			if (key == "WIDTH") w = parse_number(next_token(data, pos));
+			else if (key == "HEIGHT") h = parse_number(next_token(data, pos));
+			else if (key == "DEPTH") d = parse_number(next_token(data, pos));
+			else if (key == "MAXVAL") maxval = parse_number(next_token(data, pos));
+			else while (pos < data.size() && data[pos] != '\n') pos++;
+		}
+
+		if (pos >= data.size() || data[pos] != '\n')
+			return std::unexpected(IVMG_DEC_ERR::INVALID_HEADER);
+	}
+
+	if (!w || !h || !d || !maxval || *w == 0 || *h == 0 || *d == 0 || *d > 4 || (*maxval != 255 && *maxval != 65535)) {
+		Logger::log(LOG_LEVEL::ERROR, "Unsupported {} header: {}x{} pixels, depth {}, maxval {}", format, w.value_or(0), h.value_or(0), d.value_or(0), maxval.value_or(0));
+		return std::unexpected(IVMG_DEC_ERR::INVALID_HEADER);
+	}
+
+	width = *w;
+	height = *h;
+	depth = static_cast<uint8_t>(*d);
+	bit_depth = (*maxval == 255) ? 8 : 16;
+	raster = data.subspan(pos + 1);
+	return {};
+}
+
+
+/**
+ * @brief Sets the output layout from the options, once the pixels are known to be all there
+ */
+std::expected<void, IVMG_DEC_ERR> PamDecoder::set_output(const DecodeOptions& opts) {
+	const size_t pixel_size = depth * bit_depth / 8;
+	if (static_cast<uint64_t>(width) * height > raster.size() / pixel_size) {
+		Logger::log(LOG_LEVEL::ERROR, "{} data of {} bytes is too short for {}x{} pixels", format, raster.size(), width, height);
+		return std::unexpected(IVMG_DEC_ERR::CORRUPTED_DATA);
+	}
+
+	// Clip to the image, 64 bits to avoid overflows on x + w
+	const Rect roi = opts.roi.value_or(Rect { 0, 0, width, height });
+	const uint64_t x1 = std::min<uint64_t>(static_cast<uint64_t>(roi.x) + roi.w, width);
+	const uint64_t y1 = std::min<uint64_t>(static_cast<uint64_t>(roi.y) + roi.h, height);
+
+	if (x1 <= roi.x || y1 <= roi.y) {
+		Logger::log(LOG_LEVEL::ERROR, "Region {}x{}+{}+{} is outside of the {}x{} image", roi.w, roi.h, roi.x, roi.y, width, height);
+		return std::unexpected(IVMG_DEC_ERR::INVALID_REGION);
+	}
+
+	window = Rect { roi.x, roi.y, static_cast<uint32_t>(x1 - roi.x), static_cast<uint32_t>(y1 - roi.y) };
+	scale = std::bit_floor(std::clamp<uint8_t>(opts.scale, 1, 8));
+	out_width = (window.w + scale - 1) / scale;
+	out_height = (window.h + scale - 1) / scale;
+	out_color = opts.force_rgba ? ColorType::RGBA : this->native_color_type();
+	out_depth = (bit_depth == 16 && !opts.force_8bit) ? 16 : 8;
+	return {};
+}
+
+
+ColorType PamDecoder::native_color_type() const {
+	switch (depth) {
+		case 1:  return ColorType::GRAY;
+		case 2:  return ColorType::GRAYA;
+		case 3:  return ColorType::RGB;
+		default: return ColorType::RGBA;
+	}
+}
+
+
+void PamDecoder::write_pixels(const PixelView& out) {
+	const ExpandFn expand = select_expand(depth, bit_depth);
+	const size_t row_size = static_cast<size_t>(width) * depth * bit_depth / 8;
+
+	if (scale > 1) {
+		out_row.resize(static_cast<size_t>(window.w) * out.pixel_size());
+		box.reset(window.w, scale, 1, out.nb_chan, out.sample_size);
+	}
+
+	for (uint32_t wy = 0; wy < window.h; wy++) {
+		const uint8_t* row = raster.data() + (window.y + wy) * row_size;
+
+		if (scale == 1) {
+			expand(row, out.row(wy), window.x, window.w, no_color_key, out.nb_chan, out.sample_size);
+			continue;
+		}
+
+		expand(row, out_row.data(), window.x, window.w, no_color_key, out.nb_chan, out.sample_size);
+		box.add(out_row.data(), window.w, 0, 1, 0);
+
+		// The last block of rows may be shorter
+		if ((wy + 1) % scale == 0 || wy + 1 == window.h)
+			box.resolve(out.row(wy / scale), 0, wy % scale + 1);
+	}
+}
 
-    return out;
 }
@@ -1,7 +1,17 @@
 #pragma once
 
+#include <ivmg/codecs/decoder.hpp>
 #include <ivmg/codecs/encoder.hpp>
+#include <ivmg/core/image.hpp>
+#include <ivmg/core/rect.hpp>
+
+#include "common/box_accumulator.hpp"
+#include "common/pixel_view.hpp"
+
 #include <filesystem>
+#include <span>
+#include <string_view>
+#include <vector>
 
 namespace ivmg {
 
@@ -14,7 +24,51 @@ class PamEncoder: public Encoder {
 public:
 	inline PamEncoder() {};
 
-	std::vector<uint8_t> encode(const Image& img) override;
+	void encode(const Image& img, std::vector<uint8_t>& out, const EncodeOptions& opts) override;
+};
+
+
+
+/**
+ * @brief Decoder of binary Netpbm files: PGM (P5), PPM (P6) and PAM (P7), with MAXVAL 255 or 65535
+ *
+ * Pixels are stored as is after the header, 16 bits samples big endian. Whole 8 bits
+ * images decoded from a file come back as a view of the mapping, without any copy.
+ */
+class PamDecoder: public Decoder {
+private:
+	// File metadata
+	uint32_t width = 0;
+	uint32_t height = 0;
+	uint8_t depth = 0;						// Channels: gray, gray alpha, RGB or RGBA
+	uint8_t bit_depth = 8;					// 8 for MAXVAL 255, 16 for 65535
+	std::string_view format;				// "pgm", "ppm" or "pam"
+	std::span<const uint8_t> raster;		// Everything after the header
+
+	// Output
+	Rect window {};				// Part of the image to decode, roi clipped to the image
+	uint8_t scale = 1;
+	uint32_t out_width = 0;
+	uint32_t out_height = 0;
+	ColorType out_color = ColorType::RGBA;
+	uint8_t out_depth = 8;
+
+	// Scratch buffers, kept from one image to the next
+	std::vector<uint8_t> out_row;			// A row in the output layout, before downscaling
+	BoxAccumulator box;
+
+	std::expected<void, IVMG_DEC_ERR> read_header(std::span<const uint8_t> data);
+	std::expected<void, IVMG_DEC_ERR> set_output(const DecodeOptions& opts);
+	ColorType native_color_type() const;
+	void write_pixels(const PixelView& out);
+
+public:
+	PamDecoder() = default;
+	bool can_decode(std::span<const uint8_t> data) const override;
+	std::expected<ImageInfo, IVMG_DEC_ERR> probe(std::span<const uint8_t> data) override;
+	std::expected<Image, IVMG_DEC_ERR> decode(std::span<const uint8_t> data, const DecodeOptions& opts) override;
+	std::expected<void, IVMG_DEC_ERR> decode_into(std::span<const uint8_t> data, std::span<uint8_t> dst, size_t stride, PixelFormat fmt, const DecodeOptions& opts) override;
+	std::expected<Image, IVMG_DEC_ERR> decode_shared(std::span<uint8_t> data, std::shared_ptr<void> owner, const DecodeOptions& opts) override;
 };
 
 
@@ -0,0 +1,312 @@
+#include <ivmg/codecs/apng.hpp>
+#include <ivmg/core/image.hpp>
+#include <libdeflate.h>
+
+#include "png/png.hpp"
+#include "png/frame_diff.hpp"
+
+#include "../common/logger.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <limits>
+
+namespace ivmg {
+
+//======================================================
+// DECODING
+//======================================================
+
+/**
+ * @brief Alpha composites src over dst, straight alpha in the last channel, as the APNG specification defines it
+ */
+template <typename T>
+static void blend_over(const PixelView& src, const PixelView& dst) {
+    constexpr uint64_t max = std::numeric_limits<T>::max();
+    const size_t nb_chan = src.nb_chan;
+    const size_t alpha = nb_chan - 1;
+
+    for (size_t y = 0; y < src.height; y++) {
+        const T* s = reinterpret_cast<const T*>(src.row(y));
+        T* d = reinterpret_cast<T*>(dst.row(y));
+
+        for (size_t x = 0; x < src.width; x++, s += nb_chan, d += nb_chan) {
+            const uint64_t sa = s[alpha];
+
+            if (sa == max) {
+                std::copy_n(s, nb_chan, d);
+                continue;
+            }
+            if (sa == 0)
+                continue;
+
+            // Weights of the source and destination colors, scaled by max squared
+            const uint64_t src_weight = sa * max;
+            const uint64_t dst_weight = d[alpha] * (max - sa);
+            const uint64_t total = src_weight + dst_weight;
+
+            for (size_t c = 0; c < alpha; c++)
+                d[c] = static_cast<T>((s[c] * src_weight + d[c] * dst_weight + total / 2) / total);
+            d[alpha] = static_cast<T>((total + max / 2) / max);
+        }
+    }
+}
+
+
+ApngReader::ApngReader() : decoder(std::make_unique<PngDecoder>()), info {}, next(0) {}
+ApngReader::~ApngReader() = default;
+
+
+std::expected<ApngInfo, IVMG_DEC_ERR> ApngReader::open(std::span<const uint8_t> data, const DecodeOptions& opts) {
+    auto res = decoder->open_animation(data, opts);
+    if (!res.has_value())
+        return std::unexpected(res.error());
+
+    info = *res;
+
+    // The canvas memory is kept when the size and layout stay the same
+    const Image* img = canvas_img ? &*canvas_img : nullptr;
+    if (!img || img->width() != info.width || img->height() != info.height || img->color() != info.color || img->bit_depth() != info.bit_depth)
+        canvas_img.emplace(info.width, info.height, info.color, info.bit_depth);
+
+    // Animations start on a fully transparent black canvas
+    std::memset(canvas_img->get_raw_handle(), 0, canvas_img->size_bytes());
+
+    next = 0;
+    pending.reset();
+    return info;
+}
+
+
+std::expected<ApngFrame, IVMG_DEC_ERR> ApngReader::next_frame() {
+    if (!this->has_next_frame()) {
+        Logger::log(LOG_LEVEL::ERROR, "No frame left to decode");
+        return std::unexpected(IVMG_DEC_ERR::CORRUPTED_DATA);
+    }
+
+    if (pending)
+        this->dispose(*pending);
+
+    ApngFrame frame = decoder->frame(next);
+
+    // There is nothing before the first frame to go back to, its region is cleared instead
+    if (next == 0 && frame.dispose == ApngDispose::PREVIOUS)
+        frame.dispose = ApngDispose::BACKGROUND;
+
+    const PixelView region = PixelView::of(*canvas_img).crop(frame.region);
+    const size_t row_size = region.width * region.pixel_size();
+
+    if (frame.dispose == ApngDispose::PREVIOUS) {
+        saved.resize(region.height * row_size);
+        for (size_t y = 0; y < region.height; y++)
+            std::memcpy(saved.data() + y * row_size, region.row(y), row_size);
+    }
+
+    // Without alpha on the canvas blending is a plain copy: the frame is decoded in place
+    const bool has_alpha = info.color == ColorType::RGBA || info.color == ColorType::GRAYA;
+    bool ok;
+
+    if (frame.blend == ApngBlend::SOURCE || !has_alpha) {
+        ok = decoder->decode_frame(next, region);
+    }
+    else {
+        frame_pixels.resize(region.height * row_size);
+        const PixelView src { frame_pixels.data(), row_size, region.width, region.height, region.nb_chan, region.sample_size };
+        ok = decoder->decode_frame(next, src);
+
+        if (ok && region.sample_size == 2)
+            blend_over<uint16_t>(src, region);
+        else if (ok)
+            blend_over<uint8_t>(src, region);
+    }
+
+    if (!ok)
+        return std::unexpected(IVMG_DEC_ERR::CORRUPTED_DATA);
+
+    next++;
+    pending = frame;
+    return frame;
+}
+
+
+/**
+ * @brief Applies the dispose operation of a frame that has been shown
+ */
+void ApngReader::dispose(const ApngFrame& frame) {
+    const PixelView region = PixelView::of(*canvas_img).crop(frame.region);
+    const size_t row_size = region.width * region.pixel_size();
+
+    switch (frame.dispose) {
+        case ApngDispose::NONE:
+            break;
+
+        case ApngDispose::BACKGROUND:
+            for (size_t y = 0; y < region.height; y++)
+                std::memset(region.row(y), 0, row_size);
+            break;
+
+        case ApngDispose::PREVIOUS:
+            for (size_t y = 0; y < region.height; y++)
+                std::memcpy(region.row(y), saved.data() + y * row_size, row_size);
+            break;
+    }
+}
+
+
+
+//======================================================
+// ENCODING
+//======================================================
+
+// Sequence number, width, height, x, y, delay numerator and denominator, dispose and blend operations
+constexpr size_t fctl_size = 26;
+
+
+/**
+ * @brief Recomputes the CRC of a chunk of out whose data was changed in place
+ */
+static void rewrite_crc(std::vector<uint8_t>& out, size_t chunk_offset, size_t length) {
+    const uint8_t* type = out.data() + chunk_offset + 4;
+    store_be32(out.data() + chunk_offset + 8 + length, libdeflate_crc32(0, type, 4 + length));
+}
+
+
+static inline uint16_t load_be16(const uint8_t* src) {
+    return static_cast<uint16_t>((src[0] << 8) | src[1]);
+}
+
+
+static inline void store_be16(uint8_t* dst, uint16_t val) {
+    dst[0] = static_cast<uint8_t>(val >> 8);
+    dst[1] = static_cast<uint8_t>(val);
+}
+
+
+ApngWriter::ApngWriter()
+    : encoder(std::make_unique<PngEncoder>()), width(0), height(0), color(ColorType::RGBA), bit_depth(8),
+      nb_frames(0), sequence(0), actl_offset(0), last_fctl_offset(0) {}
+
+ApngWriter::~ApngWriter() = default;
+
+
+std::expected<void, IVMG_ENC_ERR> ApngWriter::add_frame(const Image& frame, uint16_t delay_num, uint16_t delay_den, const EncodeOptions& opts) {
+    const ConstPixelView pixels = ConstPixelView::of(frame);
+    Rect region { 0, 0, frame.width(), frame.height() };
+
+    if (nb_frames == 0) {
+        width = frame.width();
+        height = frame.height();
+        color = frame.color();
+        bit_depth = frame.bit_depth();
+        sequence = 0;
+
+        out.assign(magic, magic + magic_length);
+        PngEncoder::write_ihdr(out, width, height, frame.nb_chan(), bit_depth);
+
+        // Frame and play counts are only known at the end
+        actl_offset = out.size();
+        const std::array<uint8_t, 8> actl {};
+        PngEncoder::write_chunk(out, ChunkType::acTL, actl);
+    }
+    else {
+        if (frame.width() != width || frame.height() != height || frame.color() != color || frame.bit_depth() != bit_depth) {
+            Logger::log(LOG_LEVEL::ERROR, "Frame of {}x{} pixels does not match the {}x{} animation", frame.width(), frame.height(), width, height);
+            return std::unexpected(IVMG_ENC_ERR::INVALID_FRAME);
+        }
+
+        const ConstPixelView before { previous.data(), pixels.stride, width, height, pixels.nb_chan, pixels.sample_size };
+        region = changed_region(before, pixels);
+
+        if (region.w == 0) {
+            // Nothing changed: the previous frame stays on screen longer when both delays share a denominator
+            uint8_t* delay = out.data() + last_fctl_offset + 8 + 20;
+            const uint16_t last_num = load_be16(delay);
+            const uint16_t last_den = load_be16(delay + 2);
+
+            if ((last_den == 0 ? 100 : last_den) == (delay_den == 0 ? 100 : delay_den) && last_num + delay_num <= UINT16_MAX) {
+                store_be16(delay, last_num + delay_num);
+                rewrite_crc(out, last_fctl_offset, fctl_size);
+                return {};
+            }
+
+            // Frames cannot be empty, a single unchanged pixel stands for it
+            region = Rect { 0, 0, 1, 1 };
+        }
+    }
+
+    const size_t fctl_offset = out.size();
+    std::array<uint8_t, fctl_size> fctl {};
+    store_be32(fctl.data(), sequence++);
+    store_be32(fctl.data() + 4, region.w);
+    store_be32(fctl.data() + 8, region.h);
+    store_be32(fctl.data() + 12, region.x);
+    store_be32(fctl.data() + 16, region.y);
+    store_be16(fctl.data() + 20, delay_num);
+    store_be16(fctl.data() + 22, delay_den);
+    fctl[24] = static_cast<uint8_t>(ApngDispose::NONE);
+    fctl[25] = static_cast<uint8_t>(ApngBlend::SOURCE);
+    PngEncoder::write_chunk(out, ChunkType::fcTL, fctl);
+
+    // The region is compressed straight from the frame, its rows keep the stride of the full image
+    EncodeOptions frame_opts = opts;
+    frame_opts.png_idot = false;
+    encoder->deflate(pixels.crop(region), frame_opts);
+
+    // The first frame is the default image, the others carry a sequence number before their data
+    for (const std::vector<uint8_t>& part : encoder->zlib_stream()) {
+        const size_t max_data = (nb_frames == 0) ? max_chunk_length : max_chunk_length - 4;
+
+        for (size_t pos = 0; pos < part.size(); pos += max_data) {
+            const auto data = std::span<const uint8_t>(part.data() + pos, std::min(max_data, part.size() - pos));
+
+            if (nb_frames == 0) {
+                PngEncoder::write_chunk(out, ChunkType::IDAT, data);
+            }
+            else {
+                std::array<uint8_t, 4> seq;
+                store_be32(seq.data(), sequence++);
+                PngEncoder::write_chunk(out, ChunkType::fdAT, data, seq);
+            }
+        }
+    }
+
+    Logger::log(LOG_LEVEL::INFO, "APNG frame {}: region {}x{}+{}+{}", nb_frames, region.w, region.h, region.x, region.y);
+
+    previous.assign(frame.get_raw_handle(), frame.get_raw_handle() + frame.size_bytes());
+    last_fctl_offset = fctl_offset;
+    nb_frames++;
+    return {};
+}
+
+
+std::span<const uint8_t> ApngWriter::finish(uint32_t nb_plays) {
+    if (nb_frames == 0)
+        return {};
+
+    store_be32(out.data() + actl_offset + 8, nb_frames);
+    store_be32(out.data() + actl_offset + 12, nb_plays);
+    rewrite_crc(out, actl_offset, 8);
+
+    PngEncoder::write_chunk(out, ChunkType::IEND, {});
+
+    // The next frame starts a new animation
+    nb_frames = 0;
+    return out;
+}
+
+
+std::expected<void, IVMG_ENC_ERR> ApngWriter::save(const std::filesystem::path& path, uint32_t nb_plays) {
+    const std::span<const uint8_t> file = this->finish(nb_plays);
+
+    if (file.empty()) {
+        Logger::log(LOG_LEVEL::ERROR, "Animation without any frame");
+        return std::unexpected(IVMG_ENC_ERR::INVALID_FRAME);
+    }
+
+    std::ofstream outfile(path, std::ios::binary);
+    outfile.write(reinterpret_cast<const char*>(file.data()), file.size());
+    return {};
+}
+
+}
@@ -0,0 +1,335 @@
+#include <ivmg/core/image.hpp>
+#include <libdeflate.h>
+
+#include "png/png.hpp"
+#include "png/filter.hpp"
+
+#include "../common/byteswap.hpp"
+#include "../common/logger.hpp"
+#include "../common/parallel.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstring>
+
+namespace ivmg {
+
+void LibdeflateCompressorDeleter::operator()(libdeflate_compressor* c) const {
+    libdeflate_free_compressor(c);
+}
+
+
+/**
+ * @brief Appends a complete chunk: length, type, data and CRC
+ *
+ * @param prefix bytes written at the start of the data, like the sequence number of fdAT chunks
+ */
+void PngEncoder::write_chunk(std::vector<uint8_t>& out, ChunkType type, std::span<const uint8_t> data, std::span<const uint8_t> prefix) {
+    append_be32(out, prefix.size() + data.size());
+    const size_t type_idx = out.size();
+    append_be32(out, static_cast<uint32_t>(type));
+    out.insert(out.end(), prefix.begin(), prefix.end());
+    out.insert(out.end(), data.begin(), data.end());
+
+    // The CRC covers the type and the data
+    append_be32(out, libdeflate_crc32(0, out.data() + type_idx, out.size() - type_idx));
+}
+
+
+void PngEncoder::write_ihdr(std::vector<uint8_t>& out, uint32_t width, uint32_t height, uint8_t nb_chan, uint8_t bit_depth) {
+    static constexpr PNG_COLOR_TYPE color_types[] = { PNG_COLOR_TYPE::GSC, PNG_COLOR_TYPE::GSCA, PNG_COLOR_TYPE::RGB, PNG_COLOR_TYPE::RGBA };
+
+    std::array<uint8_t, 13> ihdr {};
+    store_be32(ihdr.data(), width);
+    store_be32(ihdr.data() + 4, height);
+    ihdr[8] = bit_depth;
+    ihdr[9] = static_cast<uint8_t>(color_types[nb_chan - 1]);
+    // Compression, filter and interlace methods stay at 0: deflate, adaptive filtering, no interlacing
+
+    write_chunk(out, ChunkType::IHDR, ihdr);
+}
+
+
+
+/**
+ * @brief Picks the filter of one scanline
+ *
+ * @param restricted true to only consider the filters that do not look at the previous row
+ */
+PNG_FILT_TYPE PngEncoder::select_filter(PngFilter mode, const uint8_t* row, const uint8_t* prev, size_t len, size_t bpp, bool restricted, FilterScratch& s) {
+    // NONE and SUB come first in both enums
+    const size_t nb_candidates = restricted ? 2 : 5;
+
+    if (mode == PngFilter::ADAPTIVE) {
+        const FilterCosts costs = filter_costs(row, prev, len, bpp);
+        return static_cast<PNG_FILT_TYPE>(std::min_element(costs.begin(), costs.begin() + nb_candidates) - costs.begin());
+    }
+
+    if (mode == PngFilter::BRUTE_FORCE) {
+        if (!s.trial_compressor)
+            s.trial_compressor.reset(libdeflate_alloc_compressor(trial_level));
+
+        const FilterKernels& kernels = select_filter_kernels(bpp);
+        const size_t bound = libdeflate_deflate_compress_bound(s.trial_compressor.get(), len);
+        s.trial.resize(len + bound);
+
+        size_t best_size = SIZE_MAX;
+        PNG_FILT_TYPE best = PNG_FILT_TYPE::NONE;
+
+        for (size_t f = 0; f < nb_candidates; f++) {
+            kernels[f](row, prev, s.trial.data(), len);
+            const size_t size = libdeflate_deflate_compress(s.trial_compressor.get(), s.trial.data(), len, s.trial.data() + len, bound);
+
+            if (size < best_size) {
+                best_size = size;
+                best = static_cast<PNG_FILT_TYPE>(f);
+            }
+        }
+
+        return best;
+    }
+
+    const PNG_FILT_TYPE filter = static_cast<PNG_FILT_TYPE>(mode);
+    return (restricted && filter >= PNG_FILT_TYPE::UP) ? PNG_FILT_TYPE::SUB : filter;
+}
+
+
+
+/**
+ * @brief Filters count rows from first into filtered, each preceded by its filter type byte
+ *
+ * @param independent true to start on a row that does not depend on the one before first
+ */
+void PngEncoder::filter_rows(const ConstPixelView& img, PngFilter mode, uint32_t first, uint32_t count, bool independent, FilterScratch& s) {
+    const size_t bpp = img.pixel_size();
+    const size_t row_size = img.width * bpp;
+    const FilterKernels& kernels = select_filter_kernels(bpp);
+
+    // Images hold 16 bits samples in native order, PNG wants them big endian
+    const bool wide = img.sample_size == 2;
+    if (wide)
+        s.ring.resize(2 * row_size);
+
+    auto raw_row = [&](uint32_t y) -> const uint8_t* {
+        const uint8_t* row = img.row(y);
+        if (!wide)
+            return row;
+
+        uint8_t* swapped = s.ring.data() + (y & 1) * row_size;
+        byteswap16(row, swapped, row_size / 2);
+        return swapped;
+    };
+
+    const uint8_t* prev = (first == 0) ? zero_line.data() : raw_row(first - 1);
+
+    for (uint32_t y = first; y < first + count; y++) {
+        const uint8_t* row = raw_row(y);
+        const PNG_FILT_TYPE type = this->select_filter(mode, row, prev, row_size, bpp, independent && y == first && first > 0, s);
+
+        uint8_t* line = filtered.data() + y * (row_size + 1);
+        line[0] = static_cast<uint8_t>(type);
+        kernels[static_cast<size_t>(type)](row, prev, line + 1, row_size);
+        prev = row;
+    }
+}
+
+
+
+/**
+ * @brief Filters and compresses the whole image in one go with libdeflate
+ */
+void PngEncoder::deflate_image(const ConstPixelView& img, PngFilter mode, int level) {
+    if (scratch.empty())
+        scratch.resize(1);
+
+    this->filter_rows(img, mode, 0, img.height, false, scratch[0]);
+
+    strips.resize(1);
+    std::vector<uint8_t>& deflated = strips[0];
+
+    if (fast) {
+        if (fast_deflaters.empty())
+            fast_deflaters.push_back(std::make_unique<FastDeflater>());
+
+        // zlib header declaring the fastest compression, the Adler-32 trailer comes from libdeflate
+        deflated.assign({ 0x78, 0x01 });
+        fast_deflaters[0]->compress(filtered, img.pixel_size(), img.width * img.pixel_size() + 1, true, deflated);
+        append_be32(deflated, libdeflate_adler32(1, filtered.data(), filtered.size()));
+        return;
+    }
+
+    if (!compressor || compressor_level != level) {
+        compressor.reset(libdeflate_alloc_compressor(level));
+        compressor_level = level;
+    }
+
+    // libdeflate writes the zlib header and the Adler-32 of the filtered data around the deflate stream
+    deflated.resize(libdeflate_zlib_compress_bound(compressor.get(), filtered.size()));
+    deflated.resize(libdeflate_zlib_compress(compressor.get(), filtered.data(), filtered.size(), deflated.data(), deflated.size()));
+}
+
+
+
+/**
+ * @brief Filters and compresses strips of strip_rows rows on every core, joined into a single zlib stream
+ *
+ * @param independent true to start every strip on a row that does not depend on the previous strip
+ * @return false if zlib failed on some strip
+ */
+bool PngEncoder::deflate_strips(const ConstPixelView& img, PngFilter mode, int level, bool independent) {
+    const size_t line_size = img.width * img.pixel_size() + 1;
+    const size_t nb_strips = (img.height + strip_rows - 1) / strip_rows;
+    const size_t nb_workers = parallel_workers(nb_strips);
+
+    while (deflaters.size() < nb_workers)
+        deflaters.push_back(std::make_unique<StripDeflater>());
+    while (fast && fast_deflaters.size() < nb_workers)
+        fast_deflaters.push_back(std::make_unique<FastDeflater>());
+
+    if (scratch.size() < nb_workers)
+        scratch.resize(nb_workers);
+
+    strips.resize(nb_strips);
+    strip_adlers.resize(nb_strips);
+
+    // zlib levels stop at 9, and FLEVEL in the zlib header is only informative
+    const int zlevel = std::min(level, 9);
+    const uint8_t cmf = 0x78;
+    const uint8_t flevel = (fast || zlevel < 2) ? 0 : (zlevel < 6) ? 1 : (zlevel == 6) ? 2 : 3;
+    const uint8_t flg = (flevel << 6) | (31 - ((cmf << 8) | (flevel << 6)) % 31);
+
+    std::atomic<bool> ok = true;
+
+    parallel_for(nb_strips, [&](size_t worker, size_t i) {
+        const uint32_t first = i * strip_rows;
+        const uint32_t count = std::min<uint32_t>(strip_rows, img.height - first);
+        // Decoders can only unfilter a strip on its own if its first row does not look at the previous strip
+        this->filter_rows(img, mode, first, count, independent, scratch[worker]);
+
+        const auto in = std::span<const uint8_t>(filtered).subspan(first * line_size, count * line_size);
+        strip_adlers[i] = libdeflate_adler32(1, in.data(), in.size());
+
+        std::vector<uint8_t>& strip = strips[i];
+        strip.clear();
+        if (i == 0)
+            strip.insert(strip.end(), { cmf, flg });
+
+        if (fast)
+            fast_deflaters[worker]->compress(in, img.pixel_size(), line_size, i + 1 == nb_strips, strip);
+        else if (!deflaters[worker]->compress(in, zlevel, i + 1 == nb_strips, strip))
+            ok = false;
+    });
+
+    if (!ok)
+        return false;
+
+    // zlib trailer: Adler-32 of the whole filtered data, combined from the ones of the strips
+    uLong adler = strip_adlers[0];
+    for (size_t i = 1; i < nb_strips; i++) {
+        const size_t count = std::min<size_t>(strip_rows, img.height - i * strip_rows);
+        adler = adler32_combine(adler, strip_adlers[i], static_cast<z_off_t>(count * line_size));
+    }
+    append_be32(strips.back(), adler);
+
+    return true;
+}
+
+
+
+/**
+ * @brief Appends an iDOT chunk listing the first IDAT chunk of every strip
+ *
+ * @return false if the file is too large for the 32 bits offsets, nothing is written then
+ */
+bool PngEncoder::write_idot(std::vector<uint8_t>& out, uint32_t height) {
+    // Segment count, then first row, row count and IDAT offset of every segment
+    idot.resize(4 + 12 * strips.size());
+    store_be32(idot.data(), strips.size());
+
+    // Offsets count from the start of the iDOT chunk itself, the IDAT chunks follow it
+    uint64_t offset = 12 + idot.size();
+
+    for (size_t i = 0; i < strips.size(); i++) {
+        const uint32_t first = i * strip_rows;
+        uint8_t* entry = idot.data() + 4 + 12 * i;
+        store_be32(entry, first);
+        store_be32(entry + 4, std::min(strip_rows, height - first));
+        store_be32(entry + 8, offset);
+
+        const size_t nb_chunks = (strips[i].size() + max_chunk_length - 1) / max_chunk_length;
+        offset += strips[i].size() + 12 * nb_chunks;
+    }
+
+    if (offset > UINT32_MAX) {
+        Logger::log(LOG_LEVEL::WARNING, "PNG too large for an iDOT chunk");
+        return false;
+    }
+
+    write_chunk(out, ChunkType::iDOT, idot);
+    return true;
+}
+
+
+
+void PngEncoder::deflate(const ConstPixelView& img, const EncodeOptions& opts) {
+    const int level = std::min<int>(opts.compression_level, 12);
+
+    // Stored blocks gain nothing from filtering
+    fast = opts.png_fast;
+    const PngFilter mode = fast ? fast_filter : (level == 0) ? PngFilter::NONE : opts.png_filter;
+
+    // Brute force compresses every candidate row alone, past level 6 the ranking barely changes
+    if (mode == PngFilter::BRUTE_FORCE && trial_level != std::min(level, 6)) {
+        trial_level = std::min(level, 6);
+        for (FilterScratch& s : scratch)
+            s.trial_compressor.reset();
+    }
+
+    const size_t line_size = img.width * img.pixel_size() + 1;
+    filtered.resize(line_size * img.height);
+    zero_line.assign(line_size - 1, 0);
+
+    // Large images are compressed in strips on every core. libdeflate alone beats zlib on a single one
+    strip_rows = std::clamp<size_t>(strip_size / line_size, 1, img.height);
+    const size_t nb_strips = (img.height + strip_rows - 1) / strip_rows;
+    const bool split = nb_strips > 1 && (parallel_workers(nb_strips) > 1 || opts.png_idot);
+
+    if (!split || !this->deflate_strips(img, mode, level, opts.png_idot))
+        this->deflate_image(img, mode, level);
+}
+
+
+
+void PngEncoder::encode(const Image& img, std::vector<uint8_t>& out, const EncodeOptions& opts) {
+    const auto start = std::chrono::high_resolution_clock::now();
+
+    this->deflate(ConstPixelView::of(img), opts);
+
+    // Signature, IHDR, iDOT, IEND and one IDAT header per chunk of data
+    size_t reserved = magic_length + 3 * 12 + 13 + 4 + 12 * strips.size();
+    for (const std::vector<uint8_t>& strip : strips)
+        reserved += strip.size() + 12 * ((strip.size() + max_chunk_length - 1) / max_chunk_length);
+
+    out.clear();
+    out.reserve(reserved);
+
+    out.insert(out.end(), magic, magic + magic_length);
+    write_ihdr(out, img.width(), img.height(), img.nb_chan(), img.bit_depth());
+
+    if (opts.png_idot && strips.size() > 1)
+        this->write_idot(out, img.height());
+
+    // Every strip starts its own IDAT chunk, where the iDOT offsets point
+    for (const std::vector<uint8_t>& strip : strips)
+        for (size_t pos = 0; pos < strip.size(); pos += max_chunk_length)
+            write_chunk(out, ChunkType::IDAT, std::span<const uint8_t>(strip.data() + pos, std::min<size_t>(max_chunk_length, strip.size() - pos)));
+
+    write_chunk(out, ChunkType::IEND, {});
+
+    const auto end = std::chrono::high_resolution_clock::now();
+    Logger::log(LOG_LEVEL::INFO, "Encoded PNG of size {}x{} at level {} in {} strips in {}, {} bytes", img.width(), img.height(), std::min<int>(opts.compression_level, 12), strips.size(), std::chrono::duration_cast<std::chrono::milliseconds>(end - start), out.size());
+}
+
+}
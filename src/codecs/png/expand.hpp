@@ -0,0 +1,233 @@
+#pragma once
+
+#include "png/png.hpp"
+#include "common/byteswap.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+namespace ivmg {
+
+/**
+ * @brief Compile time description of a PNG pixel layout
+ *
+ * @tparam CT the PNG color type
+ * @tparam BD the bit depth of one sample
+ */
+template <PNG_COLOR_TYPE CT, uint8_t BD>
+struct PngFormat {
+    static constexpr uint8_t channels =
+        (CT == PNG_COLOR_TYPE::RGBA) ? 4 :
+        (CT == PNG_COLOR_TYPE::RGB)  ? 3 :
+        (CT == PNG_COLOR_TYPE::GSCA) ? 2 : 1;
+
+    static constexpr size_t bits_per_pixel = channels * BD;
+
+    // Distance in bytes to the corresponding byte of the left pixel, as used by the filters
+    static constexpr size_t bpp = std::max<size_t>(1, bits_per_pixel / 8);
+};
+
+
+/**
+ * @brief Reads the i-th sample of an unfiltered scanline at its native bit depth
+ */
+template <uint8_t BD>
+inline uint16_t png_sample(const uint8_t* row, size_t i) {
+    if constexpr (BD == 16) {
+        return static_cast<uint16_t>(row[2 * i] << 8 | row[2 * i + 1]);
+    }
+    else if constexpr (BD == 8) {
+        return row[i];
+    }
+    else {
+        // Sub-byte samples are packed MSB first
+        constexpr uint8_t mask = (1 << BD) - 1;
+        const size_t bit = i * BD;
+        return (row[bit / 8] >> (8 - BD - bit % 8)) & mask;
+    }
+}
+
+
+/**
+ * @brief Scales a sample of the given bit depth to 8 bits
+ */
+template <uint8_t BD>
+inline uint8_t png_to_8bit(uint16_t v) {
+    if constexpr (BD == 16) return static_cast<uint8_t>(v >> 8);
+    else if constexpr (BD == 8) return static_cast<uint8_t>(v);
+    else return static_cast<uint8_t>(v * (255 / ((1 << BD) - 1)));
+}
+
+
+/**
+ * @brief Scales a sample of the given bit depth to the range of T, uint8_t or uint16_t
+ */
+template <typename T, uint8_t BD>
+inline T png_scale(uint16_t v) {
+    if constexpr (sizeof(T) == 1) return png_to_8bit<BD>(v);
+    else if constexpr (BD == 16) return v;
+    else return static_cast<uint16_t>(v * (65535 / ((1 << BD) - 1)));
+}
+
+
+/**
+ * @brief Reads the i-th pixel of an unfiltered scanline as RGBA with T samples
+ */
+template <PNG_COLOR_TYPE CT, uint8_t BD, typename T>
+inline std::array<T, 4> png_pixel(const uint8_t* in, size_t i, const PngColorInfo& info) {
+    constexpr uint8_t chans = PngFormat<CT, BD>::channels;
+    constexpr T opaque = static_cast<T>(~T(0));
+
+    if constexpr (CT == PNG_COLOR_TYPE::RGBA) {
+        return {
+            png_scale<T, BD>(png_sample<BD>(in, i * chans)),
+            png_scale<T, BD>(png_sample<BD>(in, i * chans + 1)),
+            png_scale<T, BD>(png_sample<BD>(in, i * chans + 2)),
+            png_scale<T, BD>(png_sample<BD>(in, i * chans + 3))
+        };
+    }
+    else if constexpr (CT == PNG_COLOR_TYPE::GSCA) {
+        const T g = png_scale<T, BD>(png_sample<BD>(in, i * chans));
+        return { g, g, g, png_scale<T, BD>(png_sample<BD>(in, i * chans + 1)) };
+    }
+    else if constexpr (CT == PNG_COLOR_TYPE::RGB) {
+        const uint16_t r = png_sample<BD>(in, i * 3);
+        const uint16_t g = png_sample<BD>(in, i * 3 + 1);
+        const uint16_t b = png_sample<BD>(in, i * 3 + 2);
+        const bool keyed = info.has_key && r == info.key[0] && g == info.key[1] && b == info.key[2];
+        return { png_scale<T, BD>(r), png_scale<T, BD>(g), png_scale<T, BD>(b), keyed ? T(0) : opaque };
+    }
+    else if constexpr (CT == PNG_COLOR_TYPE::GSC) {
+        const uint16_t v = png_sample<BD>(in, i);
+        const T g = png_scale<T, BD>(v);
+        return { g, g, g, (info.has_key && v == info.key[0]) ? T(0) : opaque };
+    }
+    else {
+        // Palette entries are 8 bits whatever the bit depth of the indices
+        const auto& entry = info.palette[png_sample<BD>(in, i)];
+        return { png_scale<T, 8>(entry[0]), png_scale<T, 8>(entry[1]), png_scale<T, 8>(entry[2]), png_scale<T, 8>(entry[3]) };
+    }
+}
+
+
+/**
+ * @brief Writes an RGBA pixel with the given number of channels: gray, gray alpha, RGB or RGBA
+ *
+ * @tparam GRAY_SRC true if r, g and b are known equal, which skips the luma computation
+ */
+template <uint8_t OUT_CH, bool GRAY_SRC, typename T>
+inline void store_pixel(T* out, const std::array<T, 4>& px) {
+    if constexpr (OUT_CH >= 3) {
+        out[0] = px[0];
+        out[1] = px[1];
+        out[2] = px[2];
+        if constexpr (OUT_CH == 4) out[3] = px[3];
+    }
+    else {
+        // BT.601 luma in fixed point, 8.8 for 8 bits samples and 16.16 for 16 bits ones
+        if constexpr (GRAY_SRC) out[0] = px[0];
+        else if constexpr (sizeof(T) == 1) out[0] = static_cast<T>((77 * px[0] + 150 * px[1] + 29 * px[2] + 128) >> 8);
+        else out[0] = static_cast<T>((19595u * px[0] + 38470u * px[1] + 7471u * px[2] + 32768u) >> 16);
+
+        if constexpr (OUT_CH == 2) out[1] = px[3];
+    }
+}
+
+
+/**
+ * @brief Converts part of an unfiltered scanline to 8 or 16 bits pixels
+ *
+ * @tparam CT the PNG color type of the scanline
+ * @tparam BD the bit depth of the scanline
+ * @tparam OUT_CH the number of channels of the output: 1 gray, 2 gray alpha, 3 RGB, 4 RGBA
+ * @tparam T the output sample type, uint8_t or uint16_t in native byte order
+ * @param in the unfiltered scanline, without the filter type byte
+ * @param out the output row, OUT_CH samples per pixel
+ * @param first the index of the first pixel of the scanline to convert
+ * @param count the number of pixels to convert
+ * @param info the palette and transparency information of the image
+ */
+template <PNG_COLOR_TYPE CT, uint8_t BD, uint8_t OUT_CH, typename T>
+void expand_row(const uint8_t* in, uint8_t* out, size_t first, size_t count, const PngColorInfo& info) {
+    constexpr bool gray_src = CT == PNG_COLOR_TYPE::GSC || CT == PNG_COLOR_TYPE::GSCA;
+    constexpr bool same_layout = CT != PNG_COLOR_TYPE::IDX && PngFormat<CT, BD>::channels == OUT_CH;
+
+    // Same layout on both sides: a plain copy, or a byte swap of the big endian samples.
+    // A color key only matters when the output has alpha
+    if constexpr (same_layout && BD == 8 && sizeof(T) == 1) {
+        std::memcpy(out, in + first * OUT_CH, count * OUT_CH);
+    }
+    else if constexpr (same_layout && BD == 16 && sizeof(T) == 2) {
+        byteswap16(in + first * OUT_CH * 2, out, count * OUT_CH);
+    }
+    else {
+        // Output rows of 16 bits samples are 2 bytes aligned, decode_into checks it for caller buffers
+        T* dst = reinterpret_cast<T*>(out);
+        for (size_t i = 0; i < count; i++)
+            store_pixel<OUT_CH, gray_src, T>(dst + i * OUT_CH, png_pixel<CT, BD, T>(in, first + i, info));
+    }
+}
+
+
+/**
+ * @brief Runtime dispatch of expand_row on the output layout, once per row
+ *
+ * @param out_chan the number of output channels
+ * @param sample_size the number of bytes per output sample, 1 or 2
+ */
+template <PNG_COLOR_TYPE CT, uint8_t BD>
+inline void expand_row(const uint8_t* in, uint8_t* out, size_t first, size_t count, const PngColorInfo& info, uint8_t out_chan, uint8_t sample_size) {
+    if (sample_size == 2) {
+        switch (out_chan) {
+            case 1:  expand_row<CT, BD, 1, uint16_t>(in, out, first, count, info); break;
+            case 2:  expand_row<CT, BD, 2, uint16_t>(in, out, first, count, info); break;
+            case 3:  expand_row<CT, BD, 3, uint16_t>(in, out, first, count, info); break;
+            default: expand_row<CT, BD, 4, uint16_t>(in, out, first, count, info); break;
+        }
+    }
+    else {
+        switch (out_chan) {
+            case 1:  expand_row<CT, BD, 1, uint8_t>(in, out, first, count, info); break;
+            case 2:  expand_row<CT, BD, 2, uint8_t>(in, out, first, count, info); break;
+            case 3:  expand_row<CT, BD, 3, uint8_t>(in, out, first, count, info); break;
+            default: expand_row<CT, BD, 4, uint8_t>(in, out, first, count, info); break;
+        }
+    }
+}
+
+
+
+/**
+ * @brief De-interlacing scatter: copies packed pixels to every step-th pixel of the output row
+ *
+ * @tparam PIXEL_SIZE the number of bytes per pixel
+ * @param src the packed pixels
+ * @param dst the first output pixel
+ * @param count the number of pixels to copy
+ * @param step the distance in pixels between two output pixels
+ */
+template <size_t PIXEL_SIZE>
+inline void scatter_pixels(const uint8_t* src, uint8_t* dst, size_t count, size_t step) {
+    const size_t stride = step * PIXEL_SIZE;
+
+    for (size_t i = 0; i < count; i++, src += PIXEL_SIZE, dst += stride)
+        std::memcpy(dst, src, PIXEL_SIZE);
+}
+
+
+/**
+ * @brief Runtime dispatch of scatter_pixels on the pixel size, once per row
+ */
+inline void scatter_pixels(const uint8_t* src, uint8_t* dst, size_t count, size_t step, uint8_t pixel_size) {
+    switch (pixel_size) {
+        case 1:  scatter_pixels<1>(src, dst, count, step); break;
+        case 2:  scatter_pixels<2>(src, dst, count, step); break;
+        case 3:  scatter_pixels<3>(src, dst, count, step); break;
+        case 4:  scatter_pixels<4>(src, dst, count, step); break;
+        case 6:  scatter_pixels<6>(src, dst, count, step); break;
+        default: scatter_pixels<8>(src, dst, count, step); break;
+    }
+}
+
+}
@@ -0,0 +1,778 @@
+#include "png/fast_deflater.hpp"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <immintrin.h>
+    #define IVMG_X86 1
+#endif
+
+namespace ivmg {
+
+//======================================================
+// DEFLATE CONSTANTS
+//======================================================
+
+constexpr size_t block_size = 1 << 18;        // Input bytes sharing the same Huffman tables
+constexpr size_t window_size = 32768;
+constexpr size_t min_match = 4;
+constexpr size_t max_match = 258;
+constexpr size_t max_stored = 65535;
+constexpr size_t far_match = 6;               // Shortest match taken from the hash table
+constexpr unsigned hash_bits = 14;
+constexpr size_t trial_size = 1 << 16;        // Input bytes parsed both ways to choose between them
+constexpr size_t trial_period = 8;            // Blocks parsed the way the last trial chose
+
+constexpr unsigned nb_litlen = 286;
+constexpr unsigned nb_dist = 30;
+constexpr unsigned nb_codelen = 19;
+constexpr unsigned end_of_block = 256;
+
+
+constexpr uint16_t length_base[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+constexpr uint8_t length_extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+constexpr uint16_t dist_base[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+constexpr uint8_t dist_extra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+// Order in which the code length code lengths are written
+constexpr uint8_t codelen_order[nb_codelen] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+// Length code index of every match length
+constexpr auto length_codes = [] {
+    std::array<uint8_t, max_match + 1> codes {};
+    for (uint8_t c = 0; c < 29; c++)
+        for (size_t len = length_base[c]; len < length_base[c] + (1u << length_extra[c]) && len <= max_match; len++)
+            codes[len] = c;
+    return codes;
+}();
+
+// Distance code of distances up to 256, then of (distance - 1) >> 7 above, as zlib does
+constexpr auto dist_codes = [] {
+    std::array<uint8_t, 512> codes {};
+    for (uint8_t c = 0; c < 30; c++) {
+        for (size_t d = dist_base[c]; d < dist_base[c] + (1u << dist_extra[c]); d++) {
+            if (d <= 256)
+                codes[d - 1] = c;
+            else
+                codes[256 + ((d - 1) >> 7)] = c;
+        }
+    }
+    return codes;
+}();
+
+static inline uint8_t dist_code(uint32_t dist) {
+    return (dist <= 256) ? dist_codes[dist - 1] : dist_codes[256 + ((dist - 1) >> 7)];
+}
+
+
+
+//======================================================
+// HUFFMAN CODES
+//======================================================
+
+/**
+ * @brief Code lengths of a length limited Huffman code for the given symbol counts.
+ *
+ * Optimal lengths first, then the longest codes are shortened and
+ * compensated for by lengthening others until the code is complete again,
+ * the way miniz enforces its limit.
+ */
+static void build_lengths(const uint32_t* freq, size_t n, unsigned max_bits, uint8_t* lengths) {
+    std::array<std::pair<uint32_t, uint16_t>, nb_litlen> leaves;
+    size_t nb_leaves = 0;
+
+    for (size_t s = 0; s < n; s++)
+        if (freq[s] > 0)
+            leaves[nb_leaves++] = { freq[s], static_cast<uint16_t>(s) };
+
+    std::fill(lengths, lengths + n, 0);
+
+    // Deflate wants at least two codes in a tree, unused ones are harmless
+    for (uint16_t s = 0; nb_leaves < 2; s++)
+        if (freq[s] == 0)
+            leaves[nb_leaves++] = { 1, s };
+
+    std::sort(leaves.begin(), leaves.begin() + nb_leaves);
+
+    // Two queues Huffman: leaves in increasing weight, internal nodes are created in increasing weight too
+    std::array<uint64_t, 2 * nb_litlen> weight;
+    std::array<uint16_t, 2 * nb_litlen> parent;
+    size_t next_leaf = 0, next_node = nb_leaves, nb_nodes = nb_leaves;
+
+    for (size_t i = 0; i < nb_leaves; i++)
+        weight[i] = leaves[i].first;
+
+    auto pop_smallest = [&] {
+        if (next_leaf < nb_leaves && (next_node == nb_nodes || weight[next_leaf] <= weight[next_node]))
+            return next_leaf++;
+        return next_node++;
+    };
+
+    while (nb_nodes < 2 * nb_leaves - 1) {
+        const size_t a = pop_smallest();
+        const size_t b = pop_smallest();
+        weight[nb_nodes] = weight[a] + weight[b];
+        parent[a] = parent[b] = static_cast<uint16_t>(nb_nodes);
+        nb_nodes++;
+    }
+
+    // Parents come after their children: depths from the root down
+    std::array<uint16_t, 2 * nb_litlen> depth;
+    depth[nb_nodes - 1] = 0;
+    std::array<uint32_t, 64> count {};
+
+    for (size_t i = nb_nodes - 1; i-- > 0;) {
+        depth[i] = depth[parent[i]] + 1;
+        if (i < nb_leaves)
+            count[std::min<unsigned>(depth[i], max_bits + 1)]++;
+    }
+
+    // Fold the codes over the limit into the longest allowed length, then fix the Kraft sum
+    for (unsigned len = max_bits + 1; len < count.size(); len++) {
+        count[max_bits] += count[len];
+        count[len] = 0;
+    }
+
+    uint64_t kraft = 0;
+    for (unsigned len = 1; len <= max_bits; len++)
+        kraft += static_cast<uint64_t>(count[len]) << (max_bits - len);
+
+    while (kraft > (1ull << max_bits)) {
+        count[max_bits]--;
+        for (unsigned len = max_bits - 1; len > 0; len--) {
+            if (count[len] > 0) {
+                count[len]--;
+                count[len + 1] += 2;
+                break;
+            }
+        }
+        kraft--;
+    }
+
+    // Rarest symbols get the longest codes
+    size_t leaf = 0;
+    for (unsigned len = max_bits; len > 0; len--)
+        for (uint32_t i = 0; i < count[len]; i++)
+            lengths[leaves[leaf++].second] = static_cast<uint8_t>(len);
+}
+
+
+/**
+ * @brief Canonical codes of the given lengths, bit reversed since deflate writes codes from their top bit
+ */
+static void build_codes(const uint8_t* lengths, size_t n, uint16_t* codes) {
+    std::array<uint16_t, 16> count {};
+    std::array<uint16_t, 16> next {};
+
+    for (size_t s = 0; s < n; s++)
+        count[lengths[s]]++;
+    count[0] = 0;
+
+    for (unsigned len = 1; len < 16; len++)
+        next[len] = (next[len - 1] + count[len - 1]) << 1;
+
+    for (size_t s = 0; s < n; s++) {
+        if (lengths[s] == 0)
+            continue;
+
+        uint16_t code = next[lengths[s]]++;
+        uint16_t reversed = 0;
+        for (unsigned b = 0; b < lengths[s]; b++, code >>= 1)
+            reversed = (reversed << 1) | (code & 1);
+        codes[s] = reversed;
+    }
+}
+
+
+
+//======================================================
+// BIT WRITER
+//======================================================
+
+/**
+ * @brief Writes bits from the least significant one, as deflate wants.
+ *
+ * Bits pile up in a 64 bits buffer and flush writes it whole, moving forward
+ * by the complete bytes only, so up to 56 bits can go in between two flushes.
+ * The destination needs 8 bytes of slack past the end of the data.
+ */
+class BitWriter {
+private:
+    uint8_t* out;
+    uint64_t buffer = 0;
+    unsigned nb_bits = 0;
+
+public:
+    explicit BitWriter(uint8_t* dst) : out(dst) {}
+
+    inline void put(uint64_t bits, unsigned n) {
+        buffer |= bits << nb_bits;
+        nb_bits += n;
+    }
+
+    inline void flush() {
+        uint64_t word = buffer;
+        if constexpr (std::endian::native == std::endian::big)
+            word = std::byteswap(word);
+        std::memcpy(out, &word, sizeof(word));
+        out += nb_bits >> 3;
+        buffer >>= nb_bits & ~7u;
+        nb_bits &= 7;
+    }
+
+    // Pads to a byte boundary and returns where the next byte goes
+    inline uint8_t* align() {
+        this->flush();
+        if (nb_bits > 0)
+            *out++ = static_cast<uint8_t>(buffer);
+        buffer = 0;
+        nb_bits = 0;
+        return out;
+    }
+
+    inline void skip_bytes(size_t n) {
+        out += n;
+    }
+};
+
+
+
+//======================================================
+// COMPRESSION
+//======================================================
+
+size_t FastDeflater::compress_bound(size_t len) {
+    // Stored blocks when the data does not compress, plus a sync flush and the bit writer slack
+    return len + 5 * (len / max_stored + len / block_size + 2) + 16;
+}
+
+
+static inline uint32_t load32(const uint8_t* p) {
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+
+// Length of the common prefix of a and b, up to limit bytes
+static inline size_t match_length(const uint8_t* a, const uint8_t* b, size_t limit) {
+    size_t len = 0;
+
+    while (len + 8 <= limit) {
+        uint64_t va, vb;
+        std::memcpy(&va, a + len, 8);
+        std::memcpy(&vb, b + len, 8);
+
+        if (va != vb) {
+            const uint64_t diff = va ^ vb;
+            return len + ((std::endian::native == std::endian::little) ? std::countr_zero(diff) : std::countl_zero(diff)) / 8;
+        }
+        len += 8;
+    }
+
+    while (len < limit && a[len] == b[len])
+        len++;
+
+    return len;
+}
+
+
+//======================================================
+// MATCH SCANNING
+//======================================================
+
+// First position from i where 4 bytes repeat dist or row bytes back, or end if there is none
+using ScanFn = size_t (*)(const uint8_t* data, size_t i, size_t end, size_t dist, size_t row);
+
+
+static size_t scan_scalar(const uint8_t* data, size_t i, size_t end, size_t dist, size_t row) {
+    for (; i + min_match <= end; i++) {
+        const uint32_t bytes = load32(data + i);
+        if (load32(data + i - dist) == bytes || load32(data + i - row) == bytes)
+            return i;
+    }
+    return end;
+}
+
+
+#ifdef IVMG_X86
+
+#define IVMG_TARGET_AVX2 __attribute__((target("avx2")))
+
+// 32 bytes compared at a time against both distances, which gives 29 positions where 4 equal bytes can start
+IVMG_TARGET_AVX2 static size_t scan_avx2(const uint8_t* data, size_t i, size_t end, size_t dist, size_t row) {
+    for (; i + 32 <= end; i += 29) {
+        const __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i - dist));
+        const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i - row));
+
+        const uint32_t eq_a = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, a)));
+        const uint32_t eq_b = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, b)));
+        const uint32_t starts = (eq_a & (eq_a >> 1) & (eq_a >> 2) & (eq_a >> 3)) | (eq_b & (eq_b >> 1) & (eq_b >> 2) & (eq_b >> 3));
+
+        if (starts != 0)
+            return i + std::countr_zero(starts);
+    }
+
+    return scan_scalar(data, i, end, dist, row);
+}
+
+#endif
+
+
+static ScanFn select_scan() {
+#ifdef IVMG_X86
+    if (__builtin_cpu_supports("avx2")) return scan_avx2;
+#endif
+    return scan_scalar;
+}
+
+
+// Scans from i, checking the distances against the start of the data until both are inside it
+static inline size_t next_match(ScanFn scan, const uint8_t* data, size_t i, size_t end, size_t dist, size_t row) {
+    for (; i < row && i + min_match <= end; i++) {
+        const uint32_t bytes = load32(data + i);
+        if (i >= dist && load32(data + i - dist) == bytes)
+            return i;
+    }
+
+    return scan(data, i, end, dist, row);
+}
+
+
+
+//======================================================
+// PARSING
+//======================================================
+
+/**
+ * @brief Adds the counts of the bytes of data to freq, spread over four tables
+ *
+ * Neighbouring bytes are often equal, and incrementing the same counter
+ * back to back waits on the previous store every time.
+ */
+static void count_bytes(const uint8_t* data, size_t n, std::array<std::array<uint32_t, 256>, 4>& freq) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        freq[0][data[i]]++;
+        freq[1][data[i + 1]]++;
+        freq[2][data[i + 2]]++;
+        freq[3][data[i + 3]]++;
+    }
+    for (; i < n; i++)
+        freq[0][data[i]]++;
+}
+
+
+/**
+ * @brief Records a sequence of the literals from literals to i followed by a match of len bytes d back
+ */
+inline void FastDeflater::add_sequence(Sequence*& seq, const uint8_t* data, size_t literals, size_t i, size_t len, size_t d) {
+    count_bytes(data + literals, i - literals, byte_freq);
+    lit_freq[257 + length_codes[len]]++;
+    dist_freq[dist_code(static_cast<uint32_t>(d))]++;
+    *seq++ = { static_cast<uint32_t>(i - literals), static_cast<uint16_t>(len), static_cast<uint16_t>(d) };
+}
+
+
+/**
+ * @brief Cuts bytes start to end into sequences of literals followed by a match
+ *
+ * Only two distances are tried: one pixel back, which turns the runs left
+ * by the filter into matches, and one row back, which catches rows
+ * repeating the one above. That is all photos have, and the scan skips
+ * over their literals many positions at a time.
+ */
+void FastDeflater::parse_runs(const uint8_t* data, size_t start, size_t end, size_t dist, size_t row) {
+    static const ScanFn scan = select_scan();
+    Sequence* seq = sequences.data();
+
+    size_t i = start, literals = start;
+    while (true) {
+        i = next_match(scan, data, i, end, dist, row);
+        if (i + min_match > end)
+            break;
+
+        const uint32_t bytes = load32(data + i);
+        const size_t d = (i >= dist && load32(data + i - dist) == bytes) ? dist : row;
+
+        const size_t limit = std::min(max_match, end - i);
+        const size_t len = min_match + match_length(data + i + min_match, data + i - d + min_match, limit - min_match);
+
+        this->add_sequence(seq, data, literals, i, len, d);
+        i += len;
+        literals = i;
+    }
+
+    // Matches need 4 bytes to compare, the last few bytes are literals whatever they are
+    count_bytes(data + literals, end - literals, byte_freq);
+    *seq++ = { static_cast<uint32_t>(end - literals), 0, 0 };
+    nb_sequences = static_cast<size_t>(seq - sequences.data());
+}
+
+
+// The first 6 bytes at p, in the low bits whatever the endianness
+static inline uint64_t load48(const uint8_t* p) {
+    uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    if constexpr (std::endian::native == std::endian::big)
+        v = std::byteswap(v);
+    return v & 0xFFFFFFFFFFFFull;
+}
+
+
+// Position last stored under the hash of the 6 bytes at i, which stores i instead
+static inline size_t probe(uint32_t* table, const uint8_t* data, size_t i) {
+    uint32_t& entry = table[(load48(data + i) * 0xCF1BBCDCB7A56463ull) >> (64 - hash_bits)];
+    const size_t candidate = entry;
+    entry = static_cast<uint32_t>(i);
+    return candidate;
+}
+
+
+/**
+ * @brief Same as parse_runs, plus a hash table of the positions seen, for matches anywhere in the window
+ *
+ * Flat images, screenshots and drawings, repeat the same glyphs and icons
+ * all over, far from the pixel to the left and the row above, and are
+ * mostly short matches back to back. Each match end is tried against the
+ * three, and only past a miss does the scan look for the next run, the
+ * hash table being probed on the way with longer and longer steps like
+ * LZ4 does. Far matches start at far_match bytes, their distances cost more bits.
+ */
+void FastDeflater::parse_hashed(const uint8_t* data, size_t start, size_t end, size_t dist, size_t row) {
+    static const ScanFn scan = select_scan();
+    Sequence* seq = sequences.data();
+    uint32_t* table = hash_table.data();
+
+    size_t i = start, literals = start;
+    size_t next = start;        // Next match dist or row back, valid while past i
+
+    // The hash reads 8 bytes, the last few are left as literals
+    while (i + 8 <= end) {
+        const uint32_t bytes = load32(data + i);
+        const size_t limit = std::min(max_match, end - i);
+        const size_t candidate = probe(table, data, i);
+        size_t len = 0, d = 0;
+
+        if (i >= dist && load32(data + i - dist) == bytes)
+            d = dist;
+        else if (i >= row && load32(data + i - row) == bytes)
+            d = row;
+        if (d != 0)
+            len = min_match + match_length(data + i + min_match, data + i - d + min_match, limit - min_match);
+
+        if (len < limit && i - candidate - 1 < window_size && load48(data + candidate) == load48(data + i)) {
+            const size_t far_len = far_match + match_length(data + i + far_match, data + candidate + far_match, limit - far_match);
+            if (far_len > len) {
+                len = far_len;
+                d = i - candidate;
+            }
+        }
+
+        if (len == 0) {
+            if (next <= i)
+                next = next_match(scan, data, i + 1, end, dist, row);
+
+            size_t misses = 0;
+            for (i++; i < next && i + 8 <= end; i += 1 + (misses++ >> 5)) {
+                const size_t far = probe(table, data, i);
+                if (i - far - 1 < window_size && load48(data + far) == load48(data + i)) {
+                    len = far_match + match_length(data + i + far_match, data + far + far_match, std::min(max_match, end - i) - far_match);
+                    d = i - far;
+                    break;
+                }
+            }
+
+            // Back to the top at the next run otherwise, the scan found it matches there
+            if (len == 0) {
+                i = next;
+                continue;
+            }
+        }
+
+        this->add_sequence(seq, data, literals, i, len, d);
+        i += len;
+        literals = i;
+
+        // What follows this match may well follow the same bytes elsewhere
+        if (i + 8 <= end)
+            probe(table, data, i - 2);
+    }
+
+    count_bytes(data + literals, end - literals, byte_freq);
+    *seq++ = { static_cast<uint32_t>(end - literals), 0, 0 };
+    nb_sequences = static_cast<size_t>(seq - sequences.data());
+}
+
+
+/**
+ * @brief Parses bytes start to end of in one way or the other, and counts their symbols
+ */
+void FastDeflater::parse_block(std::span<const uint8_t> in, size_t start, size_t end, size_t dist, size_t row, bool with_hash) {
+    for (auto& table : byte_freq)
+        table.fill(0);
+    lit_freq.fill(0);
+    dist_freq.fill(0);
+
+    // Without a row to look at, both distances are the pixel one
+    if (row == 0)
+        row = dist;
+
+    if (with_hash)
+        this->parse_hashed(in.data(), start, end, dist, row);
+    else
+        this->parse_runs(in.data(), start, end, dist, row);
+
+    for (unsigned b = 0; b < 256; b++)
+        lit_freq[b] = byte_freq[0][b] + byte_freq[1][b] + byte_freq[2][b] + byte_freq[3][b];
+    lit_freq[end_of_block] = 1;
+}
+
+
+/**
+ * @brief Bits the symbols of the last parse take with their Huffman codes, the tables left out
+ */
+uint64_t FastDeflater::symbol_bits() const {
+    std::array<uint8_t, nb_litlen> lit_len;
+    std::array<uint8_t, nb_dist> dist_len;
+    build_lengths(lit_freq.data(), nb_litlen, 15, lit_len.data());
+    build_lengths(dist_freq.data(), nb_dist, 15, dist_len.data());
+
+    uint64_t bits = 0;
+    for (unsigned s = 0; s < nb_litlen; s++)
+        bits += static_cast<uint64_t>(lit_freq[s]) * (lit_len[s] + ((s > end_of_block) ? length_extra[s - 257] : 0));
+    for (unsigned s = 0; s < nb_dist; s++)
+        bits += static_cast<uint64_t>(dist_freq[s]) * (dist_len[s] + dist_extra[s]);
+    return bits;
+}
+
+
+/**
+ * @brief Whether the hash table is worth its time on the input from start, judged on a sample of it
+ *
+ * Both parses of the sample are sized, and the hash table has to save an
+ * eighth of the bits, and a bit every eight bytes so that a mostly blank
+ * sample does not decide: photos gain a percent or two from it at half the
+ * speed, flat images lose half their size.
+ */
+bool FastDeflater::hash_pays_off(std::span<const uint8_t> in, size_t start, size_t dist, size_t row) {
+    const size_t end = std::min(in.size(), start + trial_size);
+
+    this->parse_block(in, start, end, dist, row, false);
+    const uint64_t runs_bits = this->symbol_bits();
+    this->parse_block(in, start, end, dist, row, true);
+    const uint64_t hashed_bits = this->symbol_bits();
+
+    // The sample is parsed again for real, where every position would find itself
+    for (uint32_t& entry : hash_table)
+        if (entry >= start)
+            entry = 0;
+
+    return runs_bits > hashed_bits && 8 * (runs_bits - hashed_bits) > std::max<uint64_t>(runs_bits, end - start);
+}
+
+
+void FastDeflater::compress(std::span<const uint8_t> in, size_t dist, size_t row, bool last, std::vector<uint8_t>& out) {
+    // At most one match every min_match bytes, and the trailing literals
+    sequences.resize(std::min(in.size(), block_size) / min_match + 1);
+
+    // Matches one row back are only worth it within the window
+    if (row > window_size)
+        row = 0;
+
+    // Positions are offsets in this input
+    hash_table.assign(1 << hash_bits, 0);
+    bool with_hash = false;
+
+    const size_t out_start = out.size();
+    out.resize(out_start + compress_bound(in.size()));
+    BitWriter bits(out.data() + out_start);
+
+    std::array<uint8_t, nb_litlen> lit_len;
+    std::array<uint8_t, nb_dist> dist_len;
+    std::array<uint16_t, nb_litlen> lit_codes;
+    std::array<uint16_t, nb_dist> dist_codes_;
+    std::array<uint8_t, nb_litlen + nb_dist> lengths;      // Both trees' code lengths, as written in the block header
+    std::array<uint16_t, nb_litlen + nb_dist> runs;        // Code length symbol in the low byte, its repeat count above
+    std::array<uint32_t, max_match + 1> length_bits;       // Code and extra bits of every match length, ready to write
+    std::array<uint8_t, max_match + 1> length_nb_bits;
+
+    // An empty input still needs a block, hence the do while
+    size_t start = 0, block = 0;
+    do {
+        const size_t end = std::min(in.size(), start + block_size);
+        const bool final_block = last && end == in.size();
+
+        // The content can change along the image, the choice is made again every few blocks
+        if (block++ % trial_period == 0)
+            with_hash = this->hash_pays_off(in, start, dist, row);
+        this->parse_block(in, start, end, dist, row, with_hash);
+
+        build_lengths(lit_freq.data(), nb_litlen, 15, lit_len.data());
+        build_lengths(dist_freq.data(), nb_dist, 15, dist_len.data());
+
+        unsigned hlit = nb_litlen, hdist = nb_dist;
+        while (hlit > 257 && lit_len[hlit - 1] == 0) hlit--;
+        while (hdist > 1 && dist_len[hdist - 1] == 0) hdist--;
+
+        std::copy_n(lit_len.begin(), hlit, lengths.begin());
+        std::copy_n(dist_len.begin(), hdist, lengths.begin() + hlit);
+        const size_t nb_lengths = hlit + hdist;
+
+        // Code lengths of both trees as one sequence, with the run length codes 16, 17 and 18
+        size_t nb_runs = 0;
+        std::array<uint32_t, nb_codelen> cl_freq {};
+
+        for (size_t k = 0; k < nb_lengths;) {
+            const uint8_t len = lengths[k];
+            size_t rep = 1;
+            while (k + rep < nb_lengths && lengths[k + rep] == len)
+                rep++;
+            k += rep;
+
+            if (len == 0) {
+                for (; rep >= 11; rep -= std::min<size_t>(rep, 138)) {
+                    runs[nb_runs++] = static_cast<uint16_t>(18 | (std::min<size_t>(rep, 138) - 11) << 8);
+                    cl_freq[18]++;
+                }
+                if (rep >= 3) {
+                    runs[nb_runs++] = static_cast<uint16_t>(17 | (rep - 3) << 8);
+                    cl_freq[17]++;
+                    rep = 0;
+                }
+            }
+            else {
+                runs[nb_runs++] = len;
+                cl_freq[len]++;
+                rep--;
+                for (; rep >= 3; rep -= std::min<size_t>(rep, 6)) {
+                    runs[nb_runs++] = static_cast<uint16_t>(16 | (std::min<size_t>(rep, 6) - 3) << 8);
+                    cl_freq[16]++;
+                }
+            }
+
+            for (; rep > 0; rep--) {
+                runs[nb_runs++] = len;
+                cl_freq[len]++;
+            }
+        }
+
+        std::array<uint8_t, nb_codelen> cl_len;
+        std::array<uint16_t, nb_codelen> cl_codes;
+        build_lengths(cl_freq.data(), nb_codelen, 7, cl_len.data());
+        build_codes(cl_len.data(), nb_codelen, cl_codes.data());
+
+        unsigned hclen = nb_codelen;
+        while (hclen > 4 && cl_len[codelen_order[hclen - 1]] == 0) hclen--;
+
+        // Size of the block with these tables, against storing the bytes as they are
+        uint64_t dynamic_bits = 3 + 5 + 5 + 4 + 3 * hclen;
+        for (size_t r = 0; r < nb_runs; r++) {
+            const uint8_t sym = runs[r] & 0xFF;
+            dynamic_bits += cl_len[sym] + ((sym == 16) ? 2 : (sym == 17) ? 3 : (sym == 18) ? 7 : 0);
+        }
+        for (unsigned s = 0; s < nb_litlen; s++)
+            dynamic_bits += static_cast<uint64_t>(lit_freq[s]) * (lit_len[s] + ((s > end_of_block) ? length_extra[s - 257] : 0));
+        for (unsigned s = 0; s < nb_dist; s++)
+            dynamic_bits += static_cast<uint64_t>(dist_freq[s]) * (dist_len[s] + dist_extra[s]);
+
+        const uint64_t stored_bits = 8 * ((end - start) + 5 * ((end - start + max_stored - 1) / max_stored) + 1);
+
+        if (dynamic_bits < stored_bits) {
+            build_codes(lit_len.data(), nb_litlen, lit_codes.data());
+            build_codes(dist_len.data(), nb_dist, dist_codes_.data());
+
+            for (size_t len = min_match; len <= max_match; len++) {
+                const uint8_t lc = length_codes[len];
+                length_bits[len] = lit_codes[257 + lc] | static_cast<uint32_t>(len - length_base[lc]) << lit_len[257 + lc];
+                length_nb_bits[len] = lit_len[257 + lc] + length_extra[lc];
+            }
+
+            bits.put(final_block ? 1 : 0, 1);
+            bits.put(2, 2);
+            bits.put(hlit - 257, 5);
+            bits.put(hdist - 1, 5);
+            bits.put(hclen - 4, 4);
+            bits.flush();
+            for (unsigned k = 0; k < hclen; k++) {
+                bits.put(cl_len[codelen_order[k]], 3);
+                bits.flush();
+            }
+
+            for (size_t r = 0; r < nb_runs; r++) {
+                const uint8_t sym = runs[r] & 0xFF;
+                bits.put(cl_codes[sym], cl_len[sym]);
+                if (sym >= 16)
+                    bits.put(runs[r] >> 8, (sym == 16) ? 2 : (sym == 17) ? 3 : 7);
+                bits.flush();
+            }
+
+            // Three literals or a match never take more than 48 bits: flushing after each is enough
+            const uint8_t* data = in.data() + start;
+            for (size_t k = 0; k < nb_sequences; k++) {
+                const Sequence& sq = sequences[k];
+                const uint8_t* lit = data;
+                const uint8_t* lit_end = data + sq.literals;
+
+                for (; lit + 3 <= lit_end; lit += 3) {
+                    bits.put(lit_codes[lit[0]], lit_len[lit[0]]);
+                    bits.put(lit_codes[lit[1]], lit_len[lit[1]]);
+                    bits.put(lit_codes[lit[2]], lit_len[lit[2]]);
+                    bits.flush();
+                }
+                for (; lit < lit_end; lit++)
+                    bits.put(lit_codes[*lit], lit_len[*lit]);
+                bits.flush();
+
+                if (sq.length > 0) {
+                    const uint8_t dc = dist_code(sq.distance);
+                    bits.put(length_bits[sq.length], length_nb_bits[sq.length]);
+                    bits.put(dist_codes_[dc] | static_cast<uint64_t>(sq.distance - dist_base[dc]) << dist_len[dc], dist_len[dc] + dist_extra[dc]);
+                    bits.flush();
+                }
+
+                data = lit_end + sq.length;
+            }
+
+            bits.put(lit_codes[end_of_block], lit_len[end_of_block]);
+            bits.flush();
+        }
+        else {
+            // Stored blocks of at most 65535 bytes, the last one carrying the final flag
+            for (size_t pos = start; pos < end || pos == start; pos += max_stored) {
+                const size_t len = std::min(max_stored, end - pos);
+                bits.put((final_block && pos + len == end) ? 1 : 0, 1);
+                bits.put(0, 2);
+
+                uint8_t* dst = bits.align();
+                const uint16_t nlen = static_cast<uint16_t>(~len);
+                const uint8_t header[4] = { static_cast<uint8_t>(len), static_cast<uint8_t>(len >> 8), static_cast<uint8_t>(nlen), static_cast<uint8_t>(nlen >> 8) };
+                std::memcpy(dst, header, 4);
+                std::memcpy(dst + 4, in.data() + pos, len);
+                bits.skip_bytes(4 + len);
+
+                if (len == 0)
+                    break;
+            }
+        }
+
+        start = end;
+    } while (start < in.size());
+
+    // Sync flush: an empty stored block leaves the stream byte aligned and open
+    if (!last) {
+        bits.put(0, 3);
+        uint8_t* dst = bits.align();
+        const uint8_t marker[4] = { 0x00, 0x00, 0xFF, 0xFF };
+        std::memcpy(dst, marker, 4);
+        bits.skip_bytes(4);
+    }
+
+    out.resize(bits.align() - out.data());
+}
+
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+namespace ivmg {
+
+/**
+ * @brief Deflate writer trading compression for speed, in the spirit of fpng.
+ *
+ * Matches are looked for one pixel to the left, which catches the runs left
+ * by PNG filters, and one row up. Flat images also get a hash table of the
+ * positions seen, when a trial parse every few blocks shows it pays off.
+ * Each block of input gets its own Huffman tables, built from the symbol
+ * counts of the parsing pass over it. The output is plain deflate any
+ * inflater reads.
+ */
+class FastDeflater {
+private:
+    // A run of literals, followed by a match unless length is 0
+    struct Sequence {
+        uint32_t literals;
+        uint16_t length;
+        uint16_t distance;
+    };
+
+    std::vector<Sequence> sequences;                    // Sequences of the current block
+    size_t nb_sequences = 0;
+    std::array<std::array<uint32_t, 256>, 4> byte_freq; // Literal counts of the current block, in four interleaved parts
+    std::array<uint32_t, 286> lit_freq;                 // Literal and length symbol counts of the current block
+    std::array<uint32_t, 30> dist_freq;                 // Distance symbol counts of the current block
+    std::vector<uint32_t> hash_table;                   // Last position of every hash of 6 bytes, for flat images
+
+public:
+    FastDeflater() = default;
+
+    /**
+     * @brief Upper bound of the compressed size of len bytes, sync flush included
+     */
+    static size_t compress_bound(size_t len);
+
+    /**
+     * @brief Compresses data into raw deflate blocks. Keeps the allocations from one call to the next.
+     *
+     * @param in the data to compress, matches never reach before it
+     * @param dist the distance of the runs to look for, the PNG pixel size
+     * @param row the distance to the same byte one row up, the filtered row size, or 0 to not look there
+     * @param last true to end on a final block, false to end on a sync flush so that more data can follow
+     * @param out receives the raw deflate data, appended after its current content
+     */
+    void compress(std::span<const uint8_t> in, size_t dist, size_t row, bool last, std::vector<uint8_t>& out);
+
+private:
+    void parse_block(std::span<const uint8_t> in, size_t start, size_t end, size_t dist, size_t row, bool with_hash);
+    void parse_runs(const uint8_t* data, size_t start, size_t end, size_t dist, size_t row);
+    void parse_hashed(const uint8_t* data, size_t start, size_t end, size_t dist, size_t row);
+    void add_sequence(Sequence*& seq, const uint8_t* data, size_t literals, size_t i, size_t len, size_t d);
+    uint64_t symbol_bits() const;
+    bool hash_pays_off(std::span<const uint8_t> in, size_t start, size_t dist, size_t row);
+};
+
+}
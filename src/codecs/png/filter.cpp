@@ -0,0 +1,210 @@
+#include "png/filter.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <immintrin.h>
+    #define IVMG_X86 1
+#endif
+
+namespace ivmg {
+
+// Branchless so that the paeth loop vectorizes like the others
+static inline uint8_t paeth_predictor(uint8_t a, uint8_t b, uint8_t c) {
+    const int16_t pa = std::abs(b - c);
+    const int16_t pb = std::abs(a - c);
+    const int16_t pc = std::abs(a + b - 2 * c);
+
+    const uint8_t bc = (pb <= pc) ? b : c;
+    return (pa <= pb && pa <= pc) ? a : bc;
+}
+
+
+static void filter_none(const uint8_t* row, const uint8_t*, uint8_t* out, size_t len) {
+    std::memcpy(out, row, len);
+}
+
+
+template <size_t BPP>
+static void filter_sub(const uint8_t* row, const uint8_t*, uint8_t* out, size_t len) {
+    for (size_t i = 0; i < BPP && i < len; i++)
+        out[i] = row[i];
+
+    for (size_t i = BPP; i < len; i++)
+        out[i] = row[i] - row[i - BPP];
+}
+
+
+static void filter_up(const uint8_t* row, const uint8_t* prev, uint8_t* out, size_t len) {
+    for (size_t i = 0; i < len; i++)
+        out[i] = row[i] - prev[i];
+}
+
+
+template <size_t BPP>
+static void filter_avg(const uint8_t* row, const uint8_t* prev, uint8_t* out, size_t len) {
+    for (size_t i = 0; i < BPP && i < len; i++)
+        out[i] = row[i] - (prev[i] >> 1);
+
+    for (size_t i = BPP; i < len; i++)
+        out[i] = row[i] - ((static_cast<uint16_t>(row[i - BPP]) + prev[i]) >> 1);
+}
+
+
+template <size_t BPP>
+static void filter_paeth(const uint8_t* row, const uint8_t* prev, uint8_t* out, size_t len) {
+    // With a = c = 0 the predictor always picks b
+    for (size_t i = 0; i < BPP && i < len; i++)
+        out[i] = row[i] - prev[i];
+
+    for (size_t i = BPP; i < len; i++)
+        out[i] = row[i] - paeth_predictor(row[i - BPP], prev[i], prev[i - BPP]);
+}
+
+
+template <size_t BPP>
+static constexpr FilterKernels kernels {
+    filter_none,
+    filter_sub<BPP>,
+    filter_up,
+    filter_avg<BPP>,
+    filter_paeth<BPP>
+};
+
+
+const FilterKernels& select_filter_kernels(size_t bpp) {
+    switch (bpp) {
+        case 2:  return kernels<2>;
+        case 3:  return kernels<3>;
+        case 4:  return kernels<4>;
+        case 6:  return kernels<6>;
+        case 8:  return kernels<8>;
+        default: return kernels<1>;
+    }
+}
+
+
+
+
+//======================================================
+// FILTER COSTS
+//======================================================
+
+// Absolute value of a filtered byte read as signed
+static inline uint8_t magnitude(uint8_t v) {
+    return (v < 128) ? v : 256 - v;
+}
+
+
+/**
+ * @brief Adds the costs of bytes start to len, once a full pixel to the left exists
+ */
+using FilterCostsFn = void (*)(const uint8_t* row, const uint8_t* prev, size_t start, size_t len, size_t bpp, FilterCosts& costs);
+
+
+static void filter_costs_scalar(const uint8_t* row, const uint8_t* prev, size_t start, size_t len, size_t bpp, FilterCosts& costs) {
+    for (size_t i = start; i < len; i++) {
+        const uint8_t x = row[i];
+        const uint8_t a = row[i - bpp];
+        const uint8_t b = prev[i];
+        const uint8_t c = prev[i - bpp];
+
+        costs[0] += magnitude(x);
+        costs[1] += magnitude(x - a);
+        costs[2] += magnitude(x - b);
+        costs[3] += magnitude(x - ((a + b) >> 1));
+        costs[4] += magnitude(x - paeth_predictor(a, b, c));
+    }
+}
+
+
+
+#ifdef IVMG_X86
+
+#define IVMG_TARGET_AVX2 __attribute__((target("avx2")))
+
+// Sums of the absolute values of the bytes of x - pred, in four 64 bits lanes
+IVMG_TARGET_AVX2 static inline __m256i sad_residuals(__m256i x, __m256i pred) {
+    return _mm256_sad_epu8(_mm256_abs_epi8(_mm256_sub_epi8(x, pred)), _mm256_setzero_si256());
+}
+
+
+// Paeth predictor on 16 bits lanes so that the distances cannot overflow
+IVMG_TARGET_AVX2 static inline __m256i paeth_epi16(__m256i a, __m256i b, __m256i c) {
+    const __m256i pa = _mm256_abs_epi16(_mm256_sub_epi16(b, c));
+    const __m256i pb = _mm256_abs_epi16(_mm256_sub_epi16(a, c));
+    const __m256i pc = _mm256_abs_epi16(_mm256_sub_epi16(_mm256_add_epi16(a, b), _mm256_add_epi16(c, c)));
+
+    const __m256i not_a = _mm256_or_si256(_mm256_cmpgt_epi16(pa, pb), _mm256_cmpgt_epi16(pa, pc));
+    const __m256i bc = _mm256_blendv_epi8(b, c, _mm256_cmpgt_epi16(pb, pc));
+    return _mm256_blendv_epi8(a, bc, not_a);
+}
+
+
+IVMG_TARGET_AVX2 static void filter_costs_avx2(const uint8_t* row, const uint8_t* prev, size_t start, size_t len, size_t bpp, FilterCosts& costs) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi8(1);
+    __m256i sums[5] = { zero, zero, zero, zero, zero };
+    size_t i = start;
+
+    for (; i + 32 <= len; i += 32) {
+        const __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + i));
+        const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + i - bpp));
+        const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(prev + i));
+        const __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(prev + i - bpp));
+
+        sums[0] = _mm256_add_epi64(sums[0], sad_residuals(x, zero));
+        sums[1] = _mm256_add_epi64(sums[1], sad_residuals(x, a));
+        sums[2] = _mm256_add_epi64(sums[2], sad_residuals(x, b));
+
+        // _mm256_avg_epu8 rounds up, PNG rounds down: remove the carried bit
+        const __m256i avg = _mm256_sub_epi8(_mm256_avg_epu8(a, b), _mm256_and_si256(_mm256_xor_si256(a, b), one));
+        sums[3] = _mm256_add_epi64(sums[3], sad_residuals(x, avg));
+
+        // Unpacking and packing within each 128 bits lane keeps the bytes in place
+        const __m256i lo = paeth_epi16(_mm256_unpacklo_epi8(a, zero), _mm256_unpacklo_epi8(b, zero), _mm256_unpacklo_epi8(c, zero));
+        const __m256i hi = paeth_epi16(_mm256_unpackhi_epi8(a, zero), _mm256_unpackhi_epi8(b, zero), _mm256_unpackhi_epi8(c, zero));
+        sums[4] = _mm256_add_epi64(sums[4], sad_residuals(x, _mm256_packus_epi16(lo, hi)));
+    }
+
+    for (size_t f = 0; f < costs.size(); f++) {
+        alignas(32) uint64_t lanes[4];
+        _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), sums[f]);
+        costs[f] += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+
+    filter_costs_scalar(row, prev, i, len, bpp, costs);
+}
+
+#endif
+
+
+static FilterCostsFn select_filter_costs() {
+#ifdef IVMG_X86
+    if (__builtin_cpu_supports("avx2")) return filter_costs_avx2;
+#endif
+    return filter_costs_scalar;
+}
+
+
+FilterCosts filter_costs(const uint8_t* row, const uint8_t* prev, size_t len, size_t bpp) {
+    static const FilterCostsFn fn = select_filter_costs();
+    FilterCosts costs {};
+
+    // First pixel: nothing on the left, a = c = 0
+    const size_t start = std::min(bpp, len);
+    for (size_t i = 0; i < start; i++) {
+        costs[0] += magnitude(row[i]);
+        costs[1] += magnitude(row[i]);
+        costs[2] += magnitude(row[i] - prev[i]);
+        costs[3] += magnitude(row[i] - (prev[i] >> 1));
+        costs[4] += magnitude(row[i] - prev[i]);
+    }
+
+    fn(row, prev, start, len, bpp, costs);
+    return costs;
+}
+
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace ivmg {
+
+/**
+ * @brief Filters one scanline for the encoder.
+ *
+ * @param row the raw bytes of the scanline
+ * @param prev the previous raw scanline. All zeros for the first scanline
+ * @param out where to write the filtered bytes, without the filter type byte
+ * @param len the number of bytes in the scanline
+ */
+using FilterFn = void (*)(const uint8_t* row, const uint8_t* prev, uint8_t* out, size_t len);
+
+
+/**
+ * @brief Filter kernels for a given pixel size, indexed by PNG filter type
+ */
+using FilterKernels = std::array<FilterFn, 5>;
+
+
+/**
+ * @brief Picks the filter kernels for the given pixel size.
+ *
+ * Filtering reads raw scanlines only, so unlike unfiltering every byte is
+ * independent and the loops are left to the compiler's vectorizer.
+ *
+ * @param bpp bytes per complete pixel, rounded up to 1 for bit depths below 8
+ * @return the kernel table, valid for the lifetime of the program
+ */
+const FilterKernels& select_filter_kernels(size_t bpp);
+
+
+/**
+ * @brief Cost of a scanline under every filter, indexed by PNG filter type
+ */
+using FilterCosts = std::array<uint64_t, 5>;
+
+
+/**
+ * @brief Sums the filtered bytes of a scanline, taken as signed, for all five filters in one pass.
+ *
+ * This is libpng's minimum sum of absolute differences heuristic: the filter
+ * giving the smallest sum usually compresses best. Uses AVX2 SAD instructions
+ * when the running CPU has them, with the same results.
+ *
+ * @param row the raw bytes of the scanline
+ * @param prev the previous raw scanline. All zeros for the first scanline
+ * @param len the number of bytes in the scanline
+ * @param bpp bytes per complete pixel, rounded up to 1 for bit depths below 8
+ * @return the cost of every filter
+ */
+FilterCosts filter_costs(const uint8_t* row, const uint8_t* prev, size_t len, size_t bpp);
+
+}
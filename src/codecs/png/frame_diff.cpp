@@ -0,0 +1,157 @@
+#include "png/frame_diff.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <immintrin.h>
+    #define IVMG_X86 1
+#endif
+
+namespace ivmg {
+
+/**
+ * @brief Finds where two byte ranges differ
+ *
+ * @param from, to the range to search, as offsets in a and b
+ * @return the offset of the first difference in [from, to), or to if there is none
+ */
+using FirstDiffFn = size_t (*)(const uint8_t* a, const uint8_t* b, size_t from, size_t to);
+
+// Same search from the end: one past the offset of the last difference in [from, to), or from if there is none
+using LastDiffFn = size_t (*)(const uint8_t* a, const uint8_t* b, size_t from, size_t to);
+
+
+static size_t first_diff_scalar(const uint8_t* a, const uint8_t* b, size_t from, size_t to) {
+    size_t i = from;
+
+    for (; i + 8 <= to; i += 8) {
+        uint64_t va, vb;
+        std::memcpy(&va, a + i, 8);
+        std::memcpy(&vb, b + i, 8);
+
+        if (va != vb) {
+            const uint64_t diff = va ^ vb;
+            return i + ((std::endian::native == std::endian::little) ? std::countr_zero(diff) : std::countl_zero(diff)) / 8;
+        }
+    }
+
+    while (i < to && a[i] == b[i])
+        i++;
+
+    return i;
+}
+
+
+static size_t last_diff_scalar(const uint8_t* a, const uint8_t* b, size_t from, size_t to) {
+    size_t i = to;
+
+    for (; i >= from + 8; i -= 8) {
+        uint64_t va, vb;
+        std::memcpy(&va, a + i - 8, 8);
+        std::memcpy(&vb, b + i - 8, 8);
+
+        if (va != vb) {
+            const uint64_t diff = va ^ vb;
+            return i - ((std::endian::native == std::endian::little) ? std::countl_zero(diff) : std::countr_zero(diff)) / 8;
+        }
+    }
+
+    while (i > from && a[i - 1] == b[i - 1])
+        i--;
+
+    return i;
+}
+
+
+#ifdef IVMG_X86
+
+#define IVMG_TARGET_AVX2 __attribute__((target("avx2")))
+
+// Bit i is set where byte i of a and b differ
+IVMG_TARGET_AVX2 static inline uint32_t diff_mask(const uint8_t* a, const uint8_t* b) {
+    const __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a));
+    const __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b));
+    return ~static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb)));
+}
+
+
+IVMG_TARGET_AVX2 static size_t first_diff_avx2(const uint8_t* a, const uint8_t* b, size_t from, size_t to) {
+    size_t i = from;
+
+    for (; i + 32 <= to; i += 32) {
+        if (const uint32_t mask = diff_mask(a + i, b + i); mask != 0)
+            return i + std::countr_zero(mask);
+    }
+
+    return first_diff_scalar(a, b, i, to);
+}
+
+
+IVMG_TARGET_AVX2 static size_t last_diff_avx2(const uint8_t* a, const uint8_t* b, size_t from, size_t to) {
+    size_t i = to;
+
+    for (; i >= from + 32; i -= 32) {
+        if (const uint32_t mask = diff_mask(a + i - 32, b + i - 32); mask != 0)
+            return i - std::countl_zero(mask);
+    }
+
+    return last_diff_scalar(a, b, from, i);
+}
+
+#endif
+
+
+static FirstDiffFn select_first_diff() {
+#ifdef IVMG_X86
+    if (__builtin_cpu_supports("avx2")) return first_diff_avx2;
+#endif
+    return first_diff_scalar;
+}
+
+
+static LastDiffFn select_last_diff() {
+#ifdef IVMG_X86
+    if (__builtin_cpu_supports("avx2")) return last_diff_avx2;
+#endif
+    return last_diff_scalar;
+}
+
+
+Rect changed_region(const ConstPixelView& a, const ConstPixelView& b) {
+    static const FirstDiffFn first_diff = select_first_diff();
+    static const LastDiffFn last_diff = select_last_diff();
+
+    const size_t pixel_size = a.pixel_size();
+    const size_t row_size = a.width * pixel_size;
+
+    // Box in bytes, right exclusive
+    size_t left = row_size, right = 0;
+    uint32_t top = a.height, bottom = 0;
+
+    for (uint32_t y = 0; y < a.height; y++) {
+        const uint8_t* row_a = a.row(y);
+        const uint8_t* row_b = b.row(y);
+
+        const size_t first = first_diff(row_a, row_b, 0, row_size);
+        if (first == row_size)
+            continue;
+
+        top = std::min(top, y);
+        bottom = y + 1;
+        left = std::min(left, first);
+
+        // The last difference only matters right of the box
+        right = std::max(right, last_diff(row_a, row_b, std::max(right, first), row_size));
+    }
+
+    if (top == a.height)
+        return Rect { 0, 0, 0, 0 };
+
+    const uint32_t x0 = static_cast<uint32_t>(left / pixel_size);
+    const uint32_t x1 = static_cast<uint32_t>((right + pixel_size - 1) / pixel_size);
+    return Rect { x0, top, x1 - x0, bottom - top };
+}
+
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <ivmg/core/rect.hpp>
+
+#include "common/pixel_view.hpp"
+
+namespace ivmg {
+
+/**
+ * @brief Bounding box of the pixels that differ between two images of the same size and layout.
+ *
+ * Rows are compared 32 bytes at a time with AVX2 when the running CPU has
+ * it. Once a row differs, only the bytes right of the box found so far are
+ * searched backwards for its last difference.
+ *
+ * @return the box, of width 0 when the images are identical
+ */
+Rect changed_region(const ConstPixelView& a, const ConstPixelView& b);
+
+}
@@ -0,0 +1,67 @@
+#include "png/idat_stream.hpp"
+
+#include "../common/logger.hpp"
+
+namespace ivmg {
+
+IdatStream::~IdatStream() {
+    if (initialized)
+        inflateEnd(&zs);
+}
+
+
+bool IdatStream::reset(std::span<const std::span<const uint8_t>> idat_chunks, bool raw_deflate) {
+    chunks = idat_chunks;
+    next_chunk = 0;
+
+    zs.next_in = nullptr;
+    zs.avail_in = 0;
+
+    // Negative window bits tell zlib there is no header nor trailer
+    const int window_bits = raw_deflate ? -MAX_WBITS : MAX_WBITS;
+
+    if (initialized) {
+        const bool same_format = raw == raw_deflate;
+        raw = raw_deflate;
+        return (same_format ? inflateReset(&zs) : inflateReset2(&zs, window_bits)) == Z_OK;
+    }
+
+    raw = raw_deflate;
+    initialized = inflateInit2(&zs, window_bits) == Z_OK;
+    return initialized;
+}
+
+
+bool IdatStream::read(std::span<uint8_t> out) {
+    zs.next_out = out.data();
+    zs.avail_out = static_cast<uInt>(out.size());
+
+    while (zs.avail_out > 0) {
+        if (zs.avail_in == 0) {
+            if (next_chunk == chunks.size()) {
+                Logger::log(LOG_LEVEL::ERROR, "IDAT stream ended {} bytes early", zs.avail_out);
+                return false;
+            }
+
+            // zlib does not write through next_in, the const_cast only matches its C API
+            zs.next_in = const_cast<Bytef*>(chunks[next_chunk].data());
+            zs.avail_in = static_cast<uInt>(chunks[next_chunk].size());
+            next_chunk++;
+            continue;
+        }
+
+        const int ret = inflate(&zs, Z_NO_FLUSH);
+
+        if (ret == Z_STREAM_END)
+            return zs.avail_out == 0;
+
+        if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            Logger::log(LOG_LEVEL::ERROR, "Inflate died with code {}", ret);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <zlib.h>
+
+#include <cstdint>
+#include <span>
+
+namespace ivmg {
+
+/**
+ * @brief Incremental zlib inflater reading across the data of consecutive IDAT chunks.
+ *
+ * Only the zlib window is kept in memory, the caller pulls the inflated
+ * bytes as it needs them, one scanline at a time.
+ */
+class IdatStream {
+private:
+    z_stream zs {};
+    bool initialized = false;
+    bool raw = false;
+    std::span<const std::span<const uint8_t>> chunks;
+    size_t next_chunk = 0;
+
+public:
+    IdatStream() = default;
+    ~IdatStream();
+
+    IdatStream(const IdatStream&) = delete;
+    IdatStream& operator=(const IdatStream&) = delete;
+
+    /**
+     * @brief Starts a new zlib stream over the given chunks. Keeps the inflater allocation.
+     *
+     * @param idat_chunks the data of every IDAT chunk, in file order. The list and the data must outlive the reads
+     * @param raw_deflate true if the data has no zlib header, as the segments of a flushed stream after the first
+     * @return true if the inflater is ready, false otherwise
+     */
+    bool reset(std::span<const std::span<const uint8_t>> idat_chunks, bool raw_deflate = false);
+
+    /**
+     * @brief Inflates exactly out.size() bytes
+     *
+     * @param out where to write the inflated bytes
+     * @return true if the buffer was filled, false if the stream is corrupted or too short
+     */
+    bool read(std::span<uint8_t> out);
+};
+
+}
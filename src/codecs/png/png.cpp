@@ -2,303 +2,592 @@
 #include <libdeflate.h>
 
 #include "png/png.hpp"
+#include "png/unfilter.hpp"
+#include "png/expand.hpp"
 
 #include "../common/logger.hpp"
 #include "../common/macros.hpp"
+#include "../common/parallel.hpp"
 #include "../common/utils.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <bit>
 #include <chrono>
-#include <optional>
 
 namespace ivmg {
 
-bool PngDecoder::can_decode(std::ifstream& filestream) const {
-    auto startpos = filestream.tellg();
-    char buffer[magic_length] = {0};
-    if (filestream.read(buffer, magic_length) && !filestream.fail() && std::memcmp(buffer, magic, magic_length) == 0) {
-        filestream.seekg(startpos);
-        return true;
+void LibdeflateDecompressorDeleter::operator()(libdeflate_decompressor* d) const {
+    libdeflate_free_decompressor(d);
+}
+
+
+/**
+ * @brief Reverses the filter of one scanline in place
+ *
+ * @param line the scanline, starting with its filter type byte
+ * @param up_line the previous scanline of the pass, already unfiltered, without its filter type byte
+ * @param len the size of the scanline without the filter type byte
+ * @return false if the filter type is invalid
+ */
+static bool unfilter_scanline(const UnfilterKernels& kernels, uint8_t* line, const uint8_t* up_line, size_t len) {
+    uint8_t *scanline = line + 1;
+
+    switch (static_cast<PNG_FILT_TYPE>(line[0])) {
+        case PNG_FILT_TYPE::NONE:  return true;
+        case PNG_FILT_TYPE::SUB:   kernels.sub(scanline, up_line, len); return true;
+        case PNG_FILT_TYPE::UP:    kernels.up(scanline, up_line, len); return true;
+        case PNG_FILT_TYPE::AVG:   kernels.avg(scanline, up_line, len); return true;
+        case PNG_FILT_TYPE::PAETH: kernels.paeth(scanline, up_line, len); return true;
+        default:                   return false;
     }
-    return false;
 }
 
 
-Image PngDecoder::decode(std::ifstream& filestream) {
-    filestream.seekg(0, std::ios_base::end);
+bool PngDecoder::can_decode(std::span<const uint8_t> data) const {
+    return data.size() >= magic_length && std::memcmp(data.data(), magic, magic_length) == 0;
+}
+
 
-    const size_t len = filestream.tellg();
-    filestream.seekg(magic_length);
+std::expected<Image, IVMG_DEC_ERR> PngDecoder::decode(std::span<const uint8_t> data, const DecodeOptions& opts) {
+    // Chunks are parsed as spans straight over the caller's buffer, usually the mapped file
+    if (auto res = this->decode_png(data.subspan(magic_length), opts); !res.has_value())
+        return std::unexpected(res.error());
 
-    std::vector<uint8_t> vbuffer;
-    vbuffer.resize(len - magic_length);
+    Image img (out_width, out_height, out_color, out_depth);
 
-    filestream.read(reinterpret_cast<char*>(vbuffer.data()), len - magic_length);
+    if (!this->write_pixels(PixelView::of(img)))
+        return std::unexpected(IVMG_DEC_ERR::CORRUPTED_DATA);
 
-    return this->decode_png(vbuffer);
+    return img;
 }
 
 
-Image PngDecoder::decode_png(std::vector<uint8_t>& file_buffer) {
+std::expected<void, IVMG_DEC_ERR> PngDecoder::decode_into(std::span<const uint8_t> data, std::span<uint8_t> dst, size_t stride, PixelFormat fmt, const DecodeOptions& opts) {
+    if (bytes_per_pixel(fmt) == 0)
+        return std::unexpected(IVMG_DEC_ERR::UNSUPPORTED_PIXEL_FORMAT);
+
+    // 16 bits samples are written as uint16_t
+    const uint8_t sample_size = ivmg::bit_depth(fmt) / 8;
+    if (sample_size == 2 && (reinterpret_cast<uintptr_t>(dst.data()) % 2 != 0 || stride % 2 != 0)) {
+        Logger::log(LOG_LEVEL::ERROR, "16 bits pixels need 2 bytes aligned rows");
+        return std::unexpected(IVMG_DEC_ERR::UNSUPPORTED_PIXEL_FORMAT);
+    }
+
+    if (auto res = this->decode_png(data.subspan(magic_length), opts); !res.has_value())
+        return std::unexpected(res.error());
+
+    // The last row does not need the padding of the stride
+    const size_t row_size = static_cast<size_t>(out_width) * bytes_per_pixel(fmt);
+    if (stride < row_size || dst.size() < stride * (out_height - 1) + row_size) {
+        Logger::log(LOG_LEVEL::ERROR, "Buffer of {} bytes with stride {} is too small for {}x{} pixels", dst.size(), stride, out_width, out_height);
+        return std::unexpected(IVMG_DEC_ERR::BUFFER_TOO_SMALL);
+    }
+
+    if (!this->write_pixels(PixelView { dst.data(), stride, out_width, out_height, channels(fmt), sample_size }))
+        return std::unexpected(IVMG_DEC_ERR::CORRUPTED_DATA);
+
+    return {};
+}
+
+
+std::expected<ImageInfo, IVMG_DEC_ERR> PngDecoder::probe(std::span<const uint8_t> data) {
+    // IHDR must be the first chunk: magic + length + type + 13 bytes of header
+    constexpr size_t ihdr_end = magic_length + 8 + 13;
+
+    if (data.size() < ihdr_end)
+        return std::unexpected(IVMG_DEC_ERR::CORRUPTED_DATA);
+
+    size_t idx {magic_length + 4};
+    if (static_cast<ChunkType>(read<uint32_t, std::endian::big>(data, idx)) != ChunkType::IHDR)
+        return std::unexpected(IVMG_DEC_ERR::INVALID_HEADER);
+
+    if (!this->decode_ihdr(data.subspan(idx, 13)))
+        return std::unexpected(IVMG_DEC_ERR::INVALID_HEADER);
+
+    return ImageInfo { width, height, channel_nb.at(color_type), bit_depth, "png" };
+}
+
+
+std::expected<void, IVMG_DEC_ERR> PngDecoder::read_chunks(std::span<const uint8_t> file_buffer, const DecodeOptions& opts) {
     // D(std::println("Decoding PNG");)
     Logger::log(LOG_LEVEL::INFO, "Decoding PNG of size {} bytes", file_buffer.size());
-    auto start = std::chrono::high_resolution_clock::now();
+    decode_start = std::chrono::high_resolution_clock::now();
 
     size_t pxl_idx {0};
     ChunkPNG chunk {};
 
-    std::vector<uint8_t> rawidat;
-    rawidat.reserve(file_buffer.size());
+    // IDAT chunks are never concatenated, the inflaters read straight from the file buffer
+    idat_chunks.clear();
+    idat_offsets.clear();
+    segments.clear();
+
+    animated = false;
+    frames.clear();
+
+    color_info.has_key = false;
+    color_info.has_alpha = false;
+    for (auto& entry : color_info.palette) entry = { 0, 0, 0, 255 };
 
     do {
+        // Every chunk has at least its length, type and CRC
+        if (pxl_idx + 12 > file_buffer.size())
+            return std::unexpected(IVMG_DEC_ERR::CORRUPTED_DATA);
+
+        const size_t chunk_offset = pxl_idx;
         chunk = this->read_chunk(file_buffer, pxl_idx);
 
         Logger::log(LOG_LEVEL::INFO, "Got chunk {:#x} of length {} bytes", static_cast<uint32_t>(chunk.type), chunk.length);
 
+        if (!check_crc(chunk, opts.crc_check))
+            return std::unexpected(IVMG_DEC_ERR::CRC_MISMATCH);
+
+        // IHDR comes first and only once, nothing is known about the image without it
+        if ((chunk_offset == 0) != (chunk.type == ChunkType::IHDR)) {
+            Logger::log(LOG_LEVEL::ERROR, "IHDR must be the first chunk and appear once, got {:#x} at offset {}", static_cast<uint32_t>(chunk.type), chunk_offset);
+            return std::unexpected(IVMG_DEC_ERR::INVALID_HEADER);
+        }
+
         switch (chunk.type) {
 
             case ChunkType::IHDR:
-                this->decode_ihdr(chunk.data);
+                if (!this->decode_ihdr(chunk.data))
+                    return std::unexpected(IVMG_DEC_ERR::INVALID_HEADER);
                 break;
 
             case ChunkType::PLTE:
+                this->decode_plte(chunk.data);
+                break;
+            case ChunkType::tRNS:
+                this->decode_trns(chunk.data);
                 break;
             case ChunkType::IDAT: {
-                rawidat.append_range(chunk.data);
+                idat_chunks.push_back(chunk.data);
+                idat_offsets.push_back(chunk_offset);
+
+                // An fcTL before the image data makes the default image the first frame
+                if (!frames.empty())
+                    frames.back().chunks.push_back(chunk.data);
                 break;
             }
+            case ChunkType::iDOT:
+                this->decode_idot(chunk.data, chunk_offset);
+                break;
+            case ChunkType::acTL:
+                if (!this->decode_actl(chunk.data))
+                    return std::unexpected(IVMG_DEC_ERR::INVALID_HEADER);
+                break;
+            case ChunkType::fcTL:
+                if (animated && !this->decode_fctl(chunk.data))
+                    return std::unexpected(IVMG_DEC_ERR::INVALID_HEADER);
+                break;
+            case ChunkType::fdAT:
+                if (animated && !this->decode_fdat(chunk.data))
+                    return std::unexpected(IVMG_DEC_ERR::CORRUPTED_DATA);
+                break;
             case ChunkType::IEND:
                 break;
 
         }
     } while (chunk.type != ChunkType::IEND);
 
-    libdeflate_decompressor *decompressor = libdeflate_alloc_decompressor();
+    return {};
+}
+
+
+
+std::expected<void, IVMG_DEC_ERR> PngDecoder::decode_png(std::span<const uint8_t> file_buffer, const DecodeOptions& opts) {
+    if (auto res = this->read_chunks(file_buffer, opts); !res.has_value())
+        return res;
+
+    nb_passes = (interlace_method == 1) ? std::clamp<uint8_t>(opts.adam7_passes, 1, adam7_passes.size()) : 1;
+    grid = (interlace_method == 1) ? adam7_grids[nb_passes - 1] : no_interlace_pass;
+
+    if (!this->set_window(opts.roi.value_or(Rect { 0, 0, width, height })))
+        return std::unexpected(IVMG_DEC_ERR::INVALID_REGION);
+
+    scale = std::bit_floor(std::clamp<uint8_t>(opts.scale, 1, 8));
+    out_width = (window.w + scale - 1) / scale;
+    out_height = (window.h + scale - 1) / scale;
+    out_color = opts.force_rgba ? ColorType::RGBA : this->native_color_type();
+    out_depth = (bit_depth == 16 && !opts.force_8bit) ? 16 : 8;
+
+    // Independent deflate segments are inflated on every core, anything unexpected falls back to a single inflater.
+    // On a single core libdeflate alone is faster than zlib on the segments
+    segmented = !opts.streaming && parallel_workers(segments.size()) > 1 && this->match_segments() && this->inflate_segments();
+
+    // A region of interest only needs the scanlines down to its bottom: pull them one by one
+    streaming = !segmented && (opts.streaming || opts.roi.has_value());
+
+    if (segmented) {
+        // Already inflated
+    }
+    else if (streaming) {
+        // Inflation happens scanline by scanline while reversing the filters
+        if (!idat_stream.reset(idat_chunks))
+            return std::unexpected(IVMG_DEC_ERR::CORRUPTED_DATA);
+    }
+    else if (!this->inflate_image()) {
+        return std::unexpected(IVMG_DEC_ERR::CORRUPTED_DATA);
+    }
+
+    return {};
+}
+
+
+
+/**
+ * @brief Inflates the zlib stream of idat_chunks into inflated_data in one go
+ */
+bool PngDecoder::inflate_image() {
+    if (idat_chunks.empty())
+        return false;
+
+    // A single IDAT is contiguous in the file and inflated without any copy. Split image data, the usual case,
+    // is copied together first: libdeflate on the copy is still much faster than zlib walking the chunks
+    std::span<const uint8_t> zlib_stream = idat_chunks[0];
+
+    if (idat_chunks.size() > 1) {
+        idat_joined.clear();
+        for (const std::span<const uint8_t> chunk : idat_chunks)
+            idat_joined.insert(idat_joined.end(), chunk.begin(), chunk.end());
+        zlib_stream = idat_joined;
+    }
+
+    inflated_data.resize(inflated_size);
+
+    if (!decompressor)
+        decompressor.reset(libdeflate_alloc_decompressor());
 
     libdeflate_result result = libdeflate_zlib_decompress(
-        decompressor,
-        rawidat.data(),
-        rawidat.size(),
+        decompressor.get(),
+        zlib_stream.data(),
+        zlib_stream.size(),
         inflated_data.data(),
         inflated_data.size(),
         nullptr
     );
 
     if (result != LIBDEFLATE_SUCCESS) {
-        std::println(std::cerr, "Deflate died");
-        exit(result);
+        Logger::log(LOG_LEVEL::ERROR, "Deflate died with code {}", static_cast<int>(result));
+        return false;
     }
 
-    libdeflate_free_decompressor(decompressor);
+    return true;
+}
 
-    // Reverse the filters
-    Image img (width, height);
 
-    D(
-        int n=0;
-        int s=0;
-        int u=0;
-        int a=0;
-        int p=0;
-    )
 
+std::expected<ApngInfo, IVMG_DEC_ERR> PngDecoder::open_animation(std::span<const uint8_t> data, const DecodeOptions& opts) {
+    if (!this->can_decode(data))
+        return std::unexpected(IVMG_DEC_ERR::UNKNOWN_FORMAT);
 
-    const size_t line_in_size = width * bpp + 1;     // Width of the image + 1 byte for the filter type
-    const size_t line_out_size = width * img.nb_chan();
+    if (auto res = this->read_chunks(data.subspan(magic_length), opts); !res.has_value())
+        return std::unexpected(res.error());
 
-    uint16_t line_id = 0;
+    // Still images play as a single frame, so do animations whose frames are all missing
+    if (frames.empty()) {
+        frames.push_back({ ApngFrame { Rect { 0, 0, width, height }, 0, 0, ApngDispose::NONE, ApngBlend::SOURCE }, idat_chunks });
+        nb_plays = 0;
+    }
 
-    std::span<const uint8_t> data_view(inflated_data);
-    auto res = get_scanline(data_view, line_in_size);
+    // Frames are always decoded whole, at full resolution
+    nb_passes = (interlace_method == 1) ? adam7_passes.size() : 1;
+    grid = no_interlace_pass;
+    scale = 1;
+    streaming = false;
+    segmented = false;
+    out_color = opts.force_rgba ? ColorType::RGBA : this->native_color_type();
+    out_depth = (bit_depth == 16 && !opts.force_8bit) ? 16 : 8;
 
-    const uint8_t in_out_chan_diff = img.nb_chan() - bpp;
+    return ApngInfo { width, height, out_color, out_depth, static_cast<uint32_t>(frames.size()), nb_plays };
+}
 
-    while (res.has_value()) {
-        std::span<const uint8_t> scanline = res.value();
 
-        PNG_FILT_TYPE filt = static_cast<PNG_FILT_TYPE>(scanline[0]);
-        scanline = scanline.subspan(1, scanline.size()-1);
 
-        uint8_t *start = img.get_raw_handle() + (line_id * line_out_size);
-        uint8_t *up_start = start - line_out_size;
-        uint8_t *end = start + line_out_size;
+/**
+ * @brief Decodes the pixels of one frame into out, which must have the size of its region
+ */
+bool PngDecoder::decode_frame(size_t index, const PixelView& out) {
+    const ApngFrameData& data = frames[index];
+    const uint32_t image_width = width;
+    const uint32_t image_height = height;
 
-        std::span<uint8_t> output_line(start, end);
-        std::span<const uint8_t> up_line(up_start, up_start + line_out_size);    // May contain garbage data for line_id = 0
+    // The frame is decoded as an image of its own, of the size of its region
+    width = data.frame.region.w;
+    height = data.frame.region.h;
+    window = Rect { 0, 0, width, height };
+    inflated_size = this->inflated_bytes(width, height);
+    idat_chunks.assign(data.chunks.begin(), data.chunks.end());
 
-        switch (filt) {
+    const bool ok = this->inflate_image() && this->write_pixels(out);
 
-        case PNG_FILT_TYPE::NONE: {
-            D(n++;)
+    width = image_width;
+    height = image_height;
+    return ok;
+}
 
-            switch (color_type) {
-                case PNG_COLOR_TYPE::RGBA: {
-                    std::memcpy(output_line.data(), scanline.data(), scanline.size());
-                    break;
-                }
 
-                case PNG_COLOR_TYPE::RGB: {
 
-                    for (size_t i = 0; i < scanline.size(); i += bpp) {
-                        const auto ipxl = (i / bpp) * (bpp + in_out_chan_diff);
-                        std::memcpy(output_line.data() + ipxl, scanline.data() + i, bpp);
-                    }
-                    break;
-                }
+bool PngDecoder::write_pixels(const PixelView& out) {
+    // Reverse the filters
+    const ScanlineDecoder decode_scanlines = this->select_scanline_decoder();
+    if (!(this->*decode_scanlines)(out))
+        return false;
 
-                default:
-                    break;
-            }
-            break;
-        }
+    auto end = std::chrono::high_resolution_clock::now();
+    Logger::log(LOG_LEVEL::INFO, "Decoded PNG of size {}x{} in {}", out.width, out.height, std::chrono::duration_cast<std::chrono::milliseconds>(end - decode_start));
+    return true;
+}
 
-        case PNG_FILT_TYPE::SUB: {
-            D(s++;)
 
-            switch (color_type) {
 
-                case PNG_COLOR_TYPE::RGBA:
-                case PNG_COLOR_TYPE::RGB: {
+template <PNG_COLOR_TYPE CT, uint8_t BD>
+bool PngDecoder::decode_scanlines(const PixelView& out) {
+    using Fmt = PngFormat<CT, BD>;
 
-                    for (size_t i = 0; i < scanline.size(); i++) {
-                        const auto dest = i + (i / bpp) * in_out_chan_diff;
-                        const uint8_t left = (i < bpp) ? 0 : output_line[dest - img.nb_chan()];
-                        output_line[dest] = left + scanline[i];
-                    }
+    // The box filter accumulates rows in order, scaled images only get the parallel inflation
+    if (segmented && scale == 1)
+        return this->decode_segments<CT, BD>(out);
 
-                    break;
-                }
+    D(int filt_count[5] {};)
 
-                default:
-                    break;
-            }
+    const UnfilterKernels& kernels = select_unfilter_kernels(Fmt::bpp);
 
-            break;
-        }
+    const size_t max_line_in_size = (width * Fmt::bits_per_pixel + 7) / 8 + 1;
+    zero_line.assign(max_line_in_size - 1, 0);
+    pass_line.resize(window.w * out.pixel_size());
+
+    // Passes revisit rows already seen: interlaced images keep the sums of every block until the end
+    const bool interlaced = nb_passes > 1;
+    if (scale > 1)
+        box.reset(window.w, scale, interlaced ? out.height : 1, out.nb_chan, out.sample_size);
+
+    uint8_t *next_line = inflated_data.data();
+    if (streaming)
+        line_ring.resize(2 * max_line_in_size);
+
+    const std::span<const Adam7Pass> image_passes = this->passes();
+
+    for (const Adam7Pass& pass : image_passes) {
+        const size_t pass_width = pass_extent(width, pass.x0, pass.dx);
+        const size_t pass_height = pass_extent(height, pass.y0, pass.dy);
+
+        // Empty passes have no scanline at all, not even filter bytes
+        if (pass_width == 0 || pass_height == 0)
+            continue;
+
+        const size_t line_in_size = (pass_width * Fmt::bits_per_pixel + 7) / 8 + 1;     // Width of the pass + 1 byte for the filter type
+        const bool last_pass = &pass == &image_passes.back();
 
-        case PNG_FILT_TYPE::UP: {
-            D(u++;)
+        // Where the pixels of the pass land on the grid, and which of them are inside the window
+        const size_t grid_x0 = pass.x0 / grid.dx;
+        const size_t out_step = pass.dx / grid.dx;
+        const size_t first = (window.x > grid_x0) ? (window.x - grid_x0 + out_step - 1) / out_step : 0;
+        const size_t end = (window.x + window.w > grid_x0) ? std::min(pass_width, (window.x + window.w - grid_x0 + out_step - 1) / out_step) : 0;
+        const size_t count = (end > first) ? end - first : 0;
+        const size_t out_x = grid_x0 + first * out_step - window.x;
 
-            switch (color_type) {
+        // Scanlines are reconstructed in place, the previous one is then already unfiltered
+        const uint8_t *up_line = zero_line.data();
 
-                case PNG_COLOR_TYPE::RGBA: {
+        for (size_t line_id = 0; line_id < pass_height; line_id++) {
+            const size_t grid_y = (pass.y0 + line_id * pass.dy) / grid.dy;
 
-                    if (line_id == 0) {
-                        std::memcpy(output_line.data(), scanline.data(), scanline.size());
-                    }
-                    else {
-                        for (size_t i = 0; i < output_line.size(); i++) {
-                            output_line[i] = up_line[i] + scanline[i];
-                        }
-                    }
-                    break;
-                }
+            // Nothing left to output: the rest of the stream is not even inflated
+            if (last_pass && grid_y >= window.y + window.h)
+                break;
 
-                default:
-                    break;
+            uint8_t *line = next_line;
 
+            if (streaming) {
+                line = line_ring.data() + (line_id % 2) * max_line_in_size;
+                if (!idat_stream.read(std::span(line, line_in_size)))
+                    return false;
+            }
+            else {
+                next_line += line_in_size;
             }
 
-            break;
-        }
+            if (!unfilter_scanline(kernels, line, up_line, line_in_size - 1)) {
+                Logger::log(LOG_LEVEL::ERROR, "Invalid filter type {} on scanline {}", line[0], line_id);
+                return false;
+            }
+
+            D(filt_count[line[0]]++;)
 
-        case PNG_FILT_TYPE::AVG: {
-            D(a++;)
+            uint8_t *scanline = line + 1;
+            up_line = scanline;
 
-            switch (color_type) {
+            // Rows above the window still had to be unfiltered for the ones below
+            if (grid_y < window.y || grid_y >= window.y + window.h || count == 0)
+                continue;
 
-                case PNG_COLOR_TYPE::RGBA: {
+            const size_t out_y = grid_y - window.y;
 
-                    for (size_t i = 0; i < output_line.size(); i++) {
-                        const uint16_t left = (i < bpp) ? 0 : output_line[i - img.nb_chan()];
-                        const uint16_t up = (line_id == 0) ? 0 : up_line[i];
-                        output_line[i] = scanline[i] + ((left + up) >> 1);
-                    }
+            if (scale > 1) {
+                expand_row<CT, BD>(scanline, pass_line.data(), first, count, color_info, out.nb_chan, out.sample_size);
+                box.add(pass_line.data(), count, out_x, out_step, interlaced ? out_y / scale : 0);
 
-                    break;
-                }
+                // Last row of a block, or of the window
+                if (!interlaced && ((out_y + 1) % scale == 0 || out_y + 1 == window.h))
+                    box.resolve(out.row(out_y / scale), 0, out_y % scale + 1);
 
-                default:
-                    break;
+                continue;
             }
-            break;
-        }
 
+            uint8_t *output_line = out.row(out_y) + out_x * out.pixel_size();
 
-        case PNG_FILT_TYPE::PAETH: {
-            D(p++;)
+            // Pixels of the pass are contiguous in the output when there are no holes between them
+            if (out_step == 1) {
+                expand_row<CT, BD>(scanline, output_line, first, count, color_info, out.nb_chan, out.sample_size);
+            }
+            else {
+                expand_row<CT, BD>(scanline, pass_line.data(), first, count, color_info, out.nb_chan, out.sample_size);
+                scatter_pixels(pass_line.data(), output_line, count, out_step, out.pixel_size());
+            }
+        }
+    }
+
+    if (scale > 1 && interlaced) {
+        for (size_t row = 0; row < out.height; row++)
+            box.resolve(out.row(row), row, std::min<size_t>(scale, window.h - row * scale));
+    }
 
-            switch (color_type) {
+    D(Logger::log(LOG_LEVEL::INFO, "Filter count - {} NONE - {} SUB - {} UP - {} AVG - {} PAETH", filt_count[0], filt_count[1], filt_count[2], filt_count[3], filt_count[4]);)
+    return true;
+}
 
-                case PNG_COLOR_TYPE::RGBA: {
 
-                    for (size_t i = 0; i < output_line.size(); i++) {
-                        const bool first_pixel = i < bpp;
-                        const bool first_scanline = line_id == 0;
 
-                        const uint8_t left = first_pixel ? 0 : output_line[i - img.nb_chan()];
-                        const uint8_t up = first_scanline ? 0 : up_line[i];
-                        const uint8_t upleft = (first_pixel || first_scanline) ? 0 : up_line[i - img.nb_chan()];
+template <PNG_COLOR_TYPE CT, uint8_t BD>
+bool PngDecoder::decode_segments(const PixelView& out) {
+    using Fmt = PngFormat<CT, BD>;
 
-                        output_line[i] = this->paeth_predictor(left, up, upleft) + scanline[i];
-                    }
+    const UnfilterKernels& kernels = select_unfilter_kernels(Fmt::bpp);
 
-                    break;
-                }
-                case PNG_COLOR_TYPE::RGB: {
+    const size_t line_in_size = (width * Fmt::bits_per_pixel + 7) / 8 + 1;
+    const size_t window_end = window.y + window.h;
+    zero_line.assign(line_in_size - 1, 0);
 
-                    for (size_t i = 0; i < output_line.size(); i++) {
-                        const bool first_pixel = i < bpp;
-                        const bool first_scanline = line_id == 0;
-                        const size_t j = i / bpp;
+    // Segments starting with a row that ignores the one above begin a chain that can be unfiltered on its own
+    chains.clear();
+    for (size_t i = 0; i < segments.size() && segments[i].first_row < window_end; i++) {
+        const uint8_t filt = inflated_data[segments[i].first_row * line_in_size];
+        if (i == 0 || filt == static_cast<uint8_t>(PNG_FILT_TYPE::NONE) || filt == static_cast<uint8_t>(PNG_FILT_TYPE::SUB))
+            chains.push_back(segments[i].first_row);
+    }
+    chains.push_back(std::min<size_t>(window_end, height));
 
-                        const uint8_t left = first_pixel ? 0 : output_line[i - img.nb_chan()];
-                        const uint8_t up = first_scanline ? 0 : up_line[i];
-                        const uint8_t upleft = (first_pixel || first_scanline) ? 0 : up_line[i - img.nb_chan()];
+    std::atomic<bool> ok = true;
 
-                        output_line[i + j] = this->paeth_predictor(left, up, upleft) + scanline[i];
-                    }
+    parallel_for(chains.size() - 1, [&](size_t, size_t c) {
+        if (chains[c + 1] <= window.y)
+            return;
 
-                    break;
-                }
+        const uint8_t *up_line = zero_line.data();
 
+        for (size_t row = chains[c]; row < chains[c + 1]; row++) {
+            uint8_t *line = inflated_data.data() + row * line_in_size;
 
-                default:
-                    break;
+            if (!unfilter_scanline(kernels, line, up_line, line_in_size - 1)) {
+                Logger::log(LOG_LEVEL::ERROR, "Invalid filter type {} on scanline {}", line[0], row);
+                ok = false;
+                return;
             }
-            break;
-        }
+
+            up_line = line + 1;
+
+            if (row >= window.y)
+                expand_row<CT, BD>(line + 1, out.row(row - window.y), window.x, window.w, color_info, out.nb_chan, out.sample_size);
         }
+    });
 
-        line_id++;
-        res = get_scanline(data_view, line_in_size);
-    }
+    return ok;
+}
 
-    D(Logger::log(LOG_LEVEL::INFO, "Filter count - {} NONE - {} SUB - {} UP - {} AVG - {} PAETH", n,s,u,a,p);)
-    auto end = std::chrono::high_resolution_clock::now();
-    std::println("Decoded PNG of size {}x{} in {}", width, height, std::chrono::duration_cast<std::chrono::milliseconds>(end - start));
-    return img;
+
+
+template <PNG_COLOR_TYPE CT, uint8_t... BDs>
+PngDecoder::ScanlineDecoder PngDecoder::select_bit_depth(uint8_t bd) {
+    ScanlineDecoder dec = nullptr;
+    ((bd == BDs && (dec = &PngDecoder::decode_scanlines<CT, BDs>)) || ...);
+    return dec;
+}
+
+
+
+ColorType PngDecoder::native_color_type() const {
+    // Alpha only when the file can actually make a pixel transparent
+    switch (color_type) {
+        case PNG_COLOR_TYPE::GSC:  return color_info.has_key ? ColorType::GRAYA : ColorType::GRAY;
+        case PNG_COLOR_TYPE::GSCA: return ColorType::GRAYA;
+        case PNG_COLOR_TYPE::RGB:  return color_info.has_key ? ColorType::RGBA : ColorType::RGB;
+        case PNG_COLOR_TYPE::IDX:  return color_info.has_alpha ? ColorType::RGBA : ColorType::RGB;
+        default:                   return ColorType::RGBA;
+    }
 }
 
 
 
-std::optional<std::span<const uint8_t>> PngDecoder::get_scanline(std::span<const uint8_t>& data, size_t scanline_size) {
-    if (data.size() == 0)
-        return std::nullopt;
+bool PngDecoder::set_window(const Rect& roi) {
+    // Clip to the image, 64 bits to avoid overflows on x + w
+    const uint64_t x1 = std::min<uint64_t>(static_cast<uint64_t>(roi.x) + roi.w, width);
+    const uint64_t y1 = std::min<uint64_t>(static_cast<uint64_t>(roi.y) + roi.h, height);
 
-    std::span<const uint8_t> scanline = data.subspan(0, scanline_size);
-    data = data.subspan(scanline_size, data.size() - scanline_size);
+    // Decoded pixels sit every grid.dx columns and grid.dy rows: keep the ones inside the rectangle
+    const uint64_t gx0 = (roi.x + grid.dx - 1) / grid.dx;
+    const uint64_t gy0 = (roi.y + grid.dy - 1) / grid.dy;
+    const uint64_t gx1 = (x1 + grid.dx - 1) / grid.dx;
+    const uint64_t gy1 = (y1 + grid.dy - 1) / grid.dy;
 
-    return scanline;
+    if (gx1 <= gx0 || gy1 <= gy0) {
+        Logger::log(LOG_LEVEL::ERROR, "Region {}x{}+{}+{} is outside of the {}x{} image", roi.w, roi.h, roi.x, roi.y, width, height);
+        return false;
+    }
+
+    window = Rect {
+        static_cast<uint32_t>(gx0),
+        static_cast<uint32_t>(gy0),
+        static_cast<uint32_t>(gx1 - gx0),
+        static_cast<uint32_t>(gy1 - gy0)
+    };
+    return true;
 }
 
 
 
+std::span<const Adam7Pass> PngDecoder::passes() const {
+    if (interlace_method == 1)
+        return std::span(adam7_passes).first(nb_passes);
+    return std::span(&no_interlace_pass, 1);
+}
+
 
-ChunkPNG PngDecoder::read_chunk(std::vector<uint8_t>& data, size_t& idx) {
+
+PngDecoder::ScanlineDecoder PngDecoder::select_scanline_decoder() const {
+    // Only the combinations allowed by the PNG specification are instantiated
+    switch (color_type) {
+        case PNG_COLOR_TYPE::GSC:  return select_bit_depth<PNG_COLOR_TYPE::GSC, 1, 2, 4, 8, 16>(bit_depth);
+        case PNG_COLOR_TYPE::RGB:  return select_bit_depth<PNG_COLOR_TYPE::RGB, 8, 16>(bit_depth);
+        case PNG_COLOR_TYPE::IDX:  return select_bit_depth<PNG_COLOR_TYPE::IDX, 1, 2, 4, 8>(bit_depth);
+        case PNG_COLOR_TYPE::GSCA: return select_bit_depth<PNG_COLOR_TYPE::GSCA, 8, 16>(bit_depth);
+        case PNG_COLOR_TYPE::RGBA: return select_bit_depth<PNG_COLOR_TYPE::RGBA, 8, 16>(bit_depth);
+    }
+    return nullptr;
+}
+
+
+
+ChunkPNG PngDecoder::read_chunk(std::span<const uint8_t> data, size_t& idx) {
     ChunkPNG chunk {};
     chunk.length = read<uint32_t, std::endian::big>(data, idx);
     chunk.type = static_cast<ChunkType>(read<uint32_t, std::endian::big>(data, idx));
-    chunk.data = std::span<uint8_t>(data.begin() + idx, chunk.length);
+
+    // Truncated files: keep what is there, the missing bytes are reported by inflate
+    chunk.length = std::min<size_t>(chunk.length, data.size() - std::min(idx, data.size()));
+    chunk.data = data.subspan(idx, chunk.length);
+    chunk.crc_data = data.subspan(idx - sizeof(ChunkType), chunk.length + sizeof(ChunkType));
     idx += chunk.length;
     chunk.crc = read<uint32_t, std::endian::big>(data, idx);
 
@@ -307,7 +596,29 @@ ChunkPNG PngDecoder::read_chunk(std::vector<uint8_t>& data, size_t& idx) {
 
 
 
-void PngDecoder::decode_ihdr(std::span<uint8_t> data) {
+bool PngDecoder::check_crc(const ChunkPNG& chunk, CrcPolicy policy) {
+    if (policy == CrcPolicy::NONE || (policy == CrcPolicy::CRITICAL && !chunk.is_critical()))
+        return true;
+
+    // libdeflate picks a PCLMULQDQ folding implementation when the CPU has it
+    const uint32_t crc = libdeflate_crc32(0, chunk.crc_data.data(), chunk.crc_data.size());
+
+    if (crc != chunk.crc) {
+        Logger::log(LOG_LEVEL::ERROR, "CRC mismatch on chunk {:#x}: got {:#x}, expected {:#x}", static_cast<uint32_t>(chunk.type), crc, chunk.crc);
+        return false;
+    }
+
+    return true;
+}
+
+
+
+bool PngDecoder::decode_ihdr(std::span<const uint8_t> data) {
+    if (data.size() != 13) {
+        Logger::log(LOG_LEVEL::ERROR, "IHDR of {} bytes instead of 13", data.size());
+        return false;
+    }
+
     size_t idx {0};
     width = read<uint32_t, std::endian::big>(data, idx);
     height = read<uint32_t, std::endian::big>(data, idx);
@@ -316,21 +627,258 @@ void PngDecoder::decode_ihdr(std::span<uint8_t> data) {
     compression_method = read<uint8_t>(data, idx);
     filter_method = read<uint8_t>(data, idx);
     interlace_method = read<uint8_t>(data, idx);
-    bpp = channel_nb.at(color_type) * bit_depth / 8;
-    inflated_data.resize(height * width * bpp + height);
+
+    if (width == 0 || height == 0 || width > max_dimension || height > max_dimension || static_cast<uint64_t>(width) * height > max_pixels) {
+        Logger::log(LOG_LEVEL::ERROR, "Invalid PNG size {}x{}", width, height);
+        return false;
+    }
+
+    if (!channel_nb.contains(color_type) || this->select_scanline_decoder() == nullptr) {
+        Logger::log(LOG_LEVEL::ERROR, "Unsupported color type {} with bit depth {}", static_cast<uint8_t>(color_type), bit_depth);
+        return false;
+    }
+
+    if (interlace_method > 1) {
+        Logger::log(LOG_LEVEL::ERROR, "Unknown interlace method {}", interlace_method);
+        return false;
+    }
+
+    bpp = std::max<size_t>(1, channel_nb.at(color_type) * bit_depth / 8);
+    inflated_size = this->inflated_bytes(width, height);
+    return true;
 }
 
 
 
-uint8_t PngDecoder::paeth_predictor(uint8_t a, uint8_t b, uint8_t c) {
-    const int16_t p = a + b - c;
-    const int16_t pa = std::abs(p - a);
-    const int16_t pb = std::abs(p - b);
-    const int16_t pc = std::abs(p - c);
+/**
+ * @brief Size of the inflated data of an image of the given size, all passes included
+ */
+size_t PngDecoder::inflated_bytes(uint32_t w, uint32_t h) const {
+    const size_t bits_per_pixel = channel_nb.at(color_type) * bit_depth;
+    const std::span<const Adam7Pass> all_passes = (interlace_method == 1) ? std::span<const Adam7Pass>(adam7_passes) : std::span(&no_interlace_pass, 1);
+
+    // The whole stream is inflated, whatever the number of passes decoded afterwards
+    size_t size = 0;
+    for (const Adam7Pass& pass : all_passes) {
+        const size_t pass_width = pass_extent(w, pass.x0, pass.dx);
+        const size_t pass_height = pass_extent(h, pass.y0, pass.dy);
+        if (pass_width != 0)
+            size += pass_height * ((pass_width * bits_per_pixel + 7) / 8 + 1);
+    }
+
+    return size;
+}
+
+
+
+void PngDecoder::decode_plte(std::span<const uint8_t> data) {
+    const size_t nb_entries = std::min<size_t>(data.size() / 3, color_info.palette.size());
+
+    for (size_t i = 0; i < nb_entries; i++) {
+        color_info.palette[i] = { data[3 * i], data[3 * i + 1], data[3 * i + 2], 255 };
+    }
+}
+
+
+
+void PngDecoder::decode_trns(std::span<const uint8_t> data) {
+    size_t idx {0};
+
+    switch (color_type) {
+        case PNG_COLOR_TYPE::IDX: {
+            const size_t nb_entries = std::min(data.size(), color_info.palette.size());
+            for (size_t i = 0; i < nb_entries; i++) {
+                color_info.palette[i][3] = data[i];
+                color_info.has_alpha |= data[i] != 255;
+            }
+            break;
+        }
+
+        case PNG_COLOR_TYPE::GSC:
+            color_info.key[0] = read<uint16_t, std::endian::big>(data, idx);
+            color_info.has_key = true;
+            break;
+
+        case PNG_COLOR_TYPE::RGB:
+            for (auto& k : color_info.key)
+                k = read<uint16_t, std::endian::big>(data, idx);
+            color_info.has_key = true;
+            break;
+
+        default:
+            break;
+    }
+}
+
+
+
+
+void PngDecoder::decode_idot(std::span<const uint8_t> data, size_t chunk_offset) {
+    // Segment count, then first row, row count and IDAT offset of every segment
+    size_t idx = 0;
+    const uint32_t nb_segments = read<uint32_t, std::endian::big>(data, idx);
+
+    if (data.size() != 4 + 12 * static_cast<uint64_t>(nb_segments)) {
+        Logger::log(LOG_LEVEL::WARNING, "Ignoring iDOT chunk of {} bytes for {} segments", data.size(), nb_segments);
+        return;
+    }
+
+    segments.resize(nb_segments);
+
+    for (IdotSegment& seg : segments) {
+        seg.first_row = read<uint32_t, std::endian::big>(data, idx);
+        seg.nb_rows = read<uint32_t, std::endian::big>(data, idx);
+
+        // Offsets count from the start of the iDOT chunk itself
+        seg.offset = chunk_offset + read<uint32_t, std::endian::big>(data, idx);
+    }
+}
+
+
+
+bool PngDecoder::decode_actl(std::span<const uint8_t> data) {
+    // Frame count, then play count
+    if (data.size() != 8)
+        return false;
+
+    size_t idx = 0;
+    const uint32_t nb_frames = read<uint32_t, std::endian::big>(data, idx);
+    nb_plays = read<uint32_t, std::endian::big>(data, idx);
+
+    if (nb_frames == 0) {
+        Logger::log(LOG_LEVEL::ERROR, "acTL chunk announcing no frame");
+        return false;
+    }
+
+    animated = true;
+    next_sequence = 0;
+    frames.reserve(std::min<uint32_t>(nb_frames, 1024));
+    return true;
+}
+
+
+
+bool PngDecoder::decode_fctl(std::span<const uint8_t> data) {
+    // Sequence number, width, height, x, y, delay numerator and denominator, dispose and blend operations
+    if (data.size() != 26)
+        return false;
+
+    size_t idx = 0;
+    const uint32_t sequence = read<uint32_t, std::endian::big>(data, idx);
+
+    ApngFrame frame;
+    frame.region.w = read<uint32_t, std::endian::big>(data, idx);
+    frame.region.h = read<uint32_t, std::endian::big>(data, idx);
+    frame.region.x = read<uint32_t, std::endian::big>(data, idx);
+    frame.region.y = read<uint32_t, std::endian::big>(data, idx);
+    frame.delay_num = read<uint16_t, std::endian::big>(data, idx);
+    frame.delay_den = read<uint16_t, std::endian::big>(data, idx);
+    const uint8_t dispose = read<uint8_t>(data, idx);
+    const uint8_t blend = read<uint8_t>(data, idx);
+
+    if (sequence != next_sequence++) {
+        Logger::log(LOG_LEVEL::ERROR, "fcTL chunk with sequence number {}, expected {}", sequence, next_sequence - 1);
+        return false;
+    }
+
+    // 64 bits to avoid overflows on x + w
+    const Rect& r = frame.region;
+    if (r.w == 0 || r.h == 0 || static_cast<uint64_t>(r.x) + r.w > width || static_cast<uint64_t>(r.y) + r.h > height || dispose > 2 || blend > 1) {
+        Logger::log(LOG_LEVEL::ERROR, "Frame {}x{}+{}+{} with operations {} and {} does not fit the {}x{} canvas", r.w, r.h, r.x, r.y, dispose, blend, width, height);
+        return false;
+    }
+
+    frame.dispose = static_cast<ApngDispose>(dispose);
+    frame.blend = static_cast<ApngBlend>(blend);
+    frames.push_back({ frame, {} });
+    return true;
+}
+
+
+
+bool PngDecoder::decode_fdat(std::span<const uint8_t> data) {
+    // Sequence number, then image data as in IDAT chunks
+    size_t idx = 0;
+    const uint32_t sequence = read<uint32_t, std::endian::big>(data, idx);
+
+    if (data.size() < 4 || frames.empty() || sequence != next_sequence++) {
+        Logger::log(LOG_LEVEL::ERROR, "fdAT chunk out of order");
+        return false;
+    }
+
+    frames.back().chunks.push_back(data.subspan(4));
+    return true;
+}
+
+
+
+bool PngDecoder::match_segments() {
+    if (segments.size() < 2 || interlace_method != 0 || idat_chunks.empty())
+        return false;
+
+    size_t chunk_id = 0;
+    uint32_t next_row = 0;
+
+    for (IdotSegment& seg : segments) {
+        // Segments must tile the image in order and each start on its own IDAT chunk
+        while (chunk_id < idat_offsets.size() && idat_offsets[chunk_id] < seg.offset)
+            chunk_id++;
+
+        if (seg.first_row != next_row || seg.nb_rows == 0 || chunk_id == idat_offsets.size() || idat_offsets[chunk_id] != seg.offset) {
+            Logger::log(LOG_LEVEL::WARNING, "iDOT segments do not match the image data, decoding serially");
+            return false;
+        }
+
+        seg.first_chunk = chunk_id;
+        next_row += seg.nb_rows;
+    }
+
+    if (next_row != height || segments.front().first_chunk != 0) {
+        Logger::log(LOG_LEVEL::WARNING, "iDOT segments do not cover the image, decoding serially");
+        return false;
+    }
+
+    for (size_t i = 0; i < segments.size(); i++) {
+        const size_t end = (i + 1 < segments.size()) ? segments[i + 1].first_chunk : idat_chunks.size();
+        segments[i].nb_chunks = end - segments[i].first_chunk;
+    }
+
+    return true;
+}
+
+
+
+bool PngDecoder::inflate_segments() {
+    const size_t line_in_size = (static_cast<size_t>(width) * channel_nb.at(color_type) * bit_depth + 7) / 8 + 1;
+
+    // Rows below the window are never read
+    const size_t nb_needed = std::ranges::count_if(segments, [&](const IdotSegment& seg) {
+        return seg.first_row < window.y + window.h;
+    });
+
+    const size_t nb_workers = parallel_workers(nb_needed);
+    while (segment_streams.size() < nb_workers)
+        segment_streams.push_back(std::make_unique<IdatStream>());
+
+    inflated_data.resize(inflated_size);
+    std::atomic<bool> ok = true;
+
+    parallel_for(nb_needed, [&](size_t worker, size_t i) {
+        const IdotSegment& seg = segments[i];
+        IdatStream& stream = *segment_streams[worker];
+
+        const auto chunks = std::span(idat_chunks).subspan(seg.first_chunk, seg.nb_chunks);
+        const auto out = std::span(inflated_data).subspan(seg.first_row * line_in_size, seg.nb_rows * line_in_size);
+
+        // Only the first segment carries the zlib header
+        if (!stream.reset(chunks, i > 0) || !stream.read(out))
+            ok = false;
+    });
+
+    if (!ok)
+        Logger::log(LOG_LEVEL::WARNING, "iDOT segments are not independent, decoding serially");
 
-    if (pa <= pb && pa <= pc) return a;
-    else if (pb <= pc) return b;
-    else return c;
+    return ok;
 }
 
 
@@ -1,12 +1,35 @@
 #pragma once
 
+#include <ivmg/codecs/apng.hpp>
 #include <ivmg/codecs/decoder.hpp>
+#include <ivmg/codecs/encoder.hpp>
+#include <ivmg/codecs/errors.hpp>
+#include <ivmg/codecs/options.hpp>
+#include <ivmg/core/rect.hpp>
 
+#include "png/idat_stream.hpp"
+#include "png/fast_deflater.hpp"
+#include "png/strip_deflater.hpp"
+#include "common/box_accumulator.hpp"
+#include "common/pixel_view.hpp"
+
+#include <memory>
+
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
+#include <expected>
+#include <span>
 #include <unordered_map>
 #include <vector>
 
 
+struct libdeflate_compressor;
+struct libdeflate_decompressor;
+
 namespace ivmg {
 
 
@@ -15,6 +38,11 @@ enum class ChunkType : uint32_t {
     PLTE = 0x504C5445,
     IDAT = 0x49444154,
     IEND = 0x49454E44,
+    tRNS = 0x74524E53,
+    iDOT = 0x69444F54,
+    acTL = 0x6163544C,
+    fcTL = 0x6663544C,
+    fdAT = 0x66644154,
 };
 
 
@@ -22,7 +50,11 @@ struct ChunkPNG {
     uint32_t length;
     ChunkType type;
     uint32_t crc;
-    std::span<uint8_t> data;
+    std::span<const uint8_t> data;
+    std::span<const uint8_t> crc_data;      // Type and data, the bytes covered by the CRC
+
+    // Bit 5 of the first type byte is clear for chunks a decoder cannot skip
+    inline bool is_critical() const { return (static_cast<uint32_t>(type) & 0x20000000) == 0; }
 };
 
 
@@ -38,6 +70,7 @@ enum class PNG_COLOR_TYPE : uint8_t {
 const std::unordered_map<PNG_COLOR_TYPE, uint8_t> channel_nb {
     { PNG_COLOR_TYPE::GSC, 1 },
     { PNG_COLOR_TYPE::RGB, 3 },
+    { PNG_COLOR_TYPE::IDX, 1 },
     { PNG_COLOR_TYPE::GSCA, 2 },
     { PNG_COLOR_TYPE::RGBA, 4 }
 };
@@ -51,13 +84,123 @@ enum class PNG_FILT_TYPE : uint8_t {
     PAETH = 4
 };
 
+/**
+ * @brief Palette and transparency information gathered from the PLTE and tRNS chunks
+ */
+struct PngColorInfo {
+    std::array<std::array<uint8_t, 4>, 256> palette;    // RGBA entries, opaque unless tRNS says otherwise
+    std::array<uint16_t, 3> key;                        // tRNS color key at the image bit depth. Gray uses key[0]
+    bool has_key;
+    bool has_alpha;                                     // Some palette entry is not fully opaque
+};
+
+
+/**
+ * @brief Pixels of a reduced image stored in one Adam7 pass: every dx column from x0, every dy row from y0
+ */
+struct Adam7Pass {
+    uint8_t x0, y0;
+    uint8_t dx, dy;
+};
+
+constexpr std::array<Adam7Pass, 7> adam7_passes {{
+    { 0, 0, 8, 8 },
+    { 4, 0, 8, 8 },
+    { 0, 4, 4, 8 },
+    { 2, 0, 4, 4 },
+    { 0, 2, 2, 4 },
+    { 1, 0, 2, 2 },
+    { 0, 1, 1, 2 },
+}};
+
+// Spacing of the pixels known once all the passes up to the given one are decoded
+constexpr std::array<Adam7Pass, 7> adam7_grids {{
+    { 0, 0, 8, 8 },
+    { 0, 0, 4, 8 },
+    { 0, 0, 4, 4 },
+    { 0, 0, 2, 4 },
+    { 0, 0, 2, 2 },
+    { 0, 0, 1, 2 },
+    { 0, 0, 1, 1 },
+}};
+
+// Non interlaced images are decoded as a single pass covering every pixel
+constexpr Adam7Pass no_interlace_pass { 0, 0, 1, 1 };
+
+/**
+ * @brief Number of pixels of a pass along one dimension
+ */
+constexpr size_t pass_extent(size_t full, uint8_t start, uint8_t step) {
+    return (full > start) ? (full - start + step - 1) / step : 0;
+}
+
+
+/**
+ * @brief Group of rows whose deflate data can be inflated on its own, as listed by an iDOT chunk.
+ *
+ * The encoder flushed the deflate stream at the first row of every segment,
+ * so the segments after the first are raw deflate data starting on an IDAT
+ * chunk boundary.
+ */
+struct IdotSegment {
+    uint32_t first_row;
+    uint32_t nb_rows;
+    size_t offset;          // File offset of the first IDAT chunk of the segment
+    size_t first_chunk;     // Index of that chunk in idat_chunks
+    size_t nb_chunks;
+};
+
+
+/**
+ * @brief Animation frame as described by its fcTL chunk, along with its image data
+ */
+struct ApngFrameData {
+    ApngFrame frame;
+    std::vector<std::span<const uint8_t>> chunks;   // IDAT data for a first frame that is the default image, fdAT data past the sequence number otherwise
+};
+
+
+struct LibdeflateDecompressorDeleter {
+    void operator()(libdeflate_decompressor* d) const;
+};
+
+
+struct LibdeflateCompressorDeleter {
+    void operator()(libdeflate_compressor* c) const;
+};
+
+
 constexpr uint8_t magic_length = 8;
 constexpr uint8_t magic[magic_length] = { 0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A };
 
+constexpr uint32_t max_chunk_length = 0x7FFFFFFF;
+
+// Filtered bytes compressed together when the encoder splits an image in strips
+constexpr size_t strip_size = 1 << 20;
+
+// The one filter of the fast mode: cheap, and turns flat areas into runs of zeros
+constexpr PngFilter fast_filter = PngFilter::SUB;
+
+
+inline void store_be32(uint8_t* dst, uint32_t val) {
+    if constexpr (std::endian::native == std::endian::little)
+        val = std::byteswap(val);
+    std::memcpy(dst, &val, sizeof(val));
+}
+
+
+inline void append_be32(std::vector<uint8_t>& out, uint32_t val) {
+    out.resize(out.size() + sizeof(val));
+    store_be32(out.data() + out.size() - sizeof(val), val);
+}
+
 
 class PngDecoder : public Decoder {
 
 private:
+    static constexpr uint32_t max_dimension = 0x7FFFFFFF;     // Largest width or height the PNG specification allows
+    static constexpr uint64_t max_pixels = 400'000'000;       // Same limit as the QOI decoder
+
     size_t bpp;
     uint32_t width;
     uint32_t height;
@@ -66,20 +209,143 @@ private:
     uint8_t compression_method;
     uint8_t filter_method;
     uint8_t interlace_method;
-    std::vector<uint8_t> compressed_data;
+    PngColorInfo color_info;
+    uint8_t nb_passes;
+    Adam7Pass grid;         // Spacing of the decoded pixels in the full image
+    Rect window;            // Part of the decoded pixels to output, in grid coordinates
+    uint8_t scale;          // Side of the blocks of the window averaged into one output pixel
+    uint32_t out_width;     // Size of the decoded image, window and scale applied
+    uint32_t out_height;
+    ColorType out_color;
+    uint8_t out_depth;
+    std::chrono::high_resolution_clock::time_point decode_start;
+    size_t inflated_size;
+
+    // Kept across images so that a reused decoder does not allocate again
+    std::unique_ptr<libdeflate_decompressor, LibdeflateDecompressorDeleter> decompressor;
+    std::vector<std::span<const uint8_t>> idat_chunks;
+    std::vector<size_t> idat_offsets;       // File offset of every IDAT chunk
+    std::vector<uint8_t> idat_joined;       // Image data split over several chunks, copied together for libdeflate
     std::vector<uint8_t> inflated_data;
+    std::vector<uint8_t> zero_line;
+    std::vector<uint8_t> pass_line;
+
+    // Streaming mode: scanlines are pulled from the inflater into a ring of two lines
+    bool streaming;
+    IdatStream idat_stream;
+    std::vector<uint8_t> line_ring;
+
+    // Parallel decoding of images split in independent deflate segments
+    std::vector<IdotSegment> segments;
+    std::vector<std::unique_ptr<IdatStream>> segment_streams;     // One per worker thread
+    bool segmented;                                                // inflated_data was filled segment by segment
+    std::vector<size_t> chains;                                    // First row of every run of segments unfiltered together
+
+    // Reduced resolution decoding: one row of blocks at a time, all of them for interlaced images
+    BoxAccumulator box;
+
+    // Animated PNGs, frames are only gathered when an acTL chunk came first
+    bool animated;
+    uint32_t nb_plays;
+    uint32_t next_sequence;                 // Expected sequence number of the next fcTL or fdAT chunk
+    std::vector<ApngFrameData> frames;
+
+    // Unfilters and expands every scanline of the inflated data into the output rows
+    using ScanlineDecoder = bool (PngDecoder::*)(const PixelView& out);
 
 public:
     PngDecoder() = default;
-    bool can_decode(std::ifstream& filestream) const override;
-    Image decode(std::ifstream& filestream) override;
+    bool can_decode(std::span<const uint8_t> data) const override;
+    std::expected<Image, IVMG_DEC_ERR> decode(std::span<const uint8_t> data, const DecodeOptions& opts) override;
+    std::expected<ImageInfo, IVMG_DEC_ERR> probe(std::span<const uint8_t> data) override;
+    std::expected<void, IVMG_DEC_ERR> decode_into(std::span<const uint8_t> data, std::span<uint8_t> dst, size_t stride, PixelFormat fmt, const DecodeOptions& opts) override;
+
+    // Frame by frame decoding, for ApngReader
+    std::expected<ApngInfo, IVMG_DEC_ERR> open_animation(std::span<const uint8_t> data, const DecodeOptions& opts);
+    bool decode_frame(size_t index, const PixelView& out);
+    inline const ApngFrame& frame(size_t index) const { return frames[index].frame; }
+
+private:
+    ChunkPNG read_chunk(std::span<const uint8_t> file_buffer, size_t &read_idx);
+    static bool check_crc(const ChunkPNG& chunk, CrcPolicy policy);
+    bool decode_ihdr(std::span<const uint8_t> data);
+    void decode_plte(std::span<const uint8_t> data);
+    void decode_trns(std::span<const uint8_t> data);
+    void decode_idot(std::span<const uint8_t> data, size_t chunk_offset);
+    bool decode_actl(std::span<const uint8_t> data);
+    bool decode_fctl(std::span<const uint8_t> data);
+    bool decode_fdat(std::span<const uint8_t> data);
+    size_t inflated_bytes(uint32_t w, uint32_t h) const;
+    bool match_segments();
+    bool inflate_segments();
+    std::expected<void, IVMG_DEC_ERR> read_chunks(std::span<const uint8_t> file_buffer, const DecodeOptions& opts);
+    std::expected<void, IVMG_DEC_ERR> decode_png(std::span<const uint8_t> file_buffer, const DecodeOptions& opts);
+    bool inflate_image();
+    bool write_pixels(const PixelView& out);
+
+    ScanlineDecoder select_scanline_decoder() const;
+    std::span<const Adam7Pass> passes() const;
+    bool set_window(const Rect& roi);
+    ColorType native_color_type() const;
+
+    template <PNG_COLOR_TYPE CT, uint8_t... BDs>
+    static ScanlineDecoder select_bit_depth(uint8_t bd);
+
+    template <PNG_COLOR_TYPE CT, uint8_t BD>
+    bool decode_scanlines(const PixelView& out);
+
+    template <PNG_COLOR_TYPE CT, uint8_t BD>
+    bool decode_segments(const PixelView& out);
+};
+
+
+
+/**
+ * @brief Scratch state of one thread filtering scanlines for the encoder
+ */
+struct FilterScratch {
+    std::vector<uint8_t> ring;      // 16 bits rows swapped to big endian, the current and the previous one
+    std::vector<uint8_t> trial;     // Candidate filtered row then its compressed bytes, brute force only
+    std::unique_ptr<libdeflate_compressor, LibdeflateCompressorDeleter> trial_compressor;
+};
+
+
+class PngEncoder : public Encoder {
+
+private:
+    // Kept across images so that a reused encoder does not allocate again
+    std::unique_ptr<libdeflate_compressor, LibdeflateCompressorDeleter> compressor;
+    int compressor_level = -1;
+    std::vector<uint8_t> filtered;          // Filter type byte and filtered bytes of every scanline
+    std::vector<uint8_t> zero_line;
+    std::vector<FilterScratch> scratch;     // One per worker thread
+    int trial_level = -1;                   // Compression level of the brute force trials
+
+    // Zlib stream of the image, one part per strip compressed on its own. A single part when not split
+    std::vector<std::vector<uint8_t>> strips;
+    std::vector<uint32_t> strip_adlers;
+    std::vector<std::unique_ptr<StripDeflater>> deflaters;     // One per worker thread
+    std::vector<std::unique_ptr<FastDeflater>> fast_deflaters;  // Same, for the fast mode
+    bool fast;
+    uint32_t strip_rows;
+    std::vector<uint8_t> idot;
+
+public:
+    PngEncoder() = default;
+    void encode(const Image& img, std::vector<uint8_t>& out, const EncodeOptions& opts) override;
+
+    // Frame by frame encoding, for ApngWriter
+    void deflate(const ConstPixelView& img, const EncodeOptions& opts);
+    inline std::span<const std::vector<uint8_t>> zlib_stream() const { return strips; }
+    static void write_chunk(std::vector<uint8_t>& out, ChunkType type, std::span<const uint8_t> data, std::span<const uint8_t> prefix = {});
+    static void write_ihdr(std::vector<uint8_t>& out, uint32_t width, uint32_t height, uint8_t nb_chan, uint8_t bit_depth);
 
 private:
-    ChunkPNG read_chunk(std::vector<uint8_t>& file_buffer, size_t &read_idx);
-    void decode_ihdr(std::span<uint8_t> data);
-    Image decode_png(std::vector<uint8_t>& file_buffer);
-    uint8_t paeth_predictor(uint8_t a, uint8_t b, uint8_t c);
-    std::optional<std::span<const uint8_t>> get_scanline(std::span<const uint8_t>& data, size_t scanline_size);
+    PNG_FILT_TYPE select_filter(PngFilter mode, const uint8_t* row, const uint8_t* prev, size_t len, size_t bpp, bool restricted, FilterScratch& s);
+    void filter_rows(const ConstPixelView& img, PngFilter mode, uint32_t first, uint32_t count, bool independent, FilterScratch& s);
+    void deflate_image(const ConstPixelView& img, PngFilter mode, int level);
+    bool deflate_strips(const ConstPixelView& img, PngFilter mode, int level, bool independent);
+    bool write_idot(std::vector<uint8_t>& out, uint32_t height);
 };
 
 
@@ -0,0 +1,52 @@
+#include "png/strip_deflater.hpp"
+
+#include "../common/logger.hpp"
+
+namespace ivmg {
+
+StripDeflater::~StripDeflater() {
+    if (initialized)
+        deflateEnd(&zs);
+}
+
+
+bool StripDeflater::compress(std::span<const uint8_t> in, int zlevel, bool last, std::vector<uint8_t>& out) {
+    if (!initialized) {
+        // Negative window bits: no zlib header nor trailer, the encoder writes them around the joined strips
+        initialized = deflateInit2(&zs, zlevel, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+        level = zlevel;
+
+        if (!initialized)
+            return false;
+    }
+    else if (deflateReset(&zs) != Z_OK) {
+        return false;
+    }
+
+    if (zlevel != level) {
+        if (deflateParams(&zs, zlevel, Z_DEFAULT_STRATEGY) != Z_OK)
+            return false;
+        level = zlevel;
+    }
+
+    // deflateBound does not count the empty stored block of the sync flush
+    const size_t start = out.size();
+    out.resize(start + deflateBound(&zs, in.size()) + 8);
+
+    // zlib does not write through next_in, the const_cast only matches its C API
+    zs.next_in = const_cast<Bytef*>(in.data());
+    zs.avail_in = static_cast<uInt>(in.size());
+    zs.next_out = out.data() + start;
+    zs.avail_out = static_cast<uInt>(out.size() - start);
+
+    const int ret = deflate(&zs, last ? Z_FINISH : Z_SYNC_FLUSH);
+    out.resize(out.size() - zs.avail_out);
+
+    const bool done = last ? ret == Z_STREAM_END : (ret == Z_OK && zs.avail_in == 0 && zs.avail_out > 0);
+    if (!done)
+        Logger::log(LOG_LEVEL::ERROR, "Deflate of a {} bytes strip died with code {}", in.size(), ret);
+
+    return done;
+}
+
+}
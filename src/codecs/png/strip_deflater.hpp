@@ -0,0 +1,45 @@
+#pragma once
+
+#include <zlib.h>
+
+#include <cstdint>
+#include <span>
+#include <vector>
+
+namespace ivmg {
+
+/**
+ * @brief Raw deflate compressor for one strip of scanlines of a PNG compressed in parallel.
+ *
+ * Every strip starts a fresh deflate stream so it references nothing before
+ * it. Strips other than the last end on a sync flush instead of a final
+ * block: byte aligned, they concatenate into a single valid deflate stream,
+ * the way pigz joins its blocks. libdeflate only writes complete streams,
+ * hence zlib here.
+ */
+class StripDeflater {
+private:
+    z_stream zs {};
+    bool initialized = false;
+    int level = -1;
+
+public:
+    StripDeflater() = default;
+    ~StripDeflater();
+
+    StripDeflater(const StripDeflater&) = delete;
+    StripDeflater& operator=(const StripDeflater&) = delete;
+
+    /**
+     * @brief Compresses one strip. Keeps the deflater allocation from one strip to the next.
+     *
+     * @param in the filtered scanlines of the strip
+     * @param zlevel the zlib compression level, from 0 to 9
+     * @param last true for the strip ending the image, closed with a final block
+     * @param out receives the raw deflate data, appended after its current content
+     * @return true if the strip was compressed, false if zlib failed
+     */
+    bool compress(std::span<const uint8_t> in, int zlevel, bool last, std::vector<uint8_t>& out);
+};
+
+}
@@ -0,0 +1,261 @@
+#include "png/unfilter.hpp"
+
+#include <array>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <immintrin.h>
+    #define IVMG_X86 1
+#endif
+
+namespace ivmg {
+
+//======================================================
+// SCALAR FALLBACK
+//======================================================
+
+static inline uint8_t paeth_predictor(uint8_t a, uint8_t b, uint8_t c) {
+    const int16_t pa = std::abs(b - c);
+    const int16_t pb = std::abs(a - c);
+    const int16_t pc = std::abs(a + b - 2 * c);
+
+    if (pa <= pb && pa <= pc) return a;
+    else if (pb <= pc) return b;
+    else return c;
+}
+
+
+template <size_t BPP>
+static void unfilter_sub_scalar(uint8_t* row, const uint8_t*, size_t len) {
+    for (size_t i = BPP; i < len; i++)
+        row[i] += row[i - BPP];
+}
+
+
+static void unfilter_up_scalar(uint8_t* row, const uint8_t* prev, size_t len) {
+    for (size_t i = 0; i < len; i++)
+        row[i] += prev[i];
+}
+
+
+template <size_t BPP>
+static void unfilter_avg_scalar(uint8_t* row, const uint8_t* prev, size_t len) {
+    for (size_t i = 0; i < BPP && i < len; i++)
+        row[i] += prev[i] >> 1;
+
+    for (size_t i = BPP; i < len; i++)
+        row[i] += (static_cast<uint16_t>(row[i - BPP]) + prev[i]) >> 1;
+}
+
+
+template <size_t BPP>
+static void unfilter_paeth_scalar(uint8_t* row, const uint8_t* prev, size_t len) {
+    // With a = c = 0 the predictor always picks b
+    for (size_t i = 0; i < BPP && i < len; i++)
+        row[i] += prev[i];
+
+    for (size_t i = BPP; i < len; i++)
+        row[i] += paeth_predictor(row[i - BPP], prev[i], prev[i - BPP]);
+}
+
+
+template <size_t BPP>
+static constexpr UnfilterKernels scalar_kernels {
+    unfilter_sub_scalar<BPP>,
+    unfilter_up_scalar,
+    unfilter_avg_scalar<BPP>,
+    unfilter_paeth_scalar<BPP>
+};
+
+
+
+#ifdef IVMG_X86
+
+//======================================================
+// SSE4.1 / AVX2 KERNELS
+//
+// SUB, AVG and PAETH depend on the pixel to the left, so they are
+// computed one pixel at a time in the low lanes of a register, the
+// same way libpng and spng do it. UP has no such dependency and is
+// done 16 or 32 bytes at a time.
+//======================================================
+
+#define IVMG_TARGET_SSE41 __attribute__((target("sse4.1")))
+#define IVMG_TARGET_AVX2 __attribute__((target("avx2")))
+
+template <size_t BPP>
+IVMG_TARGET_SSE41 static inline __m128i load_pixel(const uint8_t* p) {
+    uint32_t v = 0;
+    std::memcpy(&v, p, BPP);
+    return _mm_cvtsi32_si128(static_cast<int>(v));
+}
+
+
+template <size_t BPP>
+IVMG_TARGET_SSE41 static inline void store_pixel(uint8_t* p, __m128i v) {
+    const uint32_t t = static_cast<uint32_t>(_mm_cvtsi128_si32(v));
+    std::memcpy(p, &t, BPP);
+}
+
+
+template <size_t BPP>
+IVMG_TARGET_SSE41 static void unfilter_sub_sse41(uint8_t* row, const uint8_t*, size_t len) {
+    __m128i a = _mm_setzero_si128();
+
+    for (size_t i = 0; i < len; i += BPP) {
+        a = _mm_add_epi8(a, load_pixel<BPP>(row + i));
+        store_pixel<BPP>(row + i, a);
+    }
+}
+
+
+IVMG_TARGET_SSE41 static void unfilter_up_sse41(uint8_t* row, const uint8_t* prev, size_t len) {
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i));
+        const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(prev + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(row + i), _mm_add_epi8(x, b));
+    }
+
+    unfilter_up_scalar(row + i, prev + i, len - i);
+}
+
+
+template <size_t BPP>
+IVMG_TARGET_SSE41 static void unfilter_avg_sse41(uint8_t* row, const uint8_t* prev, size_t len) {
+    const __m128i one = _mm_set1_epi8(1);
+    __m128i a = _mm_setzero_si128();
+
+    for (size_t i = 0; i < len; i += BPP) {
+        const __m128i b = load_pixel<BPP>(prev + i);
+
+        // _mm_avg_epu8 rounds up, PNG rounds down: remove the carried bit
+        __m128i avg = _mm_avg_epu8(a, b);
+        avg = _mm_sub_epi8(avg, _mm_and_si128(_mm_xor_si128(a, b), one));
+
+        a = _mm_add_epi8(load_pixel<BPP>(row + i), avg);
+        store_pixel<BPP>(row + i, a);
+    }
+}
+
+
+template <size_t BPP>
+IVMG_TARGET_SSE41 static void unfilter_paeth_sse41(uint8_t* row, const uint8_t* prev, size_t len) {
+    const __m128i zero = _mm_setzero_si128();
+
+    // Pixels widened to 16 bits lanes so the distances cannot overflow
+    __m128i a = zero;
+    __m128i c = zero;
+
+    for (size_t i = 0; i < len; i += BPP) {
+        const __m128i b = _mm_unpacklo_epi8(load_pixel<BPP>(prev + i), zero);
+
+        const __m128i pa = _mm_abs_epi16(_mm_sub_epi16(b, c));
+        const __m128i pb = _mm_abs_epi16(_mm_sub_epi16(a, c));
+        const __m128i pc = _mm_abs_epi16(_mm_sub_epi16(_mm_add_epi16(a, b), _mm_add_epi16(c, c)));
+
+        const __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+
+        // Ties are broken in the order a, b, c
+        __m128i nearest = _mm_blendv_epi8(b, c, _mm_cmpeq_epi16(smallest, pc));
+        nearest = _mm_blendv_epi8(nearest, b, _mm_cmpeq_epi16(smallest, pb));
+        nearest = _mm_blendv_epi8(nearest, a, _mm_cmpeq_epi16(smallest, pa));
+
+        const __m128i x = _mm_add_epi8(load_pixel<BPP>(row + i), _mm_packus_epi16(nearest, nearest));
+        store_pixel<BPP>(row + i, x);
+
+        a = _mm_unpacklo_epi8(x, zero);
+        c = b;
+    }
+}
+
+
+IVMG_TARGET_AVX2 static void unfilter_up_avx2(uint8_t* row, const uint8_t* prev, size_t len) {
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        const __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + i));
+        const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(prev + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(row + i), _mm256_add_epi8(x, b));
+    }
+
+    unfilter_up_scalar(row + i, prev + i, len - i);
+}
+
+
+template <size_t BPP>
+static constexpr UnfilterKernels sse41_kernels {
+    unfilter_sub_sse41<BPP>,
+    unfilter_up_sse41,
+    unfilter_avg_sse41<BPP>,
+    unfilter_paeth_sse41<BPP>
+};
+
+
+// Only UP gains from wider registers, the other filters are bound by the
+// dependency on the left pixel and keep their SSE4.1 version
+template <size_t BPP>
+static constexpr UnfilterKernels avx2_kernels {
+    unfilter_sub_sse41<BPP>,
+    unfilter_up_avx2,
+    unfilter_avg_sse41<BPP>,
+    unfilter_paeth_sse41<BPP>
+};
+
+#endif
+
+
+
+//======================================================
+// RUNTIME DISPATCH
+//======================================================
+
+template <size_t BPP>
+static const UnfilterKernels& select_simd_kernels() {
+#ifdef IVMG_X86
+    if (__builtin_cpu_supports("avx2")) return avx2_kernels<BPP>;
+    if (__builtin_cpu_supports("sse4.1")) return sse41_kernels<BPP>;
+#endif
+    return scalar_kernels<BPP>;
+}
+
+
+const UnfilterKernels& select_unfilter_kernels(size_t bpp) {
+    switch (bpp) {
+        case 3: return select_simd_kernels<3>();
+        case 4: return select_simd_kernels<4>();
+        case 2: return scalar_kernels<2>;
+        case 6: return scalar_kernels<6>;
+        case 8: return scalar_kernels<8>;
+        default: return scalar_kernels<1>;
+    }
+}
+
+
+const UnfilterKernels* unfilter_kernels(size_t bpp, UnfilterIsa isa) {
+    switch (isa) {
+        case UnfilterIsa::SCALAR:
+            switch (bpp) {
+                case 2: return &scalar_kernels<2>;
+                case 3: return &scalar_kernels<3>;
+                case 4: return &scalar_kernels<4>;
+                case 6: return &scalar_kernels<6>;
+                case 8: return &scalar_kernels<8>;
+                default: return &scalar_kernels<1>;
+            }
+#ifdef IVMG_X86
+        case UnfilterIsa::SSE41:
+            if (!__builtin_cpu_supports("sse4.1") || (bpp != 3 && bpp != 4)) return nullptr;
+            return (bpp == 3) ? &sse41_kernels<3> : &sse41_kernels<4>;
+        case UnfilterIsa::AVX2:
+            if (!__builtin_cpu_supports("avx2") || (bpp != 3 && bpp != 4)) return nullptr;
+            return (bpp == 3) ? &avx2_kernels<3> : &avx2_kernels<4>;
+#endif
+        default:
+            return nullptr;
+    }
+}
+
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace ivmg {
+
+/**
+ * @brief Reconstructs one filtered scanline in place.
+ *
+ * @param row the filtered bytes of the scanline, without the filter type byte
+ * @param prev the previous reconstructed scanline. All zeros for the first scanline
+ * @param len the number of bytes in the scanline
+ */
+using UnfilterFn = void (*)(uint8_t* row, const uint8_t* prev, size_t len);
+
+
+/**
+ * @brief Set of unfilter kernels for a given pixel size. NONE is a no-op so it has no entry.
+ */
+struct UnfilterKernels {
+    UnfilterFn sub;
+    UnfilterFn up;
+    UnfilterFn avg;
+    UnfilterFn paeth;
+};
+
+
+/**
+ * @brief Picks the fastest kernels supported by the running CPU for the given pixel size.
+ *
+ * SSE4.1 and AVX2 versions exist for 3 and 4 bytes per pixel, every other size
+ * uses the scalar fallback.
+ *
+ * @param bpp bytes per complete pixel, rounded up to 1 for bit depths below 8
+ * @return the kernel table, valid for the lifetime of the program
+ */
+const UnfilterKernels& select_unfilter_kernels(size_t bpp);
+
+
+/**
+ * @brief Instruction sets the unfilter kernels are written for
+ */
+enum class UnfilterIsa : uint8_t {
+    SCALAR,
+    SSE41,
+    AVX2
+};
+
+
+/**
+ * @brief Kernels written for one instruction set, so that tests can compare every version with the scalar one.
+ *
+ * @param bpp bytes per complete pixel, as for select_unfilter_kernels
+ * @param isa the instruction set
+ * @return the kernel table, or nullptr if there is no version for this pixel size or the running CPU lacks the instruction set
+ */
+const UnfilterKernels* unfilter_kernels(size_t bpp, UnfilterIsa isa);
+
+}
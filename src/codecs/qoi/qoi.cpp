@@ -1,16 +1,216 @@
 #include <ivmg/core/image.hpp>
 #include "qoi.hpp"
+#include "common/logger.hpp"
+#include "common/parallel.hpp"
 #include "common/utils.hpp"
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <bit>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+	#include <immintrin.h>
+	#define IVMG_X86 1
+#endif
 
 
 namespace ivmg {
 
-uint16_t QoiEncoder::hash_pixel(const qoi_color_t& c) {
-	return (c.r * 3 + c.g * 5 + c.b * 7 + c.a * 11) & 63;
+/**
+ * @brief A color as the 4 bytes it takes in memory, whatever the byte order of the host
+ */
+static constexpr uint32_t pack(int r, int g, int b, int a) {
+	return std::bit_cast<uint32_t>(qoi_color_t { uint8_t(r), uint8_t(g), uint8_t(b), uint8_t(a) });
+}
+
+
+/**
+ * @brief Position of a color in the cache, from its 4 bytes
+ */
+static inline size_t hash_packed(uint32_t px) {
+	if constexpr (std::endian::native == std::endian::little) {
+		// r, g, b and a spread to 16 bits lanes as r, b, g, a: a single product sums them, weighted, in the top lane
+		uint64_t v = px;
+		v = ((v & 0xFF00FF00) << 24) | (v & 0x00FF00FF);
+		return ((v * 0x000300070005000B) >> 48) & 63;
+	}
+	else {
+		const qoi_color_t c = std::bit_cast<qoi_color_t>(px);
+		return (c.r * 3 + c.g * 5 + c.b * 7 + c.a * 11) & 63;
+	}
+}
+
+
+/**
+ * @brief Reads an RGB or RGBA pixel as 4 bytes. RGB pixels are opaque
+ */
+template <uint8_t NB_CHAN>
+static inline uint32_t load_pixel(const uint8_t* src) {
+	uint32_t px = (NB_CHAN == 3) ? pack(0, 0, 0, 255) : 0;
+	std::memcpy(&px, src, NB_CHAN);
+	return px;
+}
+
+
+template <uint8_t NB_CHAN>
+static inline void store_pixel(uint8_t* dst, uint32_t px) {
+	std::memcpy(dst, &px, NB_CHAN);
+}
+
+
+
+//======================================================
+// ENCODING
+//======================================================
+
+/**
+ * @brief Counts the pixels equal to px at the start of pixels
+ *
+ * @param pixels RGB or RGBA pixels
+ * @param count the number of pixels to look at
+ * @param px the pixel as load_pixel reads it
+ * @return the length of the run, at most count
+ */
+using RunLengthFn = size_t (*)(const uint8_t* pixels, size_t count, uint32_t px);
+
+
+template <uint8_t NB_CHAN>
+static size_t run_length_scalar(const uint8_t* pixels, size_t count, uint32_t px) {
+	size_t i = 0;
+
+	// Two RGBA pixels per comparison
+	if constexpr (NB_CHAN == 4) {
+		const uint64_t pair = (static_cast<uint64_t>(px) << 32) | px;
+		for (; i + 2 <= count; i += 2) {
+			uint64_t v;
+			std::memcpy(&v, pixels + i * 4, 8);
+			if (v != pair)
+				break;
+		}
+	}
+
+	while (i < count && load_pixel<NB_CHAN>(pixels + i * NB_CHAN) == px)
+		i++;
+
+	return i;
+}
+
+
+#ifdef IVMG_X86
+
+#define IVMG_TARGET_AVX2 __attribute__((target("avx2")))
+
+// Bit i is set where pixel i equals ref
+IVMG_TARGET_AVX2 static inline uint32_t equal_mask(const uint8_t* pixels, __m256i ref) {
+	const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pixels));
+	return static_cast<uint32_t>(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, ref))));
+}
+
+
+IVMG_TARGET_AVX2 static size_t run_length_rgba_avx2(const uint8_t* pixels, size_t count, uint32_t px) {
+	const __m256i ref = _mm256_set1_epi32(static_cast<int>(px));
+	size_t i = 0;
+
+	// 16 pixels per step, the runs of screenshots and flat assets go on for hundreds of pixels
+	for (; i + 16 <= count; i += 16) {
+		const uint32_t mask = equal_mask(pixels + i * 4, ref) | (equal_mask(pixels + i * 4 + 32, ref) << 8);
+		if (mask != 0xFFFF)
+			return i + std::countr_one(mask);
+	}
+
+	for (; i + 8 <= count; i += 8) {
+		const uint32_t mask = equal_mask(pixels + i * 4, ref);
+		if (mask != 0xFF)
+			return i + std::countr_one(mask);
+	}
+
+	return i + run_length_scalar<4>(pixels + i * 4, count - i, px);
+}
+
+
+IVMG_TARGET_AVX2 static size_t run_length_rgb_avx2(const uint8_t* pixels, size_t count, uint32_t px) {
+	// The pixel repeated every 3 bytes. 8 pixels fill the low 24 bytes of a load, after which the pattern starts over
+	alignas(32) uint8_t pattern[32];
+	for (size_t b = 0; b < sizeof(pattern); b++)
+		pattern[b] = reinterpret_cast<const uint8_t*>(&px)[b % 3];
+
+	const __m256i ref = _mm256_load_si256(reinterpret_cast<const __m256i*>(pattern));
+	size_t i = 0;
+
+	// 16 pixels per step. Loads read 8 bytes past the pixels they compare
+	for (; i * 3 + 56 <= count * 3; i += 16) {
+		const __m256i lo = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pixels + i * 3));
+		const __m256i hi = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pixels + i * 3 + 24));
+		const uint64_t mask = (static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, ref))) & 0xFFFFFF)
+			| (static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, ref))) & 0xFFFFFF) << 24);
+
+		if (mask != 0xFFFFFFFFFFFF)
+			return i + std::countr_one(mask) / 3;
+	}
+
+	return i + run_length_scalar<3>(pixels + i * 3, count - i, px);
+}
+
+#endif
+
+
+template <uint8_t NB_CHAN>
+static RunLengthFn select_run_length() {
+#ifdef IVMG_X86
+	if (__builtin_cpu_supports("avx2")) return (NB_CHAN == 4) ? run_length_rgba_avx2 : run_length_rgb_avx2;
+#endif
+	return run_length_scalar<NB_CHAN>;
+}
+
+
+/**
+ * @brief Converts pixels to RGBA 8 bits. Gray is repeated in r, g and b and 16 bits samples keep their high byte
+ */
+template <uint8_t NB_CHAN, typename T>
+static void to_rgba(const T* in, size_t count, uint8_t* out) {
+	constexpr int shift = (sizeof(T) - 1) * 8;
+
+	for (size_t i = 0; i < count; i++, in += NB_CHAN, out += 4) {
+		if constexpr (NB_CHAN >= 3) {
+			out[0] = static_cast<uint8_t>(in[0] >> shift);
+			out[1] = static_cast<uint8_t>(in[1] >> shift);
+			out[2] = static_cast<uint8_t>(in[2] >> shift);
+			out[3] = (NB_CHAN == 4) ? static_cast<uint8_t>(in[3] >> shift) : uint8_t(255);
+		}
+		else {
+			out[0] = out[1] = out[2] = static_cast<uint8_t>(in[0] >> shift);
+			out[3] = (NB_CHAN == 2) ? static_cast<uint8_t>(in[1] >> shift) : uint8_t(255);
+		}
+	}
 }
 
+
+static void to_rgba(const Image& img, size_t first, size_t count, uint8_t* out) {
+	const size_t offset = first * img.nb_chan();
+
+	if (img.bit_depth() == 16) {
+		const uint16_t* in = img.get_raw_handle16() + offset;
+		switch (img.nb_chan()) {
+			case 1:  to_rgba<1>(in, count, out); break;
+			case 2:  to_rgba<2>(in, count, out); break;
+			case 3:  to_rgba<3>(in, count, out); break;
+			default: to_rgba<4>(in, count, out); break;
+		}
+	}
+	else {
+		const uint8_t* in = img.get_raw_handle() + offset;
+		switch (img.nb_chan()) {
+			case 1:  to_rgba<1>(in, count, out); break;
+			case 2:  to_rgba<2>(in, count, out); break;
+			case 3:  to_rgba<3>(in, count, out); break;
+			default: std::memcpy(out, in, count * 4); break;
+		}
+	}
+}
+
+
 qoi_diff_t QoiEncoder::color_diff(const qoi_color_t &c1, const qoi_color_t &c2) {
     int8_t r = c1.r - c2.r;
     int8_t g = c1.g - c2.g;
@@ -20,100 +220,672 @@ qoi_diff_t QoiEncoder::color_diff(const qoi_color_t &c1, const qoi_color_t &c2)
 }
 
 
-std::vector<uint8_t> QoiEncoder::encode(const Image& img) {
-	std::println("Encoding in QOI");
+/**
+ * @brief Encodes RGB or RGBA pixels, going on from the state the previous call left
+ *
+ * A run reaching the last pixel is left pending in run, for the next call or the end of the image.
+ * A state without any valid cache slot starts a segment: the first pixel is written in full.
+ *
+ * @tparam NB_CHAN 3 or 4
+ * @param state the state the previous pixels left, updated
+ * @param pixels the pixels, packed
+ * @param count the number of pixels
+ * @param out where to write the ops, with room for the worst case
+ * @return the end of the ops written
+ */
+template <uint8_t NB_CHAN>
+uint8_t* QoiEncoder::encode_pixels(QoiState& state, const uint8_t* pixels, size_t count, uint8_t* out) {
+	static const RunLengthFn run_length = select_run_length<NB_CHAN>();
+
+	// Pixels are handled as the 4 bytes they take in memory. Locals rather than members, so that the compiler
+	// keeps them in registers and the cache on the stack without reloading them after every store to out
+	std::array<uint32_t, 64> cache = std::bit_cast<std::array<uint32_t, 64>>(state.color_cache);
+	uint32_t prev = std::bit_cast<uint32_t>(state.prev_pxl);
+	uint64_t valid = state.valid;
+	size_t pending = state.run;
+	constexpr uint32_t alpha_mask = pack(0, 0, 0, 255);
+
+	size_t i = 0;
+
+	// Decoders reach a segment with whatever the previous one left, nothing can refer to it
+	if (valid == 0 && count > 0) {
+		prev = load_pixel<NB_CHAN>(pixels);
+		cache[hash_packed(prev)] = prev;
+		valid = 1ull << hash_packed(prev);
+
+		*out++ = QOI_OP_RGBA;
+		std::memcpy(out, &prev, 4);
+		out += 4;
+		i = 1;
+	}
+
+	while (i < count) {
+		const uint32_t cur = load_pixel<NB_CHAN>(pixels + i * NB_CHAN);
+
+		if (cur == prev) {
+			const size_t len = run_length(pixels + i * NB_CHAN, count - i, prev);
+			i += len;
+
+			for (pending += len; pending >= 62; pending -= 62)
+				*out++ = QOI_OP_RUN | 61;
+			continue;
+		}
+
+		if (pending > 0) {
+			*out++ = QOI_OP_RUN | (pending - 1);
+			pending = 0;
+		}
+
+		const size_t hash = hash_packed(cur);
+
+		if (cache[hash] == cur && ((valid >> hash) & 1)) {
+			*out++ = QOI_OP_INDEX | hash;
+		}
+		else {
+			cache[hash] = cur;
+			valid |= 1ull << hash;
+
+			if (((cur ^ prev) & alpha_mask) == 0) {
+				const qoi_diff_t diff = color_diff(std::bit_cast<qoi_color_t>(cur), std::bit_cast<qoi_color_t>(prev));
+				const int8_t dr_dg = diff.r - diff.g;
+				const int8_t db_dg = diff.b - diff.g;
+
+				if (
+					diff.r >= -2 && diff.r <= 1 &&
+					diff.g >= -2 && diff.g <= 1 &&
+					diff.b >= -2 && diff.b <= 1
+				) {
+					*out++ = QOI_OP_DIFF | (diff.r + 2) << 4 | (diff.g + 2) << 2 | (diff.b + 2);
+				}
+
+				else if (
+					diff.g > -33 && diff.g < 32 &&
+					dr_dg > -9 && dr_dg < 8 &&
+					db_dg > -9 && db_dg < 8
+				) {
+					*out++ = QOI_OP_LUMA | (diff.g + 32);
+					*out++ = (dr_dg + 8) << 4 | (db_dg + 8);
+				}
+
+				else {
+					// The alpha byte lands where the next op goes, or on the end marker after the last one
+					*out++ = QOI_OP_RGB;
+					std::memcpy(out, &cur, 4);
+					out += 3;
+				}
+			}
+			else {
+				*out++ = QOI_OP_RGBA;
+				std::memcpy(out, &cur, 4);
+				out += 4;
+			}
+		}
 
-	std::vector<uint8_t> out(img.size_bytes() + QoiEncoder::hdr_size + 8);
+		prev = cur;
+		i++;
+	}
+
+	state.color_cache = std::bit_cast<std::array<qoi_color_t, 64>>(cache);
+	state.prev_pxl = std::bit_cast<qoi_color_t>(prev);
+	state.valid = valid;
+	state.run = static_cast<uint32_t>(pending);
+	return out;
+}
+
+
+/**
+ * @brief Encodes nb_rows rows of the image from first_row on, leaving the last run pending in state
+ *
+ * @param rgba_block scratch for the pixels of layouts other than RGB and RGBA 8 bits
+ */
+uint8_t* QoiEncoder::encode_rows(QoiState& state, const Image& img, uint32_t first_row, uint32_t nb_rows, uint8_t* out, std::vector<uint8_t>& rgba_block) {
+	const uint8_t nb_chan = img.nb_chan();
+	const size_t first = static_cast<size_t>(first_row) * img.width();
+	const size_t end = first + static_cast<size_t>(nb_rows) * img.width();
+
+	// RGB and RGBA are read in place
+	if (nb_chan == 4 && img.bit_depth() == 8)
+		return encode_pixels<4>(state, img.get_raw_handle() + first * 4, end - first, out);
+	if (nb_chan == 3 && img.bit_depth() == 8)
+		return encode_pixels<3>(state, img.get_raw_handle() + first * 3, end - first, out);
+
+	// Other layouts go through RGBA a block at a time, runs carry over from one block to the next
+	constexpr size_t block_size = 4096;
+	rgba_block.resize(block_size * 4);
+
+	for (size_t i = first; i < end; i += block_size) {
+		const size_t count = std::min(block_size, end - i);
+		to_rgba(img, i, count, rgba_block.data());
+		out = encode_pixels<4>(state, rgba_block.data(), count, out);
+	}
+
+	return out;
+}
+
+
+void QoiEncoder::encode(const Image& img, std::vector<uint8_t>& out, const EncodeOptions& opts) {
+	// QOI only knows RGB and RGBA: gray is written as RGB, gray alpha as RGBA
+	channels = (img.nb_chan() % 2 == 0) ? 4 : 3;
+
+	// Plain QOI is a single segment
+	const bool segmented = opts.qoi_segment_rows != 0;
+	const uint32_t segment_rows = std::max<uint32_t>(segmented ? std::min(opts.qoi_segment_rows, img.height()) : img.height(), 1);
+	const size_t nb_segments = (img.height() + segment_rows - 1) / segment_rows;
+
+	// Worst case is a QOI_OP_RGB or QOI_OP_RGBA per pixel, plus the QOI_OP_RGBA starting a segment and the byte
+	// QOI_OP_RGB writes past its end. Segments are encoded in slots of that size and packed afterwards
+	const size_t slot_size = static_cast<size_t>(segment_rows) * img.width() * (channels + 1) + 8;
+	const size_t trailer_size = segmented ? nb_segments * 8 + qoi_segments_fixed_size : 0;
+	out.resize(QoiEncoder::hdr_size + nb_segments * slot_size + end_marker.size() + trailer_size);
+	uint8_t* ptr = out.data();
 
 	auto write32 = [&] (uint32_t val) {
-		out.at(ptr++) = (0xff000000 & val) >> 24;
-		out.at(ptr++) = (0x00ff0000 & val) >> 16;
-		out.at(ptr++) = (0x0000ff00 & val) >> 8;
-		out.at(ptr++) = (0x000000ff & val);
+		*ptr++ = (0xff000000 & val) >> 24;
+		*ptr++ = (0x00ff0000 & val) >> 16;
+		*ptr++ = (0x0000ff00 & val) >> 8;
+		*ptr++ = (0x000000ff & val);
 	};
 
 	// Header
 	write32(magic);
 	write32(img.width());
 	write32(img.height());
-	out.at(ptr++) = channels;
-	out.at(ptr++) = static_cast<uint8_t>(colorspace);
+	*ptr++ = channels;
+	*ptr++ = static_cast<uint8_t>(colorspace);
 
+	std::vector<uint64_t> offsets;
 
-	for (size_t i = 0; i < img.size_bytes(); i += BYTE_PER_PIXEL) {
+	if (!segmented) {
+		rgba_blocks.resize(std::max<size_t>(rgba_blocks.size(), 1));
+		QoiState state;
+		ptr = encode_rows(state, img, 0, img.height(), ptr, rgba_blocks[0]);
 
-		qoi_color_t cur_pxl = {
-			img.get_raw_handle()[i],
-			img.get_raw_handle()[i + 1],
-			img.get_raw_handle()[i + 2],
-			img.get_raw_handle()[i + 3]
-		};
+		if (state.run > 0)
+			*ptr++ = QOI_OP_RUN | (state.run - 1);
+	}
+	else {
+		rgba_blocks.resize(std::max(rgba_blocks.size(), parallel_workers(nb_segments)));
+		segment_sizes.resize(nb_segments);
+		uint8_t* const slots = ptr;
 
+		parallel_for(nb_segments, [&](size_t worker, size_t i) {
+			const uint32_t first = i * segment_rows;
+			uint8_t* const start = slots + i * slot_size;
 
-		if (cur_pxl == prev_pxl) {
-			run++;
-			if (run == 62 || i == img.size_bytes() - BYTE_PER_PIXEL) {
-				out[ptr++] = QOI_OP_RUN | (run - 1);
-				run = 0;
-			}
+			QoiState state;
+			state.valid = 0;
+			uint8_t* end = encode_rows(state, img, first, std::min(segment_rows, img.height() - first), start, rgba_blocks[worker]);
+
+			// Runs do not cross segments
+			if (state.run > 0)
+				*end++ = QOI_OP_RUN | (state.run - 1);
+			segment_sizes[i] = end - start;
+		});
+
+		// Segments only move towards the start of the buffer, the first one is already in place
+		for (size_t i = 0; i < nb_segments; i++) {
+			offsets.push_back(ptr - out.data());
+			std::memmove(ptr, slots + i * slot_size, segment_sizes[i]);
+			ptr += segment_sizes[i];
+		}
+	}
+
+	std::memcpy(ptr, end_marker.data(), end_marker.size());
+	ptr += end_marker.size();
+
+	if (segmented) {
+		for (uint64_t offset : offsets) {
+			write32(offset >> 32);
+			write32(static_cast<uint32_t>(offset));
+		}
+		write32(segment_rows);
+		write32(nb_segments);
+		write32(trailer_size);
+		std::memcpy(ptr, qoi_segments_magic.data(), qoi_segments_magic.size());
+		ptr += qoi_segments_magic.size();
+	}
+
+	out.resize(ptr - out.data());
+}
+
+
+
+//======================================================
+// DECODING
+//======================================================
+
+/**
+ * @brief Converts RGBA 8 bits pixels to the layout of the output: gray, gray alpha, RGB or RGBA, 8 or 16 bits
+ */
+template <uint8_t OUT_CH, typename T>
+static void convert_row(const uint8_t* rgba, uint8_t* out, size_t count) {
+	// 16 bits samples are the 8 bits ones repeated in both bytes, 255 maps to 65535
+	constexpr unsigned widen = (sizeof(T) == 2) ? 257 : 1;
+	T* dst = reinterpret_cast<T*>(out);
+
+	for (size_t i = 0; i < count; i++, rgba += 4, dst += OUT_CH) {
+		if constexpr (OUT_CH >= 3) {
+			dst[0] = static_cast<T>(rgba[0] * widen);
+			dst[1] = static_cast<T>(rgba[1] * widen);
+			dst[2] = static_cast<T>(rgba[2] * widen);
+			if constexpr (OUT_CH == 4) dst[3] = static_cast<T>(rgba[3] * widen);
 		}
 		else {
-			if (run > 0) {
-				out[ptr++] = QOI_OP_RUN | (run - 1);
-				run = 0;
-			}
+			// BT.601 luma in 8.8 fixed point, as the PNG decoder does
+			dst[0] = static_cast<T>(((77 * rgba[0] + 150 * rgba[1] + 29 * rgba[2] + 128) >> 8) * widen);
+			if constexpr (OUT_CH == 2) dst[1] = static_cast<T>(rgba[3] * widen);
+		}
+	}
+}
+
+
+static void convert_row(const uint8_t* rgba, uint8_t* out, size_t count, uint8_t out_chan, uint8_t sample_size) {
+	if (sample_size == 2) {
+		switch (out_chan) {
+			case 1:  convert_row<1, uint16_t>(rgba, out, count); break;
+			case 2:  convert_row<2, uint16_t>(rgba, out, count); break;
+			case 3:  convert_row<3, uint16_t>(rgba, out, count); break;
+			default: convert_row<4, uint16_t>(rgba, out, count); break;
+		}
+	}
+	else {
+		switch (out_chan) {
+			case 1:  convert_row<1, uint8_t>(rgba, out, count); break;
+			case 2:  convert_row<2, uint8_t>(rgba, out, count); break;
+			case 3:  convert_row<3, uint8_t>(rgba, out, count); break;
+			default: std::memcpy(out, rgba, count * 4); break;
+		}
+	}
+}
+
+
+/**
+ * @brief Fills count pixels with px
+ *
+ * Every pixel but the last is stored as 4 bytes: for RGB the extra byte is overwritten by the next store.
+ */
+template <uint8_t NB_CHAN>
+static inline void store_pixels(uint8_t* dst, uint32_t px, size_t count) {
+	if (count == 0)
+		return;
+
+	for (size_t i = 0; i + 1 < count; i++)
+		std::memcpy(dst + i * NB_CHAN, &px, 4);
+	store_pixel<NB_CHAN>(dst + (count - 1) * NB_CHAN, px);
+}
+
+
+/**
+ * @brief Adds the 4 bytes of a and b each on their own, wrapping around at 256
+ */
+static inline uint32_t add_bytes(uint32_t a, uint32_t b) {
+	return ((a & 0x7F7F7F7F) + (b & 0x7F7F7F7F)) ^ ((a ^ b) & 0x80808080);
+}
+
+
+// Byte deltas of QOI_OP_DIFF, and of QOI_OP_LUMA split between its two bytes, by the low bits of the ops
+static constexpr auto diff_deltas = [] {
+	std::array<uint32_t, 64> t {};
+	for (int i = 0; i < 64; i++)
+		t[i] = pack(((i >> 4) & 3) - 2, ((i >> 2) & 3) - 2, (i & 3) - 2, 0);
+	return t;
+}();
+
+static constexpr auto luma_green_deltas = [] {
+	std::array<uint32_t, 64> t {};
+	for (int i = 0; i < 64; i++)
+		t[i] = pack(i - 32 - 8, i - 32, i - 32 - 8, 0);
+	return t;
+}();
+
+static constexpr auto luma_red_blue_deltas = [] {
+	std::array<uint32_t, 256> t {};
+	for (int i = 0; i < 256; i++)
+		t[i] = pack(i >> 4, 0, i & 0x0F, 0);
+	return t;
+}();
+
+
+bool QoiDecoder::can_decode(std::span<const uint8_t> data) const {
+	return data.size() >= 4 && data[0] == 'q' && data[1] == 'o' && data[2] == 'i' && data[3] == 'f';
+}
+
+
+std::expected<ImageInfo, IVMG_DEC_ERR> QoiDecoder::probe(std::span<const uint8_t> data) {
+	if (auto res = this->read_header(data, {}); !res.has_value())
+		return std::unexpected(res.error());
+
+	return ImageInfo { width, height, channels, 8, "qoi" };
+}
+
+
+std::expected<Image, IVMG_DEC_ERR> QoiDecoder::decode(std::span<const uint8_t> data, const DecodeOptions& opts) {
+	if (auto res = this->read_header(data, opts); !res.has_value())
+		return std::unexpected(res.error());
+
+	Image img (out_width, out_height, out_color, 8);
+
+	if (!this->write_pixels(PixelView::of(img)))
+		return std::unexpected(IVMG_DEC_ERR::CORRUPTED_DATA);
+
+	return img;
+}
+
+
+std::expected<void, IVMG_DEC_ERR> QoiDecoder::decode_into(std::span<const uint8_t> data, std::span<uint8_t> dst, size_t stride, PixelFormat fmt, const DecodeOptions& opts) {
+	if (bytes_per_pixel(fmt) == 0)
+		return std::unexpected(IVMG_DEC_ERR::UNSUPPORTED_PIXEL_FORMAT);
+
+	// 16 bits samples are written as uint16_t
+	const uint8_t sample_size = ivmg::bit_depth(fmt) / 8;
+	if (sample_size == 2 && (reinterpret_cast<uintptr_t>(dst.data()) % 2 != 0 || stride % 2 != 0)) {
+		Logger::log(LOG_LEVEL::ERROR, "16 bits pixels need 2 bytes aligned rows");
+		return std::unexpected(IVMG_DEC_ERR::UNSUPPORTED_PIXEL_FORMAT);
+	}
+
+	if (auto res = this->read_header(data, opts); !res.has_value())
+		return std::unexpected(res.error());
+
+	// The last row does not need the padding of the stride
+	const size_t row_size = static_cast<size_t>(out_width) * bytes_per_pixel(fmt);
+	if (stride < row_size || dst.size() < stride * (out_height - 1) + row_size) {
+		Logger::log(LOG_LEVEL::ERROR, "Buffer of {} bytes with stride {} is too small for {}x{} pixels", dst.size(), stride, out_width, out_height);
+		return std::unexpected(IVMG_DEC_ERR::BUFFER_TOO_SMALL);
+	}
+
+	if (!this->write_pixels(PixelView { dst.data(), stride, out_width, out_height, ivmg::channels(fmt), sample_size }))
+		return std::unexpected(IVMG_DEC_ERR::CORRUPTED_DATA);
+
+	return {};
+}
+
+
+/**
+ * @brief Reads the header, sets the output layout from the options and resets the decoding state
+ */
+std::expected<void, IVMG_DEC_ERR> QoiDecoder::read_header(std::span<const uint8_t> data, const DecodeOptions& opts) {
+	decode_start = std::chrono::high_resolution_clock::now();
+
+	if (data.size() < hdr_size + end_marker_size || !this->can_decode(data))
+		return std::unexpected(IVMG_DEC_ERR::INVALID_HEADER);
+
+	size_t idx = 4;
+	width = read<uint32_t, std::endian::big>(data, idx);
+	height = read<uint32_t, std::endian::big>(data, idx);
+	channels = read<uint8_t>(data, idx);
+	const uint8_t colorspace = read<uint8_t>(data, idx);
+
+	if (width == 0 || height == 0 || (channels != 3 && channels != 4) || colorspace > 1 || static_cast<uint64_t>(width) * height > max_pixels) {
+		Logger::log(LOG_LEVEL::ERROR, "Invalid QOI header: {}x{} pixels, {} channels, colorspace {}", width, height, channels, colorspace);
+		return std::unexpected(IVMG_DEC_ERR::INVALID_HEADER);
+	}
+
+	// Clip to the image, 64 bits to avoid overflows on x + w
+	const Rect roi = opts.roi.value_or(Rect { 0, 0, width, height });
+	const uint64_t x1 = std::min<uint64_t>(static_cast<uint64_t>(roi.x) + roi.w, width);
+	const uint64_t y1 = std::min<uint64_t>(static_cast<uint64_t>(roi.y) + roi.h, height);
+
+	if (x1 <= roi.x || y1 <= roi.y) {
+		Logger::log(LOG_LEVEL::ERROR, "Region {}x{}+{}+{} is outside of the {}x{} image", roi.w, roi.h, roi.x, roi.y, width, height);
+		return std::unexpected(IVMG_DEC_ERR::INVALID_REGION);
+	}
+
+	window = Rect { roi.x, roi.y, static_cast<uint32_t>(x1 - roi.x), static_cast<uint32_t>(y1 - roi.y) };
+	scale = std::bit_floor(std::clamp<uint8_t>(opts.scale, 1, 8));
+	out_width = (window.w + scale - 1) / scale;
+	out_height = (window.h + scale - 1) / scale;
+	out_color = (opts.force_rgba || channels == 4) ? ColorType::RGBA : ColorType::RGB;
+
+	this->read_segments(data);
+	state = QoiState {};
+	return {};
+}
+
+
+/**
+ * @brief Reads the segments table of segmented QOI files, and where the ops stop
+ *
+ * A table that does not match the image is ignored: the file is decoded as plain QOI.
+ */
+void QoiDecoder::read_segments(std::span<const uint8_t> data) {
+	chunks = data.subspan(hdr_size);
+	segment_rows = 0;
+	segment_offsets.clear();
+
+	if (data.size() < hdr_size + end_marker_size + qoi_segments_fixed_size || !std::equal(qoi_segments_magic.begin(), qoi_segments_magic.end(), data.end() - qoi_segments_magic.size()))
+		return;
+
+	size_t idx = data.size() - qoi_segments_fixed_size;
+	const uint32_t rows = read<uint32_t, std::endian::big>(data, idx);
+	const uint32_t count = read<uint32_t, std::endian::big>(data, idx);
+	const uint32_t size = read<uint32_t, std::endian::big>(data, idx);
+
+	if (rows == 0 || count != (static_cast<uint64_t>(height) + rows - 1) / rows || size != static_cast<uint64_t>(count) * 8 + qoi_segments_fixed_size
+		|| size > data.size() - hdr_size - end_marker_size) {
+		Logger::log(LOG_LEVEL::WARNING, "Invalid QOI segments table, decoding as plain QOI");
+		return;
+	}
+
+	// Every segment starts with a QOI_OP_RGBA, in order, before the end marker
+	const size_t ops_end = data.size() - size - end_marker_size;
+	idx = data.size() - size;
+	std::vector<uint64_t> offsets(count);
+
+	for (uint32_t i = 0; i < count; i++) {
+		offsets[i] = read<uint64_t, std::endian::big>(data, idx);
+		const bool in_order = (i == 0) ? offsets[i] == hdr_size : offsets[i] >= offsets[i - 1] + 5;
+
+		if (!in_order || offsets[i] >= ops_end || data[offsets[i]] != QOI_OP_RGBA) {
+			Logger::log(LOG_LEVEL::WARNING, "Invalid QOI segment {} at offset {}, decoding as plain QOI", i, offsets[i]);
+			return;
+		}
+	}
+
+	chunks = data.subspan(hdr_size, data.size() - size - hdr_size);
+	segment_rows = rows;
+	segment_offsets = std::move(offsets);
+}
+
+
+/**
+ * @brief The decoding state at the start of a segment
+ */
+QoiState QoiDecoder::segment_start(size_t segment) const {
+	QoiState st;
+	st.pos = segment_offsets[segment] - hdr_size;
+	return st;
+}
+
+
+/**
+ * @brief Decodes the next count pixels of the stream as RGB or RGBA
+ *
+ * Runs may go on past count: what is left of them is kept for the next call.
+ *
+ * @tparam NB_CHAN 3 to drop alpha, 4 to keep it
+ * @return false if the stream ends first
+ */
+template <uint8_t NB_CHAN>
+bool QoiDecoder::decode_pixels(QoiState& st, uint8_t* dst, size_t count) const {
+	uint8_t* const end = dst + count * NB_CHAN;
+
+	// Pixels are handled as the 4 bytes they take in memory. Locals rather than members, so that the compiler
+	// keeps them in registers and the cache on the stack without reloading them after every store to dst
+	std::array<uint32_t, 64> cache = std::bit_cast<std::array<uint32_t, 64>>(st.color_cache);
+	uint32_t px = std::bit_cast<uint32_t>(st.prev_pxl);
+	constexpr uint32_t alpha_mask = pack(0, 0, 0, 255);
+
+	const size_t first = std::min<size_t>(st.run, count);
+	store_pixels<NB_CHAN>(dst, px, first);
+	dst += first * NB_CHAN;
+	st.run -= static_cast<uint32_t>(first);
+
+	// An op is at most 5 bytes: starting one before the end marker never reads past the data
+	const uint8_t* p = chunks.data() + st.pos;
+	const uint8_t* const limit = chunks.data() + chunks.size() - end_marker_size;
 
-			uint16_t hash = hash_pixel(cur_pxl);
+	// Jump table on the 2 bits tag. QOI_OP_RGB and QOI_OP_RGBA share the tag of QOI_OP_RUN
+	static const void* const ops[4] = { &&op_index, &&op_diff, &&op_luma, &&op_run };
 
-			if (color_cache.at(hash) == cur_pxl) {
-				out[ptr++] = QOI_OP_INDEX | hash;
+	while (dst < end) {
+		if (p >= limit) [[unlikely]]
+			break;
+
+		const uint8_t b = *p++;
+		goto *ops[b >> 6];
+
+	op_index:
+		// Every op writes its color back to the cache, as the reference decoder does. A slot that was
+		// never written holds zero, which hashes elsewhere, so the color may not be in its own slot yet
+		px = cache[b];
+		goto store;
+
+	op_diff:
+		px = add_bytes(px, diff_deltas[b & 0x3F]);
+		goto store;
+
+	op_luma:
+		px = add_bytes(px, add_bytes(luma_green_deltas[b & 0x3F], luma_red_blue_deltas[*p++]));
+		goto store;
+
+	op_run:
+		if (b < QOI_OP_RGB) {
+			const size_t len = (b & 0x3F) + 1;
+			const size_t n = std::min<size_t>(len, (end - dst) / NB_CHAN);
+			cache[hash_packed(px)] = px;
+			store_pixels<NB_CHAN>(dst, px, n);
+			dst += n * NB_CHAN;
+			st.run = static_cast<uint32_t>(len - n);
+			continue;
+		}
+
+		// The 4th byte read for QOI_OP_RGB belongs to the next op, it is masked out
+		uint32_t color;
+		std::memcpy(&color, p, 4);
+		if (b == QOI_OP_RGBA) {
+			px = color;
+			p += 4;
+		}
+		else {
+			px = (color & ~alpha_mask) | (px & alpha_mask);
+			p += 3;
+		}
+
+	store:
+		cache[hash_packed(px)] = px;
+		store_pixel<NB_CHAN>(dst, px);
+		dst += NB_CHAN;
+	}
+
+	st.color_cache = std::bit_cast<std::array<qoi_color_t, 64>>(cache);
+	st.prev_pxl = std::bit_cast<qoi_color_t>(px);
+	st.pos = p - chunks.data();
+
+	if (dst < end) {
+		Logger::log(LOG_LEVEL::ERROR, "QOI data ends {} pixels early", (end - dst) / NB_CHAN);
+		return false;
+	}
+	return true;
+}
+
+
+/**
+ * @brief Decodes the segments of the whole image on every core, straight to an RGB or RGBA 8 bits output
+ *
+ * @return false if a segment does not end where the next one starts
+ */
+bool QoiDecoder::decode_segments(const PixelView& out) {
+	const bool contiguous = out.stride == static_cast<size_t>(width) * out.nb_chan;
+	std::atomic<bool> ok = true;
+
+	parallel_for(segment_offsets.size(), [&](size_t, size_t i) {
+		const uint32_t first = i * segment_rows;
+		const uint32_t nb_rows = std::min(segment_rows, height - first);
+		const size_t count = contiguous ? static_cast<size_t>(width) * nb_rows : width;
+		QoiState st = this->segment_start(i);
+
+		for (uint32_t y = first; y < first + (contiguous ? 1 : nb_rows); y++) {
+			if (!((out.nb_chan == 4) ? this->decode_pixels<4>(st, out.row(y), count) : this->decode_pixels<3>(st, out.row(y), count))) {
+				ok = false;
+				return;
 			}
-			else {
-				color_cache[hash] = cur_pxl;
-
-				if (cur_pxl.a == prev_pxl.a) {
-					const qoi_diff_t diff = color_diff(cur_pxl, prev_pxl);
-                    const int8_t dr_dg = diff.r - diff.g;
-                    const int8_t db_dg = diff.b - diff.g;
-
-                    if (
-                        diff.r >= -2 && diff.r <= 1 &&
-                        diff.g >= -2 && diff.g <= 1 &&
-                        diff.b >= -2 && diff.b <= 1
-                    ) {
-                        out[ptr++] = QOI_OP_DIFF | (diff.r + 2) << 4 | (diff.g + 2) << 2 | (diff.b + 2);
-                    }
-
-                    else if (
-                        diff.g > -33 && diff.g < 32 &&
-                        dr_dg > -9 && dr_dg < 8 &&
-                        db_dg > -9 && db_dg < 8
-                    ) {
-                        out[ptr++] = QOI_OP_LUMA | (diff.g + 32);
-                        out[ptr++] = (dr_dg + 8) << 4 | (db_dg + 8);
-                    }
-
-                    else {
-                        out[ptr++] = (QOI_OP_RGB);
-                        out[ptr++] = (cur_pxl.r);
-                        out[ptr++] = (cur_pxl.g);
-                        out[ptr++] = (cur_pxl.b);
-                    }
-				}
-				else {
-					out[ptr++] = (QOI_OP_RGBA);
-                    out[ptr++] = (cur_pxl.r);
-                    out[ptr++] = (cur_pxl.g);
-                    out[ptr++] = (cur_pxl.b);
-                    out[ptr++] = (cur_pxl.a);
-				}
+		}
+
+		const size_t end = (i + 1 < segment_offsets.size()) ? segment_offsets[i + 1] - hdr_size : chunks.size() - end_marker_size;
+		if (st.pos != end || st.run != 0)
+			ok = false;
+	});
+
+	return ok;
+}
+
+
+bool QoiDecoder::write_pixels(const PixelView& out) {
+	const bool full = window.x == 0 && window.y == 0 && window.w == width && window.h == height && scale == 1;
+	const bool native = (out.nb_chan == 4 || out.nb_chan == 3) && out.sample_size == 1;
+
+	// Straight to the output when it is RGB or RGBA 8 bits, in one go when the rows are contiguous
+	if (full && native) {
+		bool decoded = false;
+
+		// The whole stream is still plain QOI when the segments are off
+		if (!segment_offsets.empty()) {
+			decoded = this->decode_segments(out);
+			if (!decoded)
+				Logger::log(LOG_LEVEL::WARNING, "QOI segments do not match their table, decoding as plain QOI");
+		}
+
+		const bool contiguous = out.stride == static_cast<size_t>(width) * out.nb_chan;
+		const size_t count = contiguous ? static_cast<size_t>(width) * height : width;
+		const uint32_t nb_rows = contiguous ? 1 : height;
+
+		for (uint32_t y = 0; !decoded && y < nb_rows; y++) {
+			const bool ok = (out.nb_chan == 4) ? this->decode_pixels<4>(state, out.row(y), count) : this->decode_pixels<3>(state, out.row(y), count);
+			if (!ok)
+				return false;
+		}
+	}
+	else {
+		rgba_row.resize(static_cast<size_t>(width) * 4);
+		out_row.resize(static_cast<size_t>(window.w) * out.pixel_size());
+		if (scale > 1)
+			box.reset(window.w, scale, 1, out.nb_chan, out.sample_size);
+
+		// Segmented files start at the segment holding the first row of the region
+		uint32_t first_row = 0;
+		if (!segment_offsets.empty()) {
+			const size_t segment = window.y / segment_rows;
+			first_row = segment * segment_rows;
+			state = this->segment_start(segment);
+		}
+
+		// Rows below the region are never decoded
+		for (uint32_t y = first_row; y < window.y + window.h; y++) {
+			if (!this->decode_pixels<4>(state, rgba_row.data(), width))
+				return false;
+			if (y < window.y)
+				continue;
+
+			const uint32_t wy = y - window.y;
+			const uint8_t* src = rgba_row.data() + static_cast<size_t>(window.x) * 4;
+
+			if (scale == 1) {
+				convert_row(src, out.row(wy), window.w, out.nb_chan, out.sample_size);
+				continue;
 			}
+
+			convert_row(src, out_row.data(), window.w, out.nb_chan, out.sample_size);
+			box.add(out_row.data(), window.w, 0, 1, 0);
+
+			// The last block of rows may be shorter
+			if ((wy + 1) % scale == 0 || wy + 1 == window.h)
+				box.resolve(out.row(wy / scale), 0, wy % scale + 1);
 		}
-		prev_pxl = cur_pxl;
 	}
-	std::memcpy(out.data() + ptr, end_marker.data(), end_marker.size());
-	ptr += end_marker.size();
-	return out;
+
+	auto end = std::chrono::high_resolution_clock::now();
+	Logger::log(LOG_LEVEL::INFO, "Decoded QOI of size {}x{} in {}", out.width, out.height, std::chrono::duration_cast<std::chrono::milliseconds>(end - decode_start));
+	return true;
 }
 
 
@@ -1,8 +1,19 @@
 #pragma once
 
+#include "ivmg/codecs/decoder.hpp"
 #include "ivmg/codecs/encoder.hpp"
+#include <ivmg/core/image.hpp>
+#include <ivmg/core/rect.hpp>
+
+#include "common/box_accumulator.hpp"
+#include "common/pixel_view.hpp"
+
+#include <array>
+#include <chrono>
 #include <cstddef>
 #include <filesystem>
+#include <span>
+#include <vector>
 
 namespace ivmg {
 
@@ -50,6 +61,35 @@ constexpr size_t QOI_PIXEL_HASH(const qoi_color_t& c);
 
 
 
+/**
+ * @brief What QOI encoders and decoders carry over from one pixel to the next. Segments each have their own
+ */
+struct QoiState {
+	std::array<qoi_color_t, 64> color_cache {};
+	qoi_color_t prev_pxl { 0, 0, 0, 255 };
+	uint32_t run = 0;			// Encoders: pixels in the pending run. Decoders: pixels left in the last QOI_OP_RUN
+	uint64_t valid = ~0ull;		// Cache slots QOI_OP_INDEX may use. None at the start of a segment, see QoiEncoder
+	size_t pos = 0;				// Decoders: offset of the next op after the header
+};
+
+
+/**
+ * @brief Segmented QOI trailer, after the end marker, where plain decoders do not look:
+ * the big endian file offset of every segment as uint64_t, then rows per segment, number
+ * of segments and size of the whole trailer as uint32_t, then the magic.
+ */
+constexpr std::array<uint8_t, 4> qoi_segments_magic { 'q', 's', 'e', 'g' };
+constexpr size_t qoi_segments_fixed_size = 3 * 4 + qoi_segments_magic.size();
+
+
+
+/**
+ * @brief QOI encoder. With EncodeOptions::qoi_segment_rows, images are split in segments encoded in parallel.
+ *
+ * A segment starts with a fresh state: its first pixel is a QOI_OP_RGBA and QOI_OP_INDEX only
+ * refers to colors it has cached itself. Runs stop at its end. Decoding the segments one after
+ * the other without resetting anything gives the same pixels, so plain QOI decoders read the file.
+ */
 class QoiEncoder: public Encoder {
 private:
 	// File metadata
@@ -59,19 +99,67 @@ private:
 	uint8_t channels = 4;
 	QOI_COLORSPACE colorspace = QOI_COLORSPACE::SRGB;
 
-	std::array<qoi_color_t, 64> color_cache {};
-	std::vector<uint8_t> encoded_data;
-	qoi_color_t prev_pxl { 0, 0, 0, 255 };
-	uint16_t run = 0;
-	size_t ptr = 0;
+	std::vector<std::vector<uint8_t>> rgba_blocks;	// Per worker: pixels of other layouts, converted to RGBA
+	std::vector<size_t> segment_sizes;
 
 	// Helpers
-	static uint16_t hash_pixel(const qoi_color_t& c);
 	static qoi_diff_t color_diff(const qoi_color_t& c1, const qoi_color_t& c2);
+	template <uint8_t NB_CHAN>
+	static uint8_t* encode_pixels(QoiState& state, const uint8_t* pixels, size_t count, uint8_t* out);
+	static uint8_t* encode_rows(QoiState& state, const Image& img, uint32_t first_row, uint32_t nb_rows, uint8_t* out, std::vector<uint8_t>& rgba_block);
 
 public:
 	QoiEncoder() = default;
-	std::vector<uint8_t> encode(const Image& img) override;
+	void encode(const Image& img, std::vector<uint8_t>& out, const EncodeOptions& opts) override;
+};
+
+
+
+class QoiDecoder: public Decoder {
+private:
+	// File metadata
+	static constexpr size_t hdr_size = 14;
+	static constexpr size_t end_marker_size = 8;
+	static constexpr uint64_t max_pixels = 400'000'000;		// Same limit as the reference decoder
+	uint32_t width = 0;
+	uint32_t height = 0;
+	uint8_t channels = 4;
+
+	// Output
+	Rect window {};				// Part of the image to decode, roi clipped to the image
+	uint8_t scale = 1;
+	uint32_t out_width = 0;
+	uint32_t out_height = 0;
+	ColorType out_color = ColorType::RGBA;
+
+	// Decoding state, carried over from one call to decode_pixels to the next
+	std::span<const uint8_t> chunks;		// Everything after the header, end marker included
+	QoiState state;
+
+	// Segmented QOI, empty for plain files
+	uint32_t segment_rows = 0;
+	std::vector<uint64_t> segment_offsets;
+
+	// Scratch buffers, kept from one image to the next
+	std::vector<uint8_t> rgba_row;			// A decoded row, when it needs converting before reaching the output
+	std::vector<uint8_t> out_row;			// The same row in the output layout, before downscaling
+	BoxAccumulator box;
+	std::chrono::time_point<std::chrono::high_resolution_clock> decode_start;
+
+	std::expected<void, IVMG_DEC_ERR> read_header(std::span<const uint8_t> data, const DecodeOptions& opts);
+	void read_segments(std::span<const uint8_t> data);
+	QoiState segment_start(size_t segment) const;
+	template <uint8_t NB_CHAN>
+	bool decode_pixels(QoiState& st, uint8_t* dst, size_t count) const;
+	bool decode_segments(const PixelView& out);
+	bool write_pixels(const PixelView& out);
+
+public:
+	QoiDecoder() = default;
+	bool can_decode(std::span<const uint8_t> data) const override;
+	std::expected<ImageInfo, IVMG_DEC_ERR> probe(std::span<const uint8_t> data) override;
+	std::expected<Image, IVMG_DEC_ERR> decode(std::span<const uint8_t> data, const DecodeOptions& opts) override;
+	std::expected<void, IVMG_DEC_ERR> decode_into(std::span<const uint8_t> data, std::span<uint8_t> dst, size_t stride, PixelFormat fmt, const DecodeOptions& opts) override;
 };
 
 
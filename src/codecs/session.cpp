@@ -0,0 +1,150 @@
+#include <ivmg/codecs/session.hpp>
+#include <ivmg/codecs/codecs.hpp>
+#include <ivmg/codecs/decoder.hpp>
+#include <ivmg/codecs/encoder.hpp>
+#include <ivmg/core/image.hpp>
+
+#include "common/mapped_file.hpp"
+
+#include <fstream>
+
+
+namespace ivmg {
+
+	std::expected<Image, IVMG_DEC_ERR> Decoder::decode_shared(std::span<uint8_t> data, std::shared_ptr<void>, const DecodeOptions& opts) {
+		return this->decode(data, opts);
+	}
+
+
+
+	DecodeSession::DecodeSession() = default;
+	DecodeSession::~DecodeSession() = default;
+
+
+	Decoder* DecodeSession::find_decoder(std::span<const uint8_t> data) {
+		const auto& factories = CodecRegistry::get_instance().decoders;
+
+		// Decoders may have been registered since the last call
+		if (decoders.size() < factories.size())
+			decoders.resize(factories.size());
+
+		for (size_t i = 0; i < factories.size(); i++) {
+			if (!decoders[i])
+				decoders[i] = factories[i]();
+
+			if (decoders[i]->can_decode(data))
+				return decoders[i].get();
+		}
+
+		return nullptr;
+	}
+
+
+	std::expected<Image, IVMG_DEC_ERR> DecodeSession::decode(const std::filesystem::path& imgpath, const DecodeOptions& opts) {
+		// Shared with the image when the decoder returns a view of the mapping. Copy on write, images can be modified
+		auto file = std::make_shared<MappedFile>(imgpath, true);
+
+		if (!file->is_open())
+			return std::unexpected(IVMG_DEC_ERR::UNREADABLE_FILE);
+
+		Decoder* dec = this->find_decoder(file->bytes());
+
+		if (dec == nullptr)
+			return std::unexpected(IVMG_DEC_ERR::UNKNOWN_FORMAT);
+
+		return dec->decode_shared(file->writable_bytes(), file, opts);
+	}
+
+
+	std::expected<Image, IVMG_DEC_ERR> DecodeSession::decode(std::span<const uint8_t> data, const DecodeOptions& opts) {
+		Decoder* dec = this->find_decoder(data);
+
+		if (dec == nullptr)
+			return std::unexpected(IVMG_DEC_ERR::UNKNOWN_FORMAT);
+
+		return dec->decode(data, opts);
+	}
+
+
+
+	std::expected<void, IVMG_DEC_ERR> DecodeSession::decode_into(const std::filesystem::path& imgpath, std::span<uint8_t> dst, size_t stride, PixelFormat fmt, const DecodeOptions& opts) {
+		const MappedFile file(imgpath);
+
+		if (!file.is_open())
+			return std::unexpected(IVMG_DEC_ERR::UNREADABLE_FILE);
+
+		return this->decode_into(file.bytes(), dst, stride, fmt, opts);
+	}
+
+
+	std::expected<void, IVMG_DEC_ERR> DecodeSession::decode_into(std::span<const uint8_t> data, std::span<uint8_t> dst, size_t stride, PixelFormat fmt, const DecodeOptions& opts) {
+		Decoder* dec = this->find_decoder(data);
+
+		if (dec == nullptr)
+			return std::unexpected(IVMG_DEC_ERR::UNKNOWN_FORMAT);
+
+		return dec->decode_into(data, dst, stride, fmt, opts);
+	}
+
+
+
+	std::expected<ImageInfo, IVMG_DEC_ERR> DecodeSession::probe(const std::filesystem::path& imgpath) {
+		const MappedFile file(imgpath);
+
+		if (!file.is_open())
+			return std::unexpected(IVMG_DEC_ERR::UNREADABLE_FILE);
+
+		return this->probe(file.bytes());
+	}
+
+
+	std::expected<ImageInfo, IVMG_DEC_ERR> DecodeSession::probe(std::span<const uint8_t> data) {
+		Decoder* dec = this->find_decoder(data);
+
+		if (dec == nullptr)
+			return std::unexpected(IVMG_DEC_ERR::UNKNOWN_FORMAT);
+
+		return dec->probe(data);
+	}
+
+
+
+	EncodeSession::EncodeSession() = default;
+	EncodeSession::~EncodeSession() = default;
+
+
+	Encoder* EncodeSession::find_encoder(const std::string& ext) {
+		if (auto it = encoders.find(ext); it != encoders.end())
+			return it->second.get();
+
+		const auto& factories = CodecRegistry::get_instance().encoders;
+		if (!factories.contains(ext))
+			return nullptr;
+
+		return encoders.emplace(ext, factories.at(ext)()).first->second.get();
+	}
+
+
+	std::expected<std::span<const uint8_t>, IVMG_ENC_ERR> EncodeSession::encode(const Image& img, const std::string& ext, const EncodeOptions& opts) {
+		Encoder* enc = this->find_encoder(ext);
+
+		if (enc == nullptr)
+			return std::unexpected(IVMG_ENC_ERR::UNSUPPORTED_FORMAT);
+
+		enc->encode(img, buffer, opts);
+		return std::span<const uint8_t>(buffer);
+	}
+
+
+	std::expected<void, IVMG_ENC_ERR> EncodeSession::encode(const Image& img, const std::filesystem::path& imgpath, const EncodeOptions& opts) {
+		auto encoded = this->encode(img, imgpath.extension().string(), opts);
+
+		if (!encoded.has_value())
+			return std::unexpected(encoded.error());
+
+		std::ofstream outfile(imgpath, std::ios::binary);
+		outfile.write(reinterpret_cast<const char*>(encoded->data()), encoded->size());
+		return {};
+	}
+
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+/**
+ * @brief Box filter downscaler fed one input row at a time.
+ *
+ * Sums the samples of every scale x scale block of the input into a few
+ * accumulator rows, then averages them into the output. Only the reduced
+ * image is ever stored, never the full size one. Blocks of 8x8 16 bits
+ * samples still fit the 32 bits sums.
+ */
+class BoxAccumulator {
+private:
+    size_t scale = 1;
+    size_t in_width = 0;
+    size_t out_width = 0;
+    size_t nb_chan = 4;         // Number of channels per pixel
+    size_t sample_size = 1;     // Bytes per sample, 1 or 2
+    std::vector<uint32_t> sums;
+
+    template <typename T>
+    void add_samples(const T* pixels, size_t count, size_t x, size_t step, size_t row) {
+        uint32_t* acc = sums.data() + row * out_width * nb_chan;
+
+        for (size_t i = 0; i < count; i++, x += step, pixels += nb_chan) {
+            uint32_t* block = acc + (x / scale) * nb_chan;
+            for (size_t c = 0; c < nb_chan; c++)
+                block[c] += pixels[c];
+        }
+    }
+
+    template <typename T>
+    void resolve_samples(T* out, size_t row, size_t block_h) {
+        uint32_t* acc = sums.data() + row * out_width * nb_chan;
+
+        for (size_t ox = 0; ox < out_width; ox++, acc += nb_chan, out += nb_chan) {
+            // Blocks on the right edge may be narrower
+            const uint32_t area = std::min(scale, in_width - ox * scale) * block_h;
+
+            for (size_t c = 0; c < nb_chan; c++)
+                out[c] = static_cast<T>((acc[c] + area / 2) / area);
+        }
+    }
+
+public:
+    /**
+     * @brief Prepare the accumulator for a new image
+     *
+     * @param in_w the width of the full size input
+     * @param factor the side of a block, in input pixels
+     * @param nb_rows the number of output rows accumulated at the same time
+     * @param chans the number of channels per pixel
+     * @param bytes_per_sample 1 for 8 bits samples, 2 for native order 16 bits ones
+     */
+    void reset(size_t in_w, size_t factor, size_t nb_rows, size_t chans, size_t bytes_per_sample) {
+        scale = factor;
+        in_width = in_w;
+        out_width = (in_w + factor - 1) / factor;
+        nb_chan = chans;
+        sample_size = bytes_per_sample;
+        sums.assign(out_width * nb_rows * nb_chan, 0);
+    }
+
+    /**
+     * @brief Add pixels of one input row to their blocks
+     *
+     * @param pixels the packed input pixels
+     * @param count the number of pixels
+     * @param x the input column of the first pixel
+     * @param step the distance in input columns between two pixels
+     * @param row the accumulator row receiving the pixels
+     */
+    void add(const uint8_t* pixels, size_t count, size_t x, size_t step, size_t row) {
+        if (sample_size == 2)
+            add_samples(reinterpret_cast<const uint16_t*>(pixels), count, x, step, row);
+        else
+            add_samples(pixels, count, x, step, row);
+    }
+
+    /**
+     * @brief Average an accumulator row into an output row and clear it
+     *
+     * @param out the output row, out_width pixels
+     * @param row the accumulator row
+     * @param block_h the number of input rows summed into it, less than scale on the last row
+     */
+    void resolve(uint8_t* out, size_t row, size_t block_h) {
+        if (sample_size == 2)
+            resolve_samples(reinterpret_cast<uint16_t*>(out), row, block_h);
+        else
+            resolve_samples(out, row, block_h);
+
+        std::memset(sums.data() + row * out_width * nb_chan, 0, out_width * nb_chan * sizeof(uint32_t));
+    }
+};
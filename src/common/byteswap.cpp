@@ -0,0 +1,71 @@
+#include "byteswap.hpp"
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <immintrin.h>
+    #define IVMG_X86 1
+#endif
+
+
+using Byteswap16Fn = void (*)(const uint8_t* src, uint8_t* dst, size_t count);
+
+
+static void byteswap16_scalar(const uint8_t* src, uint8_t* dst, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        const uint8_t hi = src[2 * i];
+        dst[2 * i] = src[2 * i + 1];
+        dst[2 * i + 1] = hi;
+    }
+}
+
+
+#ifdef IVMG_X86
+
+__attribute__((target("ssse3")))
+static void byteswap16_ssse3(const uint8_t* src, uint8_t* dst, size_t count) {
+    const __m128i swap = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 2 * i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 2 * i), _mm_shuffle_epi8(v, swap));
+    }
+
+    byteswap16_scalar(src + 2 * i, dst + 2 * i, count - i);
+}
+
+
+__attribute__((target("avx2")))
+static void byteswap16_avx2(const uint8_t* src, uint8_t* dst, size_t count) {
+    // The shuffle works within each 128 bits lane, the same mask is repeated
+    const __m256i swap = _mm256_setr_epi8(
+        1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+        1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14
+    );
+    size_t i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 2 * i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + 2 * i), _mm256_shuffle_epi8(v, swap));
+    }
+
+    byteswap16_ssse3(src + 2 * i, dst + 2 * i, count - i);
+}
+
+#endif
+
+
+static Byteswap16Fn select_byteswap16() {
+#ifdef IVMG_X86
+    if (__builtin_cpu_supports("avx2")) return byteswap16_avx2;
+    if (__builtin_cpu_supports("ssse3")) return byteswap16_ssse3;
+#endif
+    return byteswap16_scalar;
+}
+
+
+void byteswap16(const uint8_t* src, uint8_t* dst, size_t count) {
+    static const Byteswap16Fn fn = select_byteswap16();
+    fn(src, dst, count);
+}
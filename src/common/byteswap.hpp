@@ -0,0 +1,16 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief Swaps the two bytes of consecutive 16 bits samples.
+ *
+ * Converts big endian file data (PNG, PAM) to native order and back.
+ * Uses SSSE3 or AVX2 shuffles when the running CPU has them.
+ *
+ * @param src the samples to swap
+ * @param dst where to write the swapped samples. May be src itself
+ * @param count the number of samples, not bytes
+ */
+void byteswap16(const uint8_t* src, uint8_t* dst, size_t count);
@@ -4,6 +4,7 @@
 #include <iostream>
 #include <unordered_map>
 #include <string>
+#include <string_view>
 #include <print>
 
 enum class LOG_LEVEL{
@@ -28,13 +29,14 @@ class Logger {
         static LOG_LEVEL level;
 
         template <typename... Args>
-        inline static void log(LOG_LEVEL lvl, const std::string &msg, Args&&... args) {
+        inline static void log(LOG_LEVEL lvl, std::string_view msg, Args&&... args) {
+            // A string_view keeps filtered out calls free of any allocation
             if (lvl > level)
             	return;
 
             auto formated_msg = std::vformat(msg, std::make_format_args(args...));
             std::println( (lvl >= LOG_LEVEL::ERROR) ? std::cerr : std::cout,
-            	"{}{}", log_level_to_str.at(lvl), std::vformat(msg, std::make_format_args(args...)));
+            	"{}{}", log_level_to_str.at(lvl), formated_msg);
         }
 
 };
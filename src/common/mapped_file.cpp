@@ -0,0 +1,74 @@
+#include "common/mapped_file.hpp"
+#include "common/logger.hpp"
+
+#include <algorithm>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+MappedFile::MappedFile(const std::filesystem::path& path, bool writable) {
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        Logger::log(LOG_LEVEL::ERROR, "Could not open {}", path.string());
+        return;
+    }
+
+    struct stat st {};
+    const bool regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+
+    if (regular && st.st_size > 0) {
+        void* map = mmap(nullptr, st.st_size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (map != MAP_FAILED) {
+            // Decoders read the file front to back: let the kernel read ahead aggressively
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+            addr = static_cast<uint8_t*>(map);
+            length = st.st_size;
+            mapped = true;
+            valid = true;
+        }
+    }
+
+    if (!mapped)
+        valid = this->read_all(fd, regular ? st.st_size : 0);
+
+    ::close(fd);
+}
+
+
+MappedFile::~MappedFile() {
+    if (mapped)
+        munmap(addr, length);
+}
+
+
+bool MappedFile::read_all(int fd, size_t size_hint) {
+    fallback.resize(std::max<size_t>(size_hint, 64 * 1024));
+    size_t total = 0;
+
+    while (true) {
+        if (total == fallback.size())
+            fallback.resize(fallback.size() * 2);
+
+        const ssize_t n = ::read(fd, fallback.data() + total, fallback.size() - total);
+
+        if (n == 0) break;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            Logger::log(LOG_LEVEL::ERROR, "Read failed with errno {}", errno);
+            return false;
+        }
+
+        total += n;
+    }
+
+    fallback.resize(total);
+    addr = fallback.data();
+    length = total;
+    return true;
+}
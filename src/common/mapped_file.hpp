@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <span>
+#include <vector>
+
+/**
+ * @brief Read only view of a whole file, memory mapped when possible.
+ *
+ * Falls back to reading the file into an owned buffer when it cannot be
+ * mapped (pipes, special files, mmap failures). Writable files are mapped
+ * copy on write: changes stay in this process, the file is never modified.
+ */
+class MappedFile {
+private:
+    uint8_t* addr = nullptr;
+    size_t length = 0;
+    bool mapped = false;
+    bool valid = false;
+    std::vector<uint8_t> fallback;
+
+public:
+    explicit MappedFile(const std::filesystem::path& path, bool writable = false);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    inline bool is_open() const { return valid; }
+    inline std::span<const uint8_t> bytes() const { return { addr, length }; }
+    inline std::span<uint8_t> writable_bytes() { return { addr, length }; }    // Files opened writable only
+
+private:
+    bool read_all(int fd, size_t size_hint);
+};
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Number of cores assumed instead of the real one when not 0, so that tests run the parallel paths on any host
+ */
+inline std::atomic<size_t> forced_workers {0};
+
+
+/**
+ * @brief Number of threads parallel_for uses for the given amount of work
+ */
+inline size_t parallel_workers(size_t count) {
+    const size_t cores = (forced_workers > 0) ? forced_workers.load() : std::thread::hardware_concurrency();
+    return std::clamp<size_t>(cores, 1, std::max<size_t>(count, 1));
+}
+
+
+/**
+ * @brief Calls fn(worker, i) for every i in [0, count), spread over parallel_workers(count) threads.
+ *
+ * Items are handed out in order to the first idle worker. worker is in
+ * [0, parallel_workers(count)) and lets fn use per-thread scratch state.
+ * The calling thread is worker 0. Returns once every item is done.
+ */
+template <typename F>
+void parallel_for(size_t count, F&& fn) {
+    const size_t nb_workers = parallel_workers(count);
+    std::atomic<size_t> next {0};
+
+    auto work = [&](size_t worker) {
+        for (size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < count;)
+            fn(worker, i);
+    };
+
+    std::vector<std::jthread> threads;
+    threads.reserve(nb_workers - 1);
+
+    for (size_t w = 1; w < nb_workers; w++)
+        threads.emplace_back(work, w);
+
+    work(0);
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <ivmg/core/image.hpp>
+#include <ivmg/core/rect.hpp>
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief Non owning view of the rows decoders write to: an Image or a caller provided buffer
+ */
+struct PixelView {
+    uint8_t* data;
+    size_t stride;          // Distance in bytes between the start of two rows
+    uint32_t width;
+    uint32_t height;
+    uint8_t nb_chan;
+    uint8_t sample_size;    // Bytes per sample, 1 or 2
+
+    static PixelView of(ivmg::Image& img) {
+        const size_t stride = static_cast<size_t>(img.width()) * img.nb_chan() * img.bytes_per_sample();
+        return { img.get_raw_handle(), stride, img.width(), img.height(), img.nb_chan(), img.bytes_per_sample() };
+    }
+
+    // The given rectangle, which must be inside the view
+    inline PixelView crop(const ivmg::Rect& r) const {
+        return { row(r.y) + r.x * pixel_size(), stride, r.w, r.h, nb_chan, sample_size };
+    }
+
+    inline uint8_t* row(size_t y) const { return data + y * stride; }
+    inline uint8_t pixel_size() const { return nb_chan * sample_size; }
+};
+
+
+/**
+ * @brief Read only counterpart of PixelView, for the rows encoders read from
+ */
+struct ConstPixelView {
+    const uint8_t* data;
+    size_t stride;
+    uint32_t width;
+    uint32_t height;
+    uint8_t nb_chan;
+    uint8_t sample_size;
+
+    static ConstPixelView of(const ivmg::Image& img) {
+        const size_t stride = static_cast<size_t>(img.width()) * img.nb_chan() * img.bytes_per_sample();
+        return { img.get_raw_handle(), stride, img.width(), img.height(), img.nb_chan(), img.bytes_per_sample() };
+    }
+
+    inline ConstPixelView crop(const ivmg::Rect& r) const {
+        return { row(r.y) + r.x * pixel_size(), stride, r.w, r.h, nb_chan, sample_size };
+    }
+
+    inline const uint8_t* row(size_t y) const { return data + y * stride; }
+    inline uint8_t pixel_size() const { return nb_chan * sample_size; }
+};
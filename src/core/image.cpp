@@ -4,20 +4,27 @@
 #include <ivmg/imgproc/filter.hpp>
 #include <ivmg/codecs/codecs.hpp>
 
+#include <limits>
 #include <print>
 #include <thread>
+#include <utility>
 
 namespace ivmg {
 using namespace imgproc::filt;
 
 Image Image::operator|(const Conv& f) {
 
-    Image out(w, h);
+    Image out(w, h, color_type, depth);
     const size_t num_threads = std::thread::hardware_concurrency();
     const size_t pixels_per_thread = (w * h) / num_threads;
 
 
-    auto convolve_scalar_worker = [] (const Image& img, const Conv& filter, Image& out, size_t start_pxl, size_t end_pxl) {
+    // Instantiated once per sample type: the 8 bits path does not pay for the 16 bits one
+    auto convolve_scalar_worker = [] <typename T> (const Image& img, const Conv& filter, Image& out, size_t start_pxl, size_t end_pxl) {
+
+        constexpr float max_sample = std::numeric_limits<T>::max();
+        const T* src = reinterpret_cast<const T*>(img.get_raw_handle());
+        T* dst = reinterpret_cast<T*>(out.get_raw_handle());
 
         std::vector<float> pxl_tmp(img.nb_channels);
 
@@ -45,12 +52,12 @@ Image Image::operator|(const Conv& f) {
                 for (size_t c = 0; c < img.nb_channels; c++) {
                     auto iidx = (kiy * img.w + kix) * img.nb_channels + c;
 
-                    pxl_tmp[c] += img.data[iidx] * filter.kernel[k];
+                    pxl_tmp[c] += src[iidx] * filter.kernel[k];
                 }
             }
 
             for (size_t c = 0; c < img.nb_channels; c++) {
-                out.data[i + c] = static_cast<uint8_t>(std::clamp(pxl_tmp[c], 0.0f, 255.0f));
+                dst[i + c] = static_cast<T>(std::clamp(pxl_tmp[c], 0.0f, max_sample));
             }
         }
     };
@@ -63,7 +70,10 @@ Image Image::operator|(const Conv& f) {
             size_t start = i * pixels_per_thread;
             size_t end = (i == num_threads - 1) ? w * h : start + pixels_per_thread;
 
-            threads.emplace_back(convolve_scalar_worker, std::cref(*this), std::cref(f), std::ref(out), start, end);
+            if (depth == 16)
+                threads.emplace_back([&, start, end] { convolve_scalar_worker.operator()<uint16_t>(*this, f, out, start, end); });
+            else
+                threads.emplace_back([&, start, end] { convolve_scalar_worker.operator()<uint8_t>(*this, f, out, start, end); });
         }
     }
 
@@ -71,32 +81,42 @@ Image Image::operator|(const Conv& f) {
 
 }
 
-std::expected<void, IVMG_ENC_ERR> Image::save(const std::filesystem::path& imgpath) {
-	return CodecRegistry::encode(*this, imgpath);
+std::expected<void, IVMG_ENC_ERR> Image::save(const std::filesystem::path& imgpath, const EncodeOptions& opts) {
+	return CodecRegistry::encode(*this, imgpath, opts);
 }
 
 
 
-Image::Image(const uint32_t width, const uint32_t height, ColorType ct): w(width), h(height), color_type(ct)
+Image::Image(const uint32_t width, const uint32_t height, ColorType ct, uint8_t bit_depth): w(width), h(height), color_type(ct), depth(bit_depth)
 {
     nb_channels = colortype_to_chan_nb.at(color_type);
-    data.resize(width * height * nb_channels, 255);
+    // All bytes at 255 is also the maximum of 16 bits samples
+    data.resize(static_cast<size_t>(width) * height * nb_channels * bytes_per_sample(), 255);
 };
 
 
-Image Image::operator=(Image& other) {
+Image::Image(const Image& other): w(other.w), h(other.h), color_type(other.color_type), nb_channels(other.nb_channels), depth(other.depth)
+{
+    // Views stay cheap to pass around by moving them, copying one takes its pixels
+    data.assign(other.get_raw_handle(), other.get_raw_handle() + other.size_bytes());
+}
 
-	Image out(other.w, other.h, other.color_type);
-	size_t idx = 0;
 
-	for (Pixel p : other) {
-		data[idx++] = p.r();
-		data[idx++] = p.g();
-		data[idx++] = p.b();
-		data[idx++] = p.a();
-	}
+Image Image::view(uint32_t width, uint32_t height, ColorType ct, uint8_t bit_depth, uint8_t* pixels, std::shared_ptr<void> owner) {
+    Image img(0, 0, ct, bit_depth);
+    img.w = width;
+    img.h = height;
+    img.view_pixels = pixels;
+    img.owner = std::move(owner);
+    return img;
+}
+
 
-	return out;
+Image& Image::operator=(const Image& other) {
+    // Same as the copy constructor: the pixels of a view are copied, the result owns them
+    Image copy(other);
+    std::swap(*this, copy);
+    return *this;
 }
 
 
@@ -8,23 +8,52 @@ enum class Formats;
 
 LOG_LEVEL Logger::level = LOG_LEVEL::NONE;
 
-Image ivmg::open(const std::string& imgpath) {
-    std::ifstream file(imgpath, std::ios::binary);
-
-    std::vector<uint8_t> file_buffer;
-
-    auto res = CodecRegistry::decode(file);
+Image ivmg::open(const std::string& imgpath, const DecodeOptions& opts) {
+    auto res = CodecRegistry::decode(imgpath, opts);
     if (res.has_value()) {
-        return res.value();
+        return *std::move(res);
     }
     else {
         switch (res.error()) {
             case IVMG_DEC_ERR::UNKNOWN_FORMAT:
-            break;
+                Logger::log(LOG_LEVEL::ERROR, "Unknown format");
+                break;
+            case IVMG_DEC_ERR::UNREADABLE_FILE:
+                Logger::log(LOG_LEVEL::ERROR, "Could not read {}", imgpath);
+                break;
+            case IVMG_DEC_ERR::INVALID_HEADER:
+                Logger::log(LOG_LEVEL::ERROR, "Invalid image header");
+                break;
+            case IVMG_DEC_ERR::CORRUPTED_DATA:
+                Logger::log(LOG_LEVEL::ERROR, "Corrupted image data");
+                break;
+            case IVMG_DEC_ERR::CRC_MISMATCH:
+                Logger::log(LOG_LEVEL::ERROR, "Checksum mismatch in {}", imgpath);
+                break;
+            case IVMG_DEC_ERR::INVALID_REGION:
+                Logger::log(LOG_LEVEL::ERROR, "Requested region is outside of the image");
+                break;
+            case IVMG_DEC_ERR::BUFFER_TOO_SMALL:
+            case IVMG_DEC_ERR::UNSUPPORTED_PIXEL_FORMAT:
+                Logger::log(LOG_LEVEL::ERROR, "Invalid destination buffer");
+                break;
         }
     }
 
-
-    Logger::log(LOG_LEVEL::ERROR, "Unknown format");
     exit(1);
 };
+
+
+std::expected<void, IVMG_ENC_ERR> ivmg::save(const Image& img, const std::filesystem::path& imgpath, const EncodeOptions& opts) {
+    return CodecRegistry::encode(img, imgpath, opts);
+}
+
+
+std::expected<ImageInfo, IVMG_DEC_ERR> ivmg::probe(const std::filesystem::path& imgpath) {
+    return CodecRegistry::probe(imgpath);
+}
+
+
+std::expected<ImageInfo, IVMG_DEC_ERR> ivmg::probe(std::span<const uint8_t> data) {
+    return CodecRegistry::probe(data);
+}
@@ -1,9 +1,12 @@
 #include "common.hpp"
-#include "ivmg/core/formats.hpp"
+#include "ivmg/codecs/codecs.hpp"
 #include "ivmg/core/image.hpp"
 #include "ivmg/ivmg.hpp"
 
+#include <algorithm>
+#include <array>
 #include <cassert>
+#include <cstring>
 #include <iostream>
 #include <random>
 #include <fstream>
@@ -11,6 +14,9 @@
 #include <cstdlib>
 #include <unistd.h>
 
+#define MAX_DIM 2048
+#define ITERATIONS 5
+
 std::pair<unsigned, unsigned> get_random_size() {
     std::mt19937 rng(time(NULL));
     std::uniform_int_distribution<unsigned> dist(1, MAX_DIM);
@@ -41,17 +47,11 @@ void decode(const std::string& input_path, const std::string& output_path) {
 }
 
 std::vector<unsigned char> read_pam(const std::string& path, unsigned w, unsigned h) {
-    std::ifstream file(path, std::ios::binary);
-    assert(file);
-
-    std::string line;
-    while (std::getline(file, line) && line != "ENDHDR") {
-        // Skip headers
-    }
+    auto img = ivmg::CodecRegistry::decode(std::filesystem::path(path));
+    if (!img.has_value() || img->width() != w || img->height() != h)
+        return {};
 
-    std::vector<unsigned char> data(w * h * 4);
-    file.read(reinterpret_cast<char*>(data.data()), data.size());
-    return data;
+    return std::vector<unsigned char>(img->get_raw_handle(), img->get_raw_handle() + img->size_bytes());
 }
 
 bool compare_images(const std::vector<unsigned char>& a, const std::vector<unsigned char>& b) {
@@ -101,3 +101,76 @@ bool run_tests(char** argv, EncodeFunction encode) {
     std::filesystem::remove_all(tmp);
     return 0;
 }
+
+
+void fill_image(ivmg::Image& img, std::mt19937& rng) {
+    std::uniform_int_distribution<int> byte(0, 255);
+    std::uniform_int_distribution<int> kind(0, 9);
+    std::uniform_int_distribution<int> step(-20, 20);
+
+    std::array<std::array<uint8_t, 4>, 8> palette;
+    for (auto& color : palette)
+        for (uint8_t& c : color)
+            c = static_cast<uint8_t>(byte(rng));
+
+    const size_t nb_chan = img.nb_chan();
+    uint8_t* data = img.get_raw_handle();
+    std::array<uint8_t, 4> px { 0, 0, 0, 255 };
+
+    for (size_t i = 0; i < img.size_pixels();) {
+        size_t count = 1;
+
+        switch (kind(rng)) {
+            case 0: case 1: count = 1 + rng() % 150; break;
+            case 2: case 3: for (size_t c = 0; c < 3; c++) px[c] += rng() % 3 - 1; break;
+            case 4: case 5: for (size_t c = 0; c < 3; c++) px[c] += step(rng); break;
+            case 6: case 7: px = palette[rng() % palette.size()]; break;
+            case 8: px[3] = static_cast<uint8_t>(byte(rng)); break;
+            default: for (uint8_t& c : px) c = static_cast<uint8_t>(byte(rng)); break;
+        }
+
+        for (; count > 0 && i < img.size_pixels(); count--, i++) {
+            if (img.bit_depth() == 8) {
+                std::memcpy(data + i * nb_chan, px.data(), nb_chan);
+                continue;
+            }
+
+            // Both bytes of 16 bits samples differ, so that swapping them shows
+            for (size_t c = 0; c < nb_chan; c++)
+                img.get_raw_handle16()[i * nb_chan + c] = static_cast<uint16_t>(px[c] << 8 | px[(c + 1) % 4]);
+        }
+    }
+}
+
+
+bool check_downscaled(const ivmg::Image& img, const ivmg::Rect& roi, uint8_t scale, const ivmg::Image& region) {
+    const uint32_t rw = std::min(roi.w, img.width() - roi.x);
+    const uint32_t rh = std::min(roi.h, img.height() - roi.y);
+    if (region.width() != (rw + scale - 1) / scale || region.height() != (rh + scale - 1) / scale || region.nb_chan() != img.nb_chan()) {
+        std::cout << "Wrong size for a region of " << rw << "x" << rh << " at 1/" << +scale;
+        return false;
+    }
+
+    const size_t nb_chan = img.nb_chan();
+    auto sample = [](const ivmg::Image& im, size_t i) -> uint32_t {
+        return im.bit_depth() == 16 ? im.get_raw_handle16()[i] : im.get_raw_handle()[i];
+    };
+
+    for (uint32_t oy = 0; oy < region.height(); oy++) {
+        for (uint32_t ox = 0; ox < region.width(); ox++) {
+            for (size_t c = 0; c < nb_chan; c++) {
+                uint32_t sum = 0, area = 0;
+                for (uint32_t y = oy * scale; y < std::min<uint32_t>(oy * scale + scale, rh); y++)
+                    for (uint32_t x = ox * scale; x < std::min<uint32_t>(ox * scale + scale, rw); x++, area++)
+                        sum += sample(img, ((roi.y + y) * static_cast<size_t>(img.width()) + roi.x + x) * nb_chan + c);
+
+                if (sample(region, (oy * static_cast<size_t>(region.width()) + ox) * nb_chan + c) != (sum + area / 2) / area) {
+                    std::cout << "Region at 1/" << +scale << " differs at " << ox << "," << oy;
+                    return false;
+                }
+            }
+        }
+    }
+
+    return true;
+}
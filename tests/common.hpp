@@ -1,13 +1,25 @@
 #pragma once
 
+#include <ivmg/core/image.hpp>
+#include <ivmg/core/rect.hpp>
+
+#include <cstdint>
 #include <functional>
+#include <random>
 #include <string>
 #include <vector>
 
-#define MAX_DIM 2048
-#define ITERATIONS 5
-
 typedef std::function<void(const std::string&, const std::vector<unsigned char>&, 
                            unsigned, unsigned, char**)> EncodeFunction;
 
 bool run_tests(char** argv, EncodeFunction encode);
+
+/**
+ * @brief Pixels that go through every codec path: long runs, small and medium steps, a small palette and noise
+ */
+void fill_image(ivmg::Image& img, std::mt19937& rng);
+
+/**
+ * @brief Checks that region is roi of img downscaled by scale, every pixel the rounded average of its block of source pixels
+ */
+bool check_downscaled(const ivmg::Image& img, const ivmg::Rect& roi, uint8_t scale, const ivmg::Image& region);
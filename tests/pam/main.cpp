@@ -0,0 +1,220 @@
+#include "common.hpp"
+
+#include <ivmg/core/image.hpp>
+#include <ivmg/codecs/codecs.hpp>
+#include <ivmg/codecs/session.hpp>
+
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <unistd.h>
+
+#define MAX_DIM 200
+
+
+std::vector<uint8_t> read_file(const std::filesystem::path& path) {
+    std::ifstream file(path, std::ios::binary);
+    return std::vector<uint8_t>(std::istreambuf_iterator<char>(file), {});
+}
+
+
+void write_file(const std::filesystem::path& path, std::span<const uint8_t> data) {
+    std::ofstream file(path, std::ios::binary);
+    file.write(reinterpret_cast<const char*>(data.data()), data.size());
+}
+
+
+bool same_pixels(const ivmg::Image& a, const ivmg::Image& b) {
+    return a.width() == b.width() && a.height() == b.height() && a.color() == b.color() && a.bit_depth() == b.bit_depth()
+        && std::memcmp(a.get_raw_handle(), b.get_raw_handle(), a.size_bytes()) == 0;
+}
+
+
+/**
+ * @brief PAM files written by the encoder come back unchanged, as a view of the file when they are 8 bits
+ */
+bool check_round_trip(ivmg::EncodeSession& session, const ivmg::Image& img, const std::filesystem::path& path) {
+    auto encoded = session.encode(img, std::string(".pam"));
+    const std::vector<uint8_t> file(encoded->begin(), encoded->end());
+
+    auto decoded = ivmg::CodecRegistry::decode(file);
+    if (!decoded.has_value() || !same_pixels(*decoded, img) || decoded->is_view()) {
+        std::cout << "Decoded " << img.width() << "x" << img.height() << " image with " << +img.nb_chan() << " channels of " << +img.bit_depth() << " bits differs";
+        return false;
+    }
+
+    write_file(path, file);
+    auto mapped = ivmg::CodecRegistry::decode(path);
+    if (!mapped.has_value() || !same_pixels(*mapped, img)) {
+        std::cout << "Mapped " << +img.nb_chan() << " channels of " << +img.bit_depth() << " bits differs";
+        return false;
+    }
+
+    // 16 bits samples are big endian in the file
+    if (mapped->is_view() != (img.bit_depth() == 8 || std::endian::native == std::endian::big)) {
+        std::cout << "View of the mapping expected for 8 bits files only";
+        return false;
+    }
+
+    // Views are copy on write, the file does not change
+    ivmg::Image copy = *mapped;
+    mapped->get_raw_handle()[0] ^= 0xFF;
+    if (copy.is_view() || !same_pixels(copy, img) || read_file(path) != file) {
+        std::cout << "Writing to a view changed its copy or the file";
+        return false;
+    }
+
+    // Assignment copies the pixels of a view too, whatever the layout of the image assigned to
+    mapped->get_raw_handle()[0] ^= 0xFF;
+    ivmg::Image assigned(3, 2, ivmg::ColorType::GRAY);
+    assigned = *mapped;
+    const ivmg::Image& alias = assigned;
+    assigned = alias;
+    mapped->get_raw_handle()[0] ^= 0xFF;
+    if (assigned.is_view() || !same_pixels(assigned, img)) {
+        std::cout << "Assigning a view did not copy its pixels";
+        return false;
+    }
+
+    // Moving keeps the view
+    const bool was_view = mapped->is_view();
+    ivmg::Image moved(1, 1, ivmg::ColorType::RGBA, 16);
+    moved = std::move(*mapped);
+    if (moved.is_view() != was_view || moved.get_raw_handle()[0] != (img.get_raw_handle()[0] ^ 0xFF)) {
+        std::cout << "Moving a view lost its pixels";
+        return false;
+    }
+
+    // Options that change the layout decode a copy
+    ivmg::DecodeOptions opts;
+    opts.force_rgba = true;
+    auto rgba = ivmg::CodecRegistry::decode(path, opts);
+    if (!rgba.has_value() || rgba->color() != ivmg::ColorType::RGBA || (img.nb_chan() != 4 && rgba->is_view())) {
+        std::cout << "force_rgba ignored";
+        return false;
+    }
+
+    // A region, downscaled: averages of the blocks of the source pixels
+    const ivmg::Rect roi { img.width() / 4, img.height() / 3, img.width() / 2 + 1, img.height() / 2 + 1 };
+    opts = {};
+    opts.roi = roi;
+    opts.scale = 2;
+
+    auto scaled = ivmg::CodecRegistry::decode(path, opts);
+    if (!scaled.has_value() || scaled->is_view()) {
+        std::cout << "Decoding a region failed";
+        return false;
+    }
+
+    if (!check_downscaled(img, roi, 2, *scaled))
+        return false;
+
+    // Caller buffers with padded rows, 8 bits samples keep the high byte of 16 bits ones
+    const size_t nb_chan = img.nb_chan();
+    const bool wide = img.bit_depth() == 16;
+    auto sample = [&](size_t i) -> uint32_t {
+        return wide ? img.get_raw_handle16()[i] : img.get_raw_handle()[i];
+    };
+
+    const size_t stride = img.width() * nb_chan + 7;
+    std::vector<uint8_t> padded(stride * img.height());
+    const ivmg::PixelFormat fmt[] = { ivmg::PixelFormat::GRAY8, ivmg::PixelFormat::GRAYA8, ivmg::PixelFormat::RGB8, ivmg::PixelFormat::RGBA8 };
+    if (!ivmg::CodecRegistry::decode_into(file, padded, stride, fmt[nb_chan - 1]).has_value()) {
+        std::cout << "decode_into failed";
+        return false;
+    }
+
+    for (size_t y = 0; y < img.height(); y++) {
+        for (size_t i = 0; i < img.width() * nb_chan; i++) {
+            const uint32_t v = sample(y * img.width() * nb_chan + i);
+            if (padded[y * stride + i] != (wide ? v >> 8 : v)) {
+                std::cout << "decode_into differs on row " << y;
+                return false;
+            }
+        }
+    }
+
+    // A truncated file is an error, not a crash
+    const std::vector<uint8_t> truncated(file.begin(), file.end() - 1);
+    if (ivmg::CodecRegistry::decode(truncated).has_value()) {
+        std::cout << "Truncated file decoded";
+        return false;
+    }
+
+    return true;
+}
+
+
+/**
+ * @brief Hand written P5 and P6 headers, with comments, and the headers that must fail
+ */
+bool check_netpbm() {
+    const std::string ppm = "P6\n# made by hand\n3 2 # width height\n255\n";
+    std::vector<uint8_t> file(ppm.begin(), ppm.end());
+    for (uint8_t i = 0; i < 18; i++)
+        file.push_back(i * 10);
+
+    auto rgb = ivmg::CodecRegistry::decode(file);
+    if (!rgb.has_value() || rgb->width() != 3 || rgb->height() != 2 || rgb->color() != ivmg::ColorType::RGB
+        || std::memcmp(rgb->get_raw_handle(), file.data() + ppm.size(), 18) != 0) {
+        std::cout << "PPM decoded wrong";
+        return false;
+    }
+
+    auto info = ivmg::CodecRegistry::probe(file);
+    if (!info.has_value() || info->channels != 3 || info->bit_depth != 8 || info->format != "ppm") {
+        std::cout << "Wrong PPM probe";
+        return false;
+    }
+
+    // 16 bits gray, big endian
+    const std::string pgm = "P5 2 1 65535 ";
+    file.assign(pgm.begin(), pgm.end());
+    file.insert(file.end(), { 0x12, 0x34, 0xAB, 0xCD });
+
+    auto gray = ivmg::CodecRegistry::decode(file);
+    if (!gray.has_value() || gray->color() != ivmg::ColorType::GRAY || gray->bit_depth() != 16
+        || gray->get_raw_handle16()[0] != 0x1234 || gray->get_raw_handle16()[1] != 0xABCD) {
+        std::cout << "16 bits PGM decoded wrong";
+        return false;
+    }
+
+    for (std::string_view bad : { "P5 2 1 1023 \x01\x02\x03\x04", "P5 0 1 255 \x01", "P7\nWIDTH 1\nHEIGHT 1\nMAXVAL 255\nENDHDR\n\x01",
+                                    "P7\nWIDTH 1\nHEIGHT 1\nDEPTH 5\nMAXVAL 255\nENDHDR\n\x01\x01\x01\x01\x01", "P6 1 1 255" }) {
+        file.assign(bad.begin(), bad.end());
+        if (ivmg::CodecRegistry::decode(file).has_value()) {
+            std::cout << "Invalid header decoded: " << bad.substr(0, 2);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+int main() {
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<unsigned> dim(1, MAX_DIM);
+    ivmg::EncodeSession session;
+
+    char tmpl[] = "/tmp/ivmg_pam_XXXXXX";
+    const std::filesystem::path tmp = mkdtemp(tmpl);
+    bool ok = check_netpbm();
+
+    for (ivmg::ColorType ct : { ivmg::ColorType::GRAY, ivmg::ColorType::GRAYA, ivmg::ColorType::RGB, ivmg::ColorType::RGBA }) {
+        for (uint8_t bit_depth : { 8, 16 }) {
+            for (size_t i = 0; ok && i < 3; i++) {
+                ivmg::Image img(dim(rng), dim(rng), ct, bit_depth);
+                fill_image(img, rng);
+                ok = check_round_trip(session, img, tmp / "image.pam");
+            }
+        }
+    }
+
+    std::filesystem::remove_all(tmp);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,403 @@
+#include "lodepng.h"
+
+#include <ivmg/core/image.hpp>
+#include <ivmg/codecs/apng.hpp>
+#include <ivmg/codecs/session.hpp>
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+
+#define MAX_ANIM_DIM 120
+#define NB_FRAMES 12
+
+/**
+ * @brief An animation frame as the writer got it, with how long it should end up on screen once repeats are merged
+ */
+struct ExpectedFrame {
+    std::vector<uint8_t> pixels;
+    uint16_t delay_num;
+    uint16_t delay_den;
+};
+
+
+/**
+ * @brief Changes a random rectangle of the image, or nothing at all now and then
+ */
+void change_region(ivmg::Image& img, std::mt19937& rng) {
+    std::uniform_int_distribution<int> dist(0, 255);
+    if (dist(rng) < 64)
+        return;
+
+    const size_t pixel_size = img.nb_chan() * img.bit_depth() / 8;
+    const uint32_t x = rng() % img.width();
+    const uint32_t y = rng() % img.height();
+    const uint32_t w = 1 + rng() % (img.width() - x);
+    const uint32_t h = 1 + rng() % (img.height() - y);
+
+    for (uint32_t j = y; j < y + h; j++) {
+        uint8_t* row = img.get_raw_handle() + (static_cast<size_t>(j) * img.width() + x) * pixel_size;
+        for (size_t i = 0; i < w * pixel_size; i++)
+            row[i] = static_cast<uint8_t>(dist(rng));
+    }
+}
+
+
+bool check_canvas(const ivmg::Image& canvas, const std::vector<uint8_t>& expected, size_t frame) {
+    if (canvas.size_bytes() != expected.size() || std::memcmp(canvas.get_raw_handle(), expected.data(), expected.size()) != 0) {
+        std::cout << "Canvas mismatch after frame " << frame << " of a " << canvas.width() << "x" << canvas.height() << " animation with "
+                  << +canvas.nb_chan() << " channels at " << +canvas.bit_depth() << " bits";
+        return false;
+    }
+    return true;
+}
+
+
+/**
+ * @brief Writes random frames, where only parts change, then plays them back with ivmg and checks the default image with lodepng
+ */
+bool check_round_trip(ivmg::ApngWriter& writer, ivmg::ApngReader& reader, ivmg::ColorType ct, uint8_t depth, std::mt19937& rng) {
+    std::uniform_int_distribution<unsigned> dim(1, MAX_ANIM_DIM);
+    ivmg::Image img(dim(rng), dim(rng), ct, depth);
+    std::uniform_int_distribution<int> dist(0, 255);
+    for (size_t i = 0; i < img.size_bytes(); i++)
+        img.get_raw_handle()[i] = static_cast<uint8_t>(dist(rng));
+
+    std::vector<ExpectedFrame> expected;
+    for (size_t f = 0; f < NB_FRAMES; f++) {
+        if (f > 0)
+            change_region(img, rng);
+
+        const uint16_t delay_num = static_cast<uint16_t>(1 + rng() % 50);
+        const uint16_t delay_den = (rng() % 4 == 0) ? 1000 : 100;
+
+        if (!writer.add_frame(img, delay_num, delay_den).has_value()) {
+            std::cout << "Failed to add frame " << f;
+            return false;
+        }
+
+        // A frame equal to the previous one only lengthens it, when the delays can be added up
+        std::vector<uint8_t> pixels(img.get_raw_handle(), img.get_raw_handle() + img.size_bytes());
+        if (!expected.empty() && expected.back().pixels == pixels && expected.back().delay_den == delay_den)
+            expected.back().delay_num += delay_num;
+        else
+            expected.push_back({ std::move(pixels), delay_num, delay_den });
+    }
+
+    const std::span<const uint8_t> animation = writer.finish(3);
+    const std::vector<uint8_t> file(animation.begin(), animation.end());
+
+    auto info = reader.open(file);
+    if (!info.has_value() || info->width != img.width() || info->height != img.height() || info->nb_frames != expected.size() || info->nb_plays != 3) {
+        std::cout << "Wrong animation header for " << expected.size() << " frames";
+        return false;
+    }
+
+    for (size_t f = 0; f < expected.size(); f++) {
+        auto frame = reader.next_frame();
+        if (!frame.has_value()) {
+            std::cout << "Failed to decode frame " << f;
+            return false;
+        }
+        if (frame->delay_num != expected[f].delay_num || frame->delay_den != expected[f].delay_den) {
+            std::cout << "Wrong delay for frame " << f << ": " << frame->delay_num << "/" << frame->delay_den;
+            return false;
+        }
+        if (!check_canvas(reader.canvas(), expected[f].pixels, f))
+            return false;
+    }
+
+    if (reader.has_next_frame()) {
+        std::cout << "More frames than written";
+        return false;
+    }
+
+    // Viewers without APNG support show the first frame
+    static constexpr LodePNGColorType lode_types[] = { LCT_GREY, LCT_GREY_ALPHA, LCT_RGB, LCT_RGBA };
+    std::vector<unsigned char> decoded;
+    unsigned w, h;
+    unsigned error = lodepng::decode(decoded, w, h, file.data(), file.size(), lode_types[img.nb_chan() - 1], depth);
+    if (error) {
+        std::cout << "lodepng failed to decode: " << lodepng_error_text(error);
+        return false;
+    }
+
+    std::vector<uint8_t> first = expected.front().pixels;
+    if (depth == 16 && std::endian::native == std::endian::little)
+        for (size_t i = 0; i < first.size(); i += 2)
+            std::swap(first[i], first[i + 1]);
+
+    if (decoded != first) {
+        std::cout << "lodepng sees another default image";
+        return false;
+    }
+
+    return true;
+}
+
+
+
+//======================================================
+// HAND BUILT ANIMATIONS
+//======================================================
+
+struct HandFrame {
+    ivmg::Rect region;
+    ivmg::ApngDispose dispose;
+    ivmg::ApngBlend blend;
+    std::vector<uint16_t> pixels;   // RGBA, in the native range of the bit depth
+};
+
+
+void append_be(std::vector<uint8_t>& out, uint32_t val, size_t bytes) {
+    for (size_t i = bytes; i-- > 0;)
+        out.push_back(static_cast<uint8_t>(val >> (8 * i)));
+}
+
+
+void append_chunk(std::vector<uint8_t>& out, const char* type, const std::vector<uint8_t>& data) {
+    append_be(out, static_cast<uint32_t>(data.size()), 4);
+    const size_t start = out.size();
+    out.insert(out.end(), type, type + 4);
+    out.insert(out.end(), data.begin(), data.end());
+    append_be(out, lodepng_crc32(out.data() + start, out.size() - start), 4);
+}
+
+
+/**
+ * @brief Builds an RGBA APNG with the dispose and blend operations of the frames, which the writer never uses
+ */
+std::vector<uint8_t> build_apng(uint32_t width, uint32_t height, uint8_t depth, const std::vector<HandFrame>& frames) {
+    std::vector<uint8_t> out = { 0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A };
+
+    std::vector<uint8_t> ihdr;
+    append_be(ihdr, width, 4);
+    append_be(ihdr, height, 4);
+    ihdr.insert(ihdr.end(), { depth, 6, 0, 0, 0 });
+    append_chunk(out, "IHDR", ihdr);
+
+    std::vector<uint8_t> actl;
+    append_be(actl, static_cast<uint32_t>(frames.size()), 4);
+    append_be(actl, 0, 4);
+    append_chunk(out, "acTL", actl);
+
+    uint32_t sequence = 0;
+    for (size_t f = 0; f < frames.size(); f++) {
+        const HandFrame& frame = frames[f];
+
+        std::vector<uint8_t> fctl;
+        append_be(fctl, sequence++, 4);
+        append_be(fctl, frame.region.w, 4);
+        append_be(fctl, frame.region.h, 4);
+        append_be(fctl, frame.region.x, 4);
+        append_be(fctl, frame.region.y, 4);
+        append_be(fctl, static_cast<uint32_t>(f + 1), 2);
+        append_be(fctl, 100, 2);
+        fctl.push_back(static_cast<uint8_t>(frame.dispose));
+        fctl.push_back(static_cast<uint8_t>(frame.blend));
+        append_chunk(out, "fcTL", fctl);
+
+        // Unfiltered rows
+        std::vector<uint8_t> raw;
+        for (uint32_t y = 0; y < frame.region.h; y++) {
+            raw.push_back(0);
+            for (uint32_t i = 0; i < frame.region.w * 4; i++)
+                append_be(raw, frame.pixels[y * frame.region.w * 4 + i], depth / 8);
+        }
+
+        std::vector<unsigned char> zlib;
+        lodepng::compress(zlib, raw.data(), raw.size());
+
+        if (f == 0) {
+            append_chunk(out, "IDAT", std::vector<uint8_t>(zlib.begin(), zlib.end()));
+        }
+        else {
+            std::vector<uint8_t> fdat;
+            append_be(fdat, sequence++, 4);
+            fdat.insert(fdat.end(), zlib.begin(), zlib.end());
+            append_chunk(out, "fdAT", fdat);
+        }
+    }
+
+    append_chunk(out, "IEND", {});
+    return out;
+}
+
+
+/**
+ * @brief Straightforward compositing of the frames, in floating point, as the APNG specification describes it
+ */
+class ReferencePlayer {
+private:
+    uint32_t width;
+    double max;
+    std::vector<double> canvas;
+    std::vector<double> before;
+    const HandFrame* last = nullptr;
+
+    double& at(std::vector<double>& buf, uint32_t x, uint32_t y, size_t c) { return buf[(static_cast<size_t>(y) * width + x) * 4 + c]; }
+
+public:
+    ReferencePlayer(uint32_t width, uint32_t height, uint8_t depth)
+        : width(width), max(depth == 16 ? 65535.0 : 255.0), canvas(static_cast<size_t>(width) * height * 4, 0.0) {}
+
+    /**
+     * @brief Disposes of the last frame then draws this one. The canvas starts transparent black,
+     * so the first frame going back to the previous state clears its region as the specification asks
+     */
+    const std::vector<double>& draw(const HandFrame& frame) {
+        if (last) {
+            const ivmg::Rect& r = last->region;
+            for (uint32_t y = r.y; y < r.y + r.h; y++)
+                for (uint32_t x = r.x; x < r.x + r.w; x++)
+                    for (size_t c = 0; c < 4; c++) {
+                        if (last->dispose == ivmg::ApngDispose::BACKGROUND)
+                            at(canvas, x, y, c) = 0;
+                        else if (last->dispose == ivmg::ApngDispose::PREVIOUS)
+                            at(canvas, x, y, c) = at(before, x, y, c);
+                    }
+        }
+
+        before = canvas;
+        const ivmg::Rect& r = frame.region;
+
+        for (uint32_t y = 0; y < r.h; y++) {
+            for (uint32_t x = 0; x < r.w; x++) {
+                const uint16_t* s = &frame.pixels[(static_cast<size_t>(y) * r.w + x) * 4];
+                double* d = &at(canvas, r.x + x, r.y + y, 0);
+
+                if (frame.blend == ivmg::ApngBlend::SOURCE) {
+                    std::copy_n(s, 4, d);
+                    continue;
+                }
+
+                const double sa = s[3] / max;
+                const double da = d[3] / max;
+                const double a = sa + da * (1 - sa);
+                if (a == 0)
+                    continue;
+
+                for (size_t c = 0; c < 3; c++)
+                    d[c] = (s[c] * sa + d[c] * da * (1 - sa)) / a;
+                d[3] = a * max;
+            }
+        }
+
+        last = &frame;
+        return canvas;
+    }
+};
+
+
+bool check_hand_built(ivmg::ApngReader& reader, uint8_t depth, std::mt19937& rng) {
+    const uint32_t width = 40 + rng() % 40;
+    const uint32_t height = 30 + rng() % 40;
+    const int max = (depth == 16) ? 65535 : 255;
+
+    // Alpha is often fully opaque or fully transparent, the shortcuts of the blending
+    std::uniform_int_distribution<int> sample(0, max);
+    auto random_alpha = [&]() {
+        const int kind = rng() % 4;
+        return kind == 0 ? 0 : kind == 1 ? max : sample(rng);
+    };
+
+    std::vector<HandFrame> frames;
+    for (size_t f = 0; f < NB_FRAMES; f++) {
+        HandFrame frame;
+        frame.region = (f == 0) ? ivmg::Rect { 0, 0, width, height } : ivmg::Rect { static_cast<uint32_t>(rng() % width), static_cast<uint32_t>(rng() % height), 0, 0 };
+        if (f > 0) {
+            frame.region.w = 1 + rng() % (width - frame.region.x);
+            frame.region.h = 1 + rng() % (height - frame.region.y);
+        }
+        frame.dispose = static_cast<ivmg::ApngDispose>(rng() % 3);
+        frame.blend = static_cast<ivmg::ApngBlend>(rng() % 2);
+
+        frame.pixels.resize(static_cast<size_t>(frame.region.w) * frame.region.h * 4);
+        for (size_t i = 0; i < frame.pixels.size(); i++)
+            frame.pixels[i] = static_cast<uint16_t>((i % 4 == 3) ? random_alpha() : sample(rng));
+
+        frames.push_back(std::move(frame));
+    }
+
+    const std::vector<uint8_t> file = build_apng(width, height, depth, frames);
+
+    auto info = reader.open(file);
+    if (!info.has_value() || info->nb_frames != frames.size() || info->color != ivmg::ColorType::RGBA) {
+        std::cout << "Failed to open a hand built animation";
+        return false;
+    }
+
+    ReferencePlayer player(width, height, depth);
+
+    for (size_t f = 0; f < frames.size(); f++) {
+        auto frame = reader.next_frame();
+        if (!frame.has_value()) {
+            std::cout << "Failed to decode hand built frame " << f;
+            return false;
+        }
+
+        const std::vector<double>& expected = player.draw(frames[f]);
+        const ivmg::Image& canvas = reader.canvas();
+
+        for (size_t i = 0; i < expected.size(); i++) {
+            const double got = (depth == 16) ? reinterpret_cast<const uint16_t*>(canvas.get_raw_handle())[i] : canvas.get_raw_handle()[i];
+
+            // Integer and floating point compositing may round differently
+            if (std::abs(got - expected[i]) > 1.0) {
+                std::cout << "Hand built frame " << f << " at " << +depth << " bits differs at sample " << i << ": " << got << " instead of " << expected[i];
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+
+int main() {
+    std::mt19937 rng(42);
+    ivmg::ApngWriter writer;
+    ivmg::ApngReader reader;
+
+    // The writer and reader are reused from one animation to the next
+    for (ivmg::ColorType ct : { ivmg::ColorType::GRAY, ivmg::ColorType::GRAYA, ivmg::ColorType::RGB, ivmg::ColorType::RGBA }) {
+        for (uint8_t depth : { 8, 16 }) {
+            for (size_t i = 0; i < 3; i++)
+                if (!check_round_trip(writer, reader, ct, depth, rng))
+                    return 1;
+        }
+    }
+
+    for (uint8_t depth : { 8, 16 }) {
+        for (size_t i = 0; i < 10; i++)
+            if (!check_hand_built(reader, depth, rng))
+                return 1;
+    }
+
+    // A PNG without animation plays as a single frame
+    ivmg::Image still(37, 23, ivmg::ColorType::RGBA, 8);
+    for (size_t i = 0; i < still.size_bytes(); i++)
+        still.get_raw_handle()[i] = static_cast<uint8_t>(rng());
+
+    ivmg::EncodeSession session;
+    auto encoded = session.encode(still, std::string(".png"));
+    if (!encoded.has_value()) {
+        std::cout << "Encoding failed";
+        return 1;
+    }
+
+    const std::vector<uint8_t> file(encoded->begin(), encoded->end());
+    auto info = reader.open(file);
+    if (!info.has_value() || info->nb_frames != 1 || !reader.next_frame().has_value() || reader.has_next_frame())
+        return 1;
+
+    const std::vector<uint8_t> pixels(still.get_raw_handle(), still.get_raw_handle() + still.size_bytes());
+    if (!check_canvas(reader.canvas(), pixels, 0))
+        return 1;
+
+    return 0;
+}
@@ -0,0 +1,118 @@
+#include "lodepng.h"
+
+#include <ivmg/core/image.hpp>
+#include <ivmg/codecs/session.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <print>
+#include <random>
+
+#define BENCH_DIM 2048
+#define BENCH_RUNS 3
+
+
+/**
+ * @brief Smooth shapes with a bit of noise, compressing about like a photo
+ */
+ivmg::Image make_image() {
+    ivmg::Image img(BENCH_DIM, BENCH_DIM, ivmg::ColorType::RGBA);
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<int> noise(-4, 4);
+    uint8_t* px = img.get_raw_handle();
+
+    for (unsigned y = 0; y < BENCH_DIM; y++) {
+        for (unsigned x = 0; x < BENCH_DIM; x++, px += 4) {
+            const double d = std::hypot(x - BENCH_DIM / 2.0, y - BENCH_DIM / 3.0);
+            px[0] = static_cast<uint8_t>(std::clamp(128 + 100 * std::sin(d / 40) + noise(rng), 0.0, 255.0));
+            px[1] = static_cast<uint8_t>((x + y) / 16);
+            px[2] = static_cast<uint8_t>(std::clamp(x * 255.0 / BENCH_DIM + noise(rng), 0.0, 255.0));
+            px[3] = 255;
+        }
+    }
+
+    return img;
+}
+
+
+template <typename F>
+double best_seconds(F&& fn) {
+    double best = 1e30;
+    for (int run = 0; run < BENCH_RUNS; run++) {
+        const auto start = std::chrono::steady_clock::now();
+        fn();
+        const auto end = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double>(end - start).count());
+    }
+    return best;
+}
+
+
+int main() {
+    const ivmg::Image img = make_image();
+    const double mbytes = img.size_bytes() / 1e6;
+
+    std::println("Encoding a {}x{} RGBA image, best of {} runs", BENCH_DIM, BENCH_DIM, BENCH_RUNS);
+
+    std::vector<unsigned char> lode_png;
+    const double lode_s = best_seconds([&] {
+        lode_png.clear();
+        lodepng::encode(lode_png, img.get_raw_handle(), img.width(), img.height());
+    });
+    std::println("{:>16} {:>9.1f} MB/s {:>10} bytes", "lodepng", mbytes / lode_s, lode_png.size());
+
+    // Reference for the adaptive filters
+    lodepng::State state;
+    state.encoder.filter_strategy = LFS_ENTROPY;
+    std::vector<unsigned char> entropy_png;
+    const double entropy_s = best_seconds([&] {
+        entropy_png.clear();
+        lodepng::encode(entropy_png, img.get_raw_handle(), img.width(), img.height(), state);
+    });
+    std::println("{:>16} {:>9.1f} MB/s {:>10} bytes", "lodepng entropy", mbytes / entropy_s, entropy_png.size());
+
+    ivmg::EncodeSession session;
+    auto run = [&](const char* name, uint8_t level, ivmg::PngFilter filter) {
+        ivmg::EncodeOptions opts;
+        opts.compression_level = level;
+        opts.png_filter = filter;
+
+        size_t size = 0;
+        const double s = best_seconds([&] { size = session.encode(img, std::string(".png"), opts)->size(); });
+        std::println("{:>13} {:>2} {:>9.1f} MB/s {:>10} bytes  x{:.1f}", name, level, mbytes / s, size, lode_s / s);
+    };
+
+    for (uint8_t level : { 0, 1, 6, 9, 12 })
+        run("ivmg", level, ivmg::PngFilter::ADAPTIVE);
+
+    ivmg::EncodeOptions fast_opts;
+    fast_opts.png_fast = true;
+    size_t fast_size = 0;
+    const double fast_s = best_seconds([&] { fast_size = session.encode(img, std::string(".png"), fast_opts)->size(); });
+    std::println("{:>16} {:>9.1f} MB/s {:>10} bytes  x{:.1f}", "ivmg fast", mbytes / fast_s, fast_size, lode_s / fast_s);
+
+    // The filtering overhead is the gap between a fixed filter and the adaptive ones
+    for (uint8_t level : { 1, 6 }) {
+        run("ivmg paeth", level, ivmg::PngFilter::PAETH);
+        run("ivmg brute", level, ivmg::PngFilter::BRUTE_FORCE);
+    }
+
+    // Decoding cost of the chunk CRC checks
+    std::println("Decoding the level 6 file, per CRC policy");
+    const auto png = session.encode(img, std::string(".png"));
+    const std::vector<uint8_t> file(png->begin(), png->end());
+    ivmg::DecodeSession decoder;
+
+    double none_s = 0;
+    for (auto [name, policy] : { std::pair { "crc none", ivmg::CrcPolicy::NONE }, { "crc critical", ivmg::CrcPolicy::CRITICAL }, { "crc all", ivmg::CrcPolicy::ALL } }) {
+        ivmg::DecodeOptions opts;
+        opts.crc_check = policy;
+
+        const double s = best_seconds([&] { decoder.decode(file, opts); });
+        none_s = none_s ? none_s : s;
+        std::println("{:>16} {:>9.1f} MB/s {:>+9.1f}%", name, mbytes / s, (s / none_s - 1) * 100);
+    }
+
+    return 0;
+}
@@ -0,0 +1,588 @@
+#include "common.hpp"
+#include "lodepng.h"
+#include "common/parallel.hpp"
+
+#include <ivmg/core/image.hpp>
+#include <ivmg/codecs/codecs.hpp>
+#include <ivmg/codecs/session.hpp>
+#include <ivmg/core/pixel_format.hpp>
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <span>
+#include <string>
+#include <vector>
+
+#define MAX_DIM 150
+#define IDOT_DIM 1200       // Large enough to be written in several strips listed by an iDOT chunk
+
+
+/**
+ * @brief A PNG layout written by lodepng as is, without picking a color type for us
+ */
+struct Fixture {
+    LodePNGColorType color_type;
+    unsigned bit_depth;
+    bool palette_alpha = false;     // Palettes only: translucent entries, written in a tRNS chunk
+    bool key = false;               // Gray and RGB only: a transparent color, written in a tRNS chunk
+};
+
+
+/**
+ * @brief Random pixels in the layout of the fixture, encoded by lodepng
+ */
+std::vector<uint8_t> encode_fixture(const Fixture& fx, unsigned w, unsigned h, unsigned interlace, std::mt19937& rng) {
+    lodepng::State state;
+    state.encoder.auto_convert = 0;
+    state.info_png.interlace_method = interlace;
+    state.info_raw.colortype = state.info_png.color.colortype = fx.color_type;
+    state.info_raw.bitdepth = state.info_png.color.bitdepth = fx.bit_depth;
+
+    std::vector<uint8_t> raw(lodepng_get_raw_size(w, h, &state.info_raw));
+    for (uint8_t& byte : raw)
+        byte = static_cast<uint8_t>(rng());
+
+    // A full palette, so that every random index is valid
+    if (fx.color_type == LCT_PALETTE) {
+        for (unsigned i = 0; i < (1u << fx.bit_depth); i++) {
+            const uint8_t alpha = fx.palette_alpha ? static_cast<uint8_t>(rng()) : 255;
+            lodepng_palette_add(&state.info_raw, rng(), rng(), rng(), alpha);
+            lodepng_palette_add(&state.info_png.color, state.info_raw.palette[i * 4], state.info_raw.palette[i * 4 + 1], state.info_raw.palette[i * 4 + 2], alpha);
+        }
+    }
+
+    // Key on the color of the first pixel, and make a few more pixels match it
+    if (fx.key) {
+        const size_t px_size = std::max(1u, lodepng_get_bpp(&state.info_raw) / 8);
+        for (size_t i = 0; i < raw.size() / px_size; i += 5)
+            std::copy_n(raw.begin(), px_size, raw.begin() + i * px_size);
+
+        auto sample = [&](size_t c) -> unsigned { return fx.bit_depth == 16 ? (raw[c * 2] << 8) | raw[c * 2 + 1] : raw[c] >> (8 - std::min(fx.bit_depth, 8u)); };
+        const bool rgb = fx.color_type == LCT_RGB;
+        state.info_png.color.key_defined = state.info_raw.key_defined = 1;
+        state.info_png.color.key_r = state.info_raw.key_r = sample(0);
+        state.info_png.color.key_g = state.info_raw.key_g = rgb ? sample(1) : sample(0);
+        state.info_png.color.key_b = state.info_raw.key_b = rgb ? sample(2) : sample(0);
+    }
+
+    std::vector<uint8_t> file;
+    const unsigned error = lodepng::encode(file, raw, w, h, state);
+    if (error)
+        std::cout << "lodepng failed to encode: " << lodepng_error_text(error) << "\n";
+    return file;
+}
+
+
+/**
+ * @brief The same file with its image data split in IDAT chunks of at most chunk_size bytes
+ */
+std::vector<uint8_t> split_idat(const std::vector<uint8_t>& file, size_t chunk_size) {
+    std::vector<uint8_t> out(file.begin(), file.begin() + 8);
+    std::vector<uint8_t> idat;
+    const uint8_t* end = file.data() + file.size();
+
+    for (const uint8_t* chunk = file.data() + 8; chunk < end; chunk = lodepng_chunk_next_const(chunk, end)) {
+        const size_t length = lodepng_chunk_length(chunk);
+        if (lodepng_chunk_type_equals(chunk, "IDAT")) {
+            idat.insert(idat.end(), chunk + 8, chunk + 8 + length);
+            continue;
+        }
+
+        for (size_t i = 0; lodepng_chunk_type_equals(chunk, "IEND") && i < idat.size(); i += chunk_size) {
+            const size_t size = std::min(chunk_size, idat.size() - i);
+            for (size_t b = 4; b-- > 0;)
+                out.push_back(static_cast<uint8_t>(size >> (8 * b)));
+            const size_t start = out.size();
+            out.insert(out.end(), { 'I', 'D', 'A', 'T' });
+            out.insert(out.end(), idat.begin() + i, idat.begin() + i + size);
+            const unsigned crc = lodepng_crc32(out.data() + start, out.size() - start);
+            for (size_t b = 4; b-- > 0;)
+                out.push_back(static_cast<uint8_t>(crc >> (8 * b)));
+        }
+        out.insert(out.end(), chunk, chunk + length + 12);
+    }
+
+    return out;
+}
+
+
+/**
+ * @brief Samples of the image as lodepng returns them, 16 bits ones big endian
+ */
+std::vector<uint8_t> big_endian_bytes(const ivmg::Image& img) {
+    std::vector<uint8_t> bytes(img.get_raw_handle(), img.get_raw_handle() + img.size_bytes());
+    if (img.bit_depth() == 16 && std::endian::native == std::endian::little)
+        for (size_t i = 0; i < bytes.size(); i += 2)
+            std::swap(bytes[i], bytes[i + 1]);
+    return bytes;
+}
+
+
+/**
+ * @brief Decodes the file with ivmg, in its native layout and in RGBA, and compares the pixels with lodepng.
+ *
+ * lodepng only converts 16 bits images to RGB and RGBA, so its RGBA output is reduced to
+ * the channels of ivmg: gray is the red channel, alpha stays alpha.
+ */
+bool check_against_lodepng(const std::vector<uint8_t>& file, const ivmg::DecodeOptions& base) {
+    static constexpr std::array<std::array<uint8_t, 4>, 4> rgba_channels {{ { 0 }, { 0, 3 }, { 0, 1, 2 }, { 0, 1, 2, 3 } }};
+
+    for (bool force_rgba : { false, true }) {
+        ivmg::DecodeOptions opts = base;
+        opts.force_rgba = force_rgba;
+
+        auto img = ivmg::CodecRegistry::decode(file, opts);
+        if (!img.has_value()) {
+            std::cout << "ivmg failed to decode";
+            return false;
+        }
+
+        std::vector<uint8_t> rgba;
+        unsigned w, h;
+        const unsigned error = lodepng::decode(rgba, w, h, file, LCT_RGBA, img->bit_depth());
+        if (error) {
+            std::cout << "lodepng failed to decode: " << lodepng_error_text(error);
+            return false;
+        }
+
+        const size_t sample_size = img->bit_depth() / 8;
+        std::vector<uint8_t> expected;
+        for (size_t px = 0; px < static_cast<size_t>(w) * h; px++)
+            for (size_t c = 0; c < img->nb_chan(); c++)
+                for (size_t b = 0; b < sample_size; b++)
+                    expected.push_back(rgba[(px * 4 + rgba_channels[img->nb_chan() - 1][c]) * sample_size + b]);
+
+        if (w != img->width() || h != img->height() || big_endian_bytes(*img) != expected) {
+            std::cout << "Pixels differ from lodepng with " << +img->nb_chan() << " channels of " << +img->bit_depth() << " bits";
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+/**
+ * @brief Streaming decodes, which inflate one scanline at a time, give the same bytes as default decodes
+ */
+bool check_streaming(const std::vector<uint8_t>& file) {
+    ivmg::DecodeOptions opts;
+    opts.streaming = true;
+
+    auto whole = ivmg::CodecRegistry::decode(file);
+    auto streamed = ivmg::CodecRegistry::decode(file, opts);
+    if (!whole.has_value() || !streamed.has_value() || streamed->width() != whole->width() || streamed->height() != whole->height()
+        || streamed->color() != whole->color() || streamed->bit_depth() != whole->bit_depth()
+        || std::memcmp(streamed->get_raw_handle(), whole->get_raw_handle(), whole->size_bytes()) != 0) {
+        std::cout << "Streaming decode differs";
+        return false;
+    }
+
+    return true;
+}
+
+
+/**
+ * @brief Decoding into caller buffers with padded rows, in every pixel format, gives the pixels lodepng decodes.
+ *
+ * Gray formats hold the BT.601 luma of color sources, as the decoder computes it.
+ */
+bool check_decode_into(const std::vector<uint8_t>& file) {
+    using ivmg::PixelFormat;
+
+    for (PixelFormat fmt : { PixelFormat::RGBA8, PixelFormat::RGB8, PixelFormat::GRAYA8, PixelFormat::GRAY8,
+                             PixelFormat::RGBA16, PixelFormat::RGB16, PixelFormat::GRAYA16, PixelFormat::GRAY16 }) {
+        const uint8_t depth = ivmg::bit_depth(fmt);
+        const size_t nb_chan = ivmg::channels(fmt);
+
+        std::vector<uint8_t> rgba;
+        unsigned w, h;
+        if (lodepng::decode(rgba, w, h, file, LCT_RGBA, depth) != 0) {
+            std::cout << "lodepng failed to decode";
+            return false;
+        }
+
+        // Samples in native byte order, as 32 bits values whatever the depth
+        auto lode_sample = [&](size_t px, size_t c) -> uint32_t {
+            return depth == 16 ? (rgba[(px * 4 + c) * 2] << 8) | rgba[(px * 4 + c) * 2 + 1] : rgba[px * 4 + c];
+        };
+        auto expected_sample = [&](size_t px, size_t c) -> uint32_t {
+            if (nb_chan >= 3) return lode_sample(px, c);
+            if (c == 1) return lode_sample(px, 3);
+            const uint32_t r = lode_sample(px, 0), g = lode_sample(px, 1), b = lode_sample(px, 2);
+            return (depth == 16) ? (19595u * r + 38470u * g + 7471u * b + 32768u) >> 16 : (77 * r + 150 * g + 29 * b + 128) >> 8;
+        };
+
+        // Padding of a few samples, and none after the last row
+        const size_t sample_size = depth / 8;
+        const size_t row_size = w * nb_chan * sample_size;
+        const size_t stride = row_size + 3 * sample_size;
+        const size_t size = stride * (h - 1) + row_size;
+        std::vector<uint16_t> storage(size / 2 + 1, 0xABAB);
+        const std::span<uint8_t> dst(reinterpret_cast<uint8_t*>(storage.data()), size);
+
+        if (!ivmg::CodecRegistry::decode_into(file, dst, stride, fmt).has_value()) {
+            std::cout << "decode_into failed for format " << static_cast<int>(fmt);
+            return false;
+        }
+
+        for (size_t y = 0; y < h; y++) {
+            for (size_t x = 0; x < w; x++) {
+                for (size_t c = 0; c < nb_chan; c++) {
+                    const size_t offset = y * stride + (x * nb_chan + c) * sample_size;
+                    const uint32_t got = (depth == 16) ? reinterpret_cast<const uint16_t*>(dst.data() + offset)[0] : dst[offset];
+                    if (got != expected_sample(y * w + x, c)) {
+                        std::cout << "decode_into format " << static_cast<int>(fmt) << " differs at " << x << "," << y;
+                        return false;
+                    }
+                }
+            }
+
+            // The padding is left alone
+            for (size_t i = row_size; y + 1 < h && i < stride; i++) {
+                if (dst[y * stride + i] != 0xAB) {
+                    std::cout << "decode_into format " << static_cast<int>(fmt) << " wrote in the padding of row " << y;
+                    return false;
+                }
+            }
+        }
+
+        // One byte short, or a stride shorter than a row
+        auto small = ivmg::CodecRegistry::decode_into(file, dst.first(size - 1), stride, fmt);
+        auto narrow = ivmg::CodecRegistry::decode_into(file, dst, row_size - sample_size, fmt);
+        if (small.has_value() || small.error() != IVMG_DEC_ERR::BUFFER_TOO_SMALL || narrow.has_value() || narrow.error() != IVMG_DEC_ERR::BUFFER_TOO_SMALL) {
+            std::cout << "Too small buffer accepted for format " << static_cast<int>(fmt);
+            return false;
+        }
+
+        // 16 bits samples need 2 bytes aligned rows
+        if (depth == 16) {
+            auto odd_stride = ivmg::CodecRegistry::decode_into(file, dst, stride + 1, fmt);
+            auto odd_start = ivmg::CodecRegistry::decode_into(file, std::span(dst.data() + 1, size - 1), stride, fmt);
+            if (odd_stride.has_value() || odd_stride.error() != IVMG_DEC_ERR::UNSUPPORTED_PIXEL_FORMAT
+                || odd_start.has_value() || odd_start.error() != IVMG_DEC_ERR::UNSUPPORTED_PIXEL_FORMAT) {
+                std::cout << "Unaligned 16 bits rows accepted for format " << static_cast<int>(fmt);
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+
+/**
+ * @brief A region of the image, downscaled: averages of the blocks of the pixels of the full decode
+ */
+bool check_region(const std::vector<uint8_t>& file, const ivmg::Rect& roi, uint8_t scale) {
+    ivmg::DecodeOptions opts;
+    opts.roi = roi;
+    opts.scale = scale;
+
+    auto full = ivmg::CodecRegistry::decode(file);
+    auto region = ivmg::CodecRegistry::decode(file, opts);
+    if (!full.has_value() || !region.has_value()) {
+        std::cout << "Decoding a region failed";
+        return false;
+    }
+
+    return check_downscaled(*full, roi, scale, *region);
+}
+
+
+/**
+ * @brief Interlaced files decode like lodepng does, and early Adam7 passes give the pixels on their grid
+ */
+bool check_adam7(const Fixture& fx, std::mt19937& rng) {
+    std::uniform_int_distribution<unsigned> dim(1, MAX_DIM);
+    const std::vector<uint8_t> file = encode_fixture(fx, dim(rng), dim(rng), 1, rng);
+    if (file.empty() || !check_against_lodepng(file, {}) || !check_streaming(file))
+        return false;
+
+    auto full = ivmg::CodecRegistry::decode(file);
+
+    // After pass 1 every 8th pixel of every 8th row is known, every 4th of every 4th after pass 3
+    for (auto [passes, step] : { std::pair<uint8_t, uint32_t> { 1, 8 }, { 3, 4 } }) {
+        ivmg::DecodeOptions opts;
+        opts.adam7_passes = passes;
+
+        auto preview = ivmg::CodecRegistry::decode(file, opts);
+        if (!preview.has_value() || preview->width() != (full->width() + step - 1) / step || preview->height() != (full->height() + step - 1) / step
+            || preview->color() != full->color() || preview->bit_depth() != full->bit_depth()) {
+            std::cout << "Wrong preview size after " << +passes << " Adam7 passes";
+            return false;
+        }
+
+        const size_t px_size = full->nb_chan() * full->bit_depth() / 8;
+        for (size_t y = 0; y < preview->height(); y++) {
+            for (size_t x = 0; x < preview->width(); x++) {
+                const uint8_t* expected = full->get_raw_handle() + (y * step * full->width() + x * step) * px_size;
+                if (std::memcmp(preview->get_raw_handle() + (y * preview->width() + x) * px_size, expected, px_size) != 0) {
+                    std::cout << "Preview after " << +passes << " Adam7 passes differs at " << x << "," << y;
+                    return false;
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+
+/**
+ * @brief The same file with the CRC of its first chunk of this type flipped
+ */
+/**
+ * @brief Files written with an iDOT chunk decode through their segments as lodepng reads them, even on a single core
+ */
+bool check_segments(std::mt19937& rng) {
+    ivmg::EncodeSession session;
+    ivmg::EncodeOptions enc;
+    enc.png_idot = true;
+    enc.compression_level = 1;
+
+    // The decoder only inflates segments when it has several cores to spread them over
+    forced_workers = 4;
+    bool ok = true;
+
+    for (ivmg::ColorType ct : { ivmg::ColorType::GRAY, ivmg::ColorType::RGB, ivmg::ColorType::RGBA }) {
+        for (uint8_t depth : { 8, 16 }) {
+            ivmg::Image img(IDOT_DIM, IDOT_DIM - rng() % 64, ct, depth);
+            uint8_t* data = img.get_raw_handle();
+            for (size_t i = 0; i < img.size_bytes(); i++)
+                data[i] = static_cast<uint8_t>((i % 3 == 0) ? rng() : i / 11);
+
+            auto encoded = session.encode(img, std::string(".png"), enc);
+            if (!encoded.has_value()) {
+                std::cout << "Encoding failed";
+                ok = false;
+                break;
+            }
+
+            const std::vector<uint8_t> file(encoded->begin(), encoded->end());
+            const uint32_t w = img.width(), h = img.height();
+            ok = check_against_lodepng(file, {}) && check_region(file, ivmg::Rect { w / 4, h / 3, w / 2, h / 3 }, 1) && check_region(file, ivmg::Rect { 0, 0, w, h }, 2);
+            if (!ok) {
+                std::cout << " (iDOT segments, " << +img.nb_chan() << " channels of " << +depth << " bits)\n";
+                break;
+            }
+        }
+        if (!ok)
+            break;
+    }
+
+    forced_workers = 0;
+    return ok;
+}
+
+
+std::vector<uint8_t> corrupt_crc(std::vector<uint8_t> file, const char* type) {
+    const uint8_t* end = file.data() + file.size();
+    for (uint8_t* chunk = file.data() + 8; chunk < end; chunk = lodepng_chunk_next(chunk, file.data() + file.size())) {
+        if (lodepng_chunk_type_equals(chunk, type)) {
+            chunk[8 + lodepng_chunk_length(chunk)] ^= 0xFF;
+            break;
+        }
+    }
+    return file;
+}
+
+
+/**
+ * @brief Probing reads the header only: what lodepng wrote in it comes back, files cut before its end fail
+ */
+bool check_probe(const std::vector<uint8_t>& file) {
+    lodepng::State state;
+    unsigned w, h;
+    lodepng_inspect(&w, &h, &state, file.data(), file.size());
+
+    // Signature, IHDR length and type, then 13 bytes of header
+    constexpr size_t ihdr_end = 8 + 8 + 13;
+    const std::vector<uint8_t> header(file.begin(), file.begin() + ihdr_end);
+
+    for (const std::vector<uint8_t>& data : { file, header }) {
+        auto info = ivmg::CodecRegistry::probe(data);
+        if (!info.has_value() || info->width != w || info->height != h || info->channels != lodepng_get_channels(&state.info_png.color)
+            || info->bit_depth != state.info_png.color.bitdepth || info->format != "png") {
+            std::cout << "Wrong PNG probe";
+            return false;
+        }
+    }
+
+    if (ivmg::CodecRegistry::probe(std::span(header).first(ihdr_end - 1)).has_value()) {
+        std::cout << "Truncated header probed";
+        return false;
+    }
+
+    // Decoding needs the whole file
+    const std::vector<uint8_t> truncated(file.begin(), file.end() - 20);
+    if (ivmg::CodecRegistry::decode(truncated).has_value()) {
+        std::cout << "Truncated file decoded";
+        return false;
+    }
+
+    return true;
+}
+
+
+/**
+ * @brief Corrupted CRCs fail the decode or not depending on the policy and on the chunk being critical
+ */
+bool check_crc_policies(std::mt19937& rng) {
+    // The color key is stored in tRNS, an ancillary chunk
+    const std::vector<uint8_t> file = encode_fixture({ LCT_RGB, 8, false, true }, MAX_DIM, MAX_DIM, 0, rng);
+    auto reference = ivmg::CodecRegistry::decode(file);
+
+    struct Case {
+        const char* chunk;
+        ivmg::CrcPolicy policy;
+        bool decodes;
+    };
+
+    static constexpr Case cases[] = {
+        { "tRNS", ivmg::CrcPolicy::ALL, false }, { "tRNS", ivmg::CrcPolicy::CRITICAL, true }, { "tRNS", ivmg::CrcPolicy::NONE, true },
+        { "IDAT", ivmg::CrcPolicy::ALL, false }, { "IDAT", ivmg::CrcPolicy::CRITICAL, false }, { "IDAT", ivmg::CrcPolicy::NONE, true },
+        { "IHDR", ivmg::CrcPolicy::CRITICAL, false }, { "IEND", ivmg::CrcPolicy::CRITICAL, false },
+    };
+
+    for (const Case& c : cases) {
+        ivmg::DecodeOptions opts;
+        opts.crc_check = c.policy;
+
+        auto img = ivmg::CodecRegistry::decode(corrupt_crc(file, c.chunk), opts);
+        const bool same = img.has_value() && std::memcmp(img->get_raw_handle(), reference->get_raw_handle(), reference->size_bytes()) == 0;
+        if (c.decodes != same || (!c.decodes && img.error() != IVMG_DEC_ERR::CRC_MISMATCH)) {
+            std::cout << "Corrupted " << c.chunk << " CRC with policy " << static_cast<int>(c.policy) << (c.decodes ? " failed" : " decoded") << "\n";
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+/**
+ * @brief Type and data of every chunk of a file
+ */
+std::vector<std::pair<std::string, std::vector<uint8_t>>> file_chunks(const std::vector<uint8_t>& file) {
+    std::vector<std::pair<std::string, std::vector<uint8_t>>> chunks;
+    const uint8_t* end = file.data() + file.size();
+    for (const uint8_t* chunk = file.data() + 8; chunk < end; chunk = lodepng_chunk_next_const(chunk, end))
+        chunks.emplace_back(std::string(chunk + 4, chunk + 8), std::vector<uint8_t>(chunk + 8, chunk + 8 + lodepng_chunk_length(chunk)));
+    return chunks;
+}
+
+
+/**
+ * @brief A PNG made of these chunks, with valid CRCs
+ */
+std::vector<uint8_t> build_png(const std::vector<std::pair<std::string, std::vector<uint8_t>>>& chunks) {
+    std::vector<uint8_t> out = { 0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A };
+    for (const auto& [type, data] : chunks) {
+        for (size_t b = 4; b-- > 0;)
+            out.push_back(static_cast<uint8_t>(data.size() >> (8 * b)));
+        const size_t start = out.size();
+        out.insert(out.end(), type.begin(), type.end());
+        out.insert(out.end(), data.begin(), data.end());
+        const unsigned crc = lodepng_crc32(out.data() + start, out.size() - start);
+        for (size_t b = 4; b-- > 0;)
+            out.push_back(static_cast<uint8_t>(crc >> (8 * b)));
+    }
+    return out;
+}
+
+
+/**
+ * @brief Out of range sizes and misplaced IHDR chunks are invalid headers, not exceptions nor other errors
+ */
+bool check_invalid_headers(std::mt19937& rng) {
+    const auto chunks = file_chunks(encode_fixture({ LCT_RGB, 8 }, 16, 16, 0, rng));
+    std::vector<std::vector<uint8_t>> files;
+
+    for (auto [w, h] : { std::pair<uint32_t, uint32_t> { 0x7FFFFFFF, 0x7FFFFFFF }, { 0x80000000, 1 }, { 1, 0xFFFFFFFF }, { 0, 16 }, { 16, 0 }, { 40000, 40000 } }) {
+        auto resized = chunks;
+        for (size_t b = 0; b < 4; b++) {
+            resized[0].second[b] = static_cast<uint8_t>(w >> (24 - 8 * b));
+            resized[0].second[4 + b] = static_cast<uint8_t>(h >> (24 - 8 * b));
+        }
+        files.push_back(build_png(resized));
+    }
+
+    // No IHDR, IHDR after another chunk, two IHDR, a short IHDR
+    auto edited = chunks;
+    edited.erase(edited.begin());
+    files.push_back(build_png(edited));
+
+    edited = chunks;
+    std::swap(edited[0], edited[1]);
+    files.push_back(build_png(edited));
+
+    edited = chunks;
+    edited.insert(edited.begin() + 1, chunks[0]);
+    files.push_back(build_png(edited));
+
+    edited = chunks;
+    edited[0].second.pop_back();
+    files.push_back(build_png(edited));
+
+    for (size_t i = 0; i < files.size(); i++) {
+        auto img = ivmg::CodecRegistry::decode(files[i]);
+        if (img.has_value() || img.error() != IVMG_DEC_ERR::INVALID_HEADER) {
+            std::cout << "Invalid header " << i << " not rejected as such\n";
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+int main() {
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<unsigned> dim(1, MAX_DIM);
+
+    const Fixture fixtures[] = {
+        { LCT_PALETTE, 1 }, { LCT_PALETTE, 2 }, { LCT_PALETTE, 4 }, { LCT_PALETTE, 8 }, { LCT_PALETTE, 8, true },
+        { LCT_PALETTE, 2, true },
+        { LCT_GREY, 1 }, { LCT_GREY, 2 }, { LCT_GREY, 4 }, { LCT_GREY, 8 }, { LCT_GREY, 16 },
+        { LCT_GREY, 1, false, true }, { LCT_GREY, 4, false, true }, { LCT_GREY, 8, false, true }, { LCT_GREY, 16, false, true },
+        { LCT_GREY_ALPHA, 8 }, { LCT_GREY_ALPHA, 16 },
+        { LCT_RGB, 8 }, { LCT_RGB, 16 }, { LCT_RGB, 8, false, true }, { LCT_RGB, 16, false, true },
+        { LCT_RGBA, 8 }, { LCT_RGBA, 16 },
+    };
+
+    for (const Fixture& fx : fixtures) {
+        for (size_t i = 0; i < 3; i++) {
+            // Image data in one IDAT chunk, then split over many
+            const std::vector<uint8_t> file = encode_fixture(fx, dim(rng), dim(rng), 0, rng);
+            const std::vector<uint8_t> split = split_idat(file, 1 + rng() % 100);
+            bool ok = !file.empty() && check_probe(file) && check_against_lodepng(file, {}) && check_against_lodepng(split, {}) && check_streaming(file) && check_streaming(split)
+                && check_decode_into(file);
+
+            // The whole image, a region in the middle and one running past the bottom right corner, at every scale
+            auto full = ivmg::CodecRegistry::decode(file);
+            const uint32_t w = full ? full->width() : 0, h = full ? full->height() : 0;
+            for (const ivmg::Rect& roi : { ivmg::Rect { 0, 0, w, h }, ivmg::Rect { w / 4, h / 3, w / 2 + 1, h / 2 + 1 }, ivmg::Rect { w / 2, h / 2, w, h } })
+                for (uint8_t scale : { 1, 2, 4, 8 })
+                    ok = ok && check_region(file, roi, scale) && check_region(split, roi, scale);
+
+            if (!ok) {
+                std::cout << " (color type " << fx.color_type << ", " << fx.bit_depth << " bits)\n";
+                return 1;
+            }
+        }
+    }
+
+    for (const Fixture& fx : { Fixture { LCT_PALETTE, 2 }, Fixture { LCT_GREY, 1, false, true }, Fixture { LCT_GREY_ALPHA, 8 }, Fixture { LCT_RGB, 16 }, Fixture { LCT_RGBA, 8 } }) {
+        if (!check_adam7(fx, rng)) {
+            std::cout << " (interlaced, color type " << fx.color_type << ", " << fx.bit_depth << " bits)\n";
+            return 1;
+        }
+    }
+
+    return check_segments(rng) && check_crc_policies(rng) && check_invalid_headers(rng) ? 0 : 1;
+}
@@ -0,0 +1,141 @@
+#include "common.hpp"
+#include "lodepng.h"
+
+#include <ivmg/core/image.hpp>
+#include <ivmg/codecs/codecs.hpp>
+#include <ivmg/codecs/session.hpp>
+
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+
+#define MAX_ENC_DIM 300
+#define STRIPS_DIM 1200     // Large enough to be split in strips
+
+/**
+ * @brief A plain background with a few random glyphs stamped all over, repeating far apart like text on a screenshot
+ */
+void fill_flat(ivmg::Image& img, std::mt19937& rng) {
+    static constexpr uint32_t glyph_w = 7, glyph_h = 12;
+    const size_t pixel_size = img.nb_chan() * img.bytes_per_sample();
+    uint8_t* data = img.get_raw_handle();
+    std::fill_n(data, img.size_bytes(), 0xF0);
+
+    if (img.width() <= glyph_w || img.height() <= glyph_h)
+        return;
+
+    std::vector<std::vector<bool>> glyphs(16, std::vector<bool>(glyph_w * glyph_h));
+    for (auto& glyph : glyphs)
+        for (size_t i = 0; i < glyph.size(); i++)
+            glyph[i] = rng() % 2;
+
+    for (size_t n = 0; n < img.size_pixels() / 100; n++) {
+        const auto& glyph = glyphs[rng() % glyphs.size()];
+        const uint32_t x0 = rng() % (img.width() - glyph_w), y0 = rng() % (img.height() - glyph_h);
+
+        for (uint32_t y = 0; y < glyph_h; y++)
+            for (uint32_t x = 0; x < glyph_w; x++)
+                if (glyph[y * glyph_w + x])
+                    std::fill_n(data + ((y0 + y) * static_cast<size_t>(img.width()) + x0 + x) * pixel_size, pixel_size, 0x20);
+    }
+}
+
+
+bool check_round_trip(ivmg::EncodeSession& session, const ivmg::Image& img, const ivmg::EncodeOptions& opts) {
+    auto encoded = session.encode(img, std::string(".png"), opts);
+    if (!encoded.has_value()) {
+        std::cout << "Encoding failed";
+        return false;
+    }
+
+    static constexpr LodePNGColorType lode_types[] = { LCT_GREY, LCT_GREY_ALPHA, LCT_RGB, LCT_RGBA };
+
+    // lodepng checks the chunk CRCs and the zlib Adler-32
+    std::vector<unsigned char> decoded;
+    unsigned w, h;
+    unsigned error = lodepng::decode(decoded, w, h, encoded->data(), encoded->size(), lode_types[img.nb_chan() - 1], img.bit_depth());
+    if (error) {
+        std::cout << "lodepng failed to decode: " << lodepng_error_text(error);
+        return false;
+    }
+
+    // lodepng returns 16 bits samples big endian
+    std::vector<unsigned char> expected(img.get_raw_handle(), img.get_raw_handle() + img.size_bytes());
+    if (img.bit_depth() == 16 && std::endian::native == std::endian::little)
+        for (size_t i = 0; i < expected.size(); i += 2)
+            std::swap(expected[i], expected[i + 1]);
+
+    if (w != img.width() || h != img.height() || decoded != expected) {
+        std::cout << "Image mismatch for " << img.width() << "x" << img.height() << " with " << +img.nb_chan()
+                  << " channels at " << +img.bit_depth() << " bits, filter " << static_cast<int>(opts.png_filter);
+        return false;
+    }
+
+    // Also read back by ivmg, through the iDOT segments on multi core hosts
+    auto own = ivmg::CodecRegistry::decode(*encoded);
+    if (!own.has_value() || own->size_bytes() != img.size_bytes() || std::memcmp(own->get_raw_handle(), img.get_raw_handle(), img.size_bytes()) != 0) {
+        std::cout << "ivmg failed to read back a " << img.width() << "x" << img.height() << " image";
+        return false;
+    }
+
+    return true;
+}
+
+
+int main(int argc, char** argv) {
+    assert(argc == 2);
+
+    // A compression level, or "fast"
+    ivmg::EncodeOptions opts;
+    opts.png_fast = std::string(argv[1]) == "fast";
+    if (!opts.png_fast)
+        opts.compression_level = std::stoi(argv[1]);
+
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<unsigned> dim(1, MAX_ENC_DIM);
+    ivmg::EncodeSession session;
+
+    for (ivmg::ColorType ct : { ivmg::ColorType::GRAY, ivmg::ColorType::GRAYA, ivmg::ColorType::RGB, ivmg::ColorType::RGBA }) {
+        for (uint8_t depth : { 8, 16 }) {
+            for (ivmg::PngFilter filter : { ivmg::PngFilter::NONE, ivmg::PngFilter::SUB, ivmg::PngFilter::UP, ivmg::PngFilter::AVG, ivmg::PngFilter::PAETH,
+                                            ivmg::PngFilter::ADAPTIVE, ivmg::PngFilter::BRUTE_FORCE }) {
+                ivmg::Image img(dim(rng), dim(rng), ct, depth);
+                fill_image(img, rng);
+
+                opts.png_filter = filter;
+                if (!check_round_trip(session, img, opts))
+                    return 1;
+            }
+        }
+    }
+
+    // Glyphs repeating anywhere, which the fast writer looks for with a hash table, over several blocks for the large one
+    opts.png_filter = ivmg::PngFilter::ADAPTIVE;
+    for (ivmg::ColorType ct : { ivmg::ColorType::GRAY, ivmg::ColorType::RGB, ivmg::ColorType::RGBA }) {
+        for (uint32_t side : { dim(rng), static_cast<uint32_t>(STRIPS_DIM) }) {
+            ivmg::Image img(side, side - side / 4, ct, 8);
+            fill_flat(img, rng);
+
+            if (!check_round_trip(session, img, opts))
+                return 1;
+        }
+    }
+
+    // Strips compressed on their own and listed in an iDOT chunk
+    opts.png_idot = true;
+    for (ivmg::ColorType ct : { ivmg::ColorType::GRAY, ivmg::ColorType::RGBA }) {
+        for (uint8_t depth : { 8, 16 }) {
+            ivmg::Image img(STRIPS_DIM, STRIPS_DIM - dim(rng) % 64, ct, depth);
+            fill_image(img, rng);
+
+            if (!check_round_trip(session, img, opts))
+                return 1;
+        }
+    }
+
+    return 0;
+}
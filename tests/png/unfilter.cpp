@@ -0,0 +1,69 @@
+#include "png/unfilter.hpp"
+
+#include <array>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#define MAX_ROW_LEN 1000
+#define GUARD 64            // Bytes past the end of the row that the kernels must not touch
+
+
+/**
+ * @brief Every filter of the kernel table unfilters random rows into the same bytes as the scalar version
+ */
+bool check_kernels(const ivmg::UnfilterKernels& simd, const ivmg::UnfilterKernels& scalar, size_t bpp, std::mt19937& rng) {
+    static constexpr std::array<const char*, 4> names { "sub", "up", "avg", "paeth" };
+    const std::array<ivmg::UnfilterFn, 4> simd_fns { simd.sub, simd.up, simd.avg, simd.paeth };
+    const std::array<ivmg::UnfilterFn, 4> scalar_fns { scalar.sub, scalar.up, scalar.avg, scalar.paeth };
+
+    for (size_t f = 0; f < names.size(); f++) {
+        for (size_t n = 0; n < 200; n++) {
+            // Short rows too, and lengths that are not a multiple of the register width
+            const size_t len = bpp * (1 + rng() % (MAX_ROW_LEN / bpp));
+            std::vector<uint8_t> prev(len + GUARD), row(len + GUARD);
+            for (size_t i = 0; i < len + GUARD; i++) {
+                prev[i] = static_cast<uint8_t>(rng());
+                row[i] = static_cast<uint8_t>(rng());
+            }
+
+            std::vector<uint8_t> expected = row;
+            scalar_fns[f](expected.data(), prev.data(), len);
+            simd_fns[f](row.data(), prev.data(), len);
+
+            if (row != expected) {
+                std::cout << "Unfilter " << names[f] << " differs from the scalar version for a row of " << len << " bytes at bpp " << bpp << "\n";
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+
+int main() {
+    std::mt19937 rng(42);
+
+    for (size_t bpp : { 3, 4 }) {
+        const ivmg::UnfilterKernels& scalar = *ivmg::unfilter_kernels(bpp, ivmg::UnfilterIsa::SCALAR);
+
+        for (ivmg::UnfilterIsa isa : { ivmg::UnfilterIsa::SSE41, ivmg::UnfilterIsa::AVX2 }) {
+            const ivmg::UnfilterKernels* simd = ivmg::unfilter_kernels(bpp, isa);
+            if (simd == nullptr) {
+                std::cout << "Instruction set " << static_cast<int>(isa) << " unavailable, skipped\n";
+                continue;
+            }
+
+            if (!check_kernels(*simd, scalar, bpp, rng))
+                return 1;
+        }
+
+        // The table decoders get is one of those
+        if (!check_kernels(ivmg::select_unfilter_kernels(bpp), scalar, bpp, rng))
+            return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,116 @@
+#include "reference.hpp"
+
+#include <ivmg/core/image.hpp>
+#include <ivmg/codecs/session.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <print>
+#include <random>
+#include <thread>
+
+#define BENCH_DIM 2048
+#define BENCH_RUNS 5
+
+
+/**
+ * @brief Smooth shapes with a bit of noise, compressing about like a photo
+ */
+ivmg::Image make_photo() {
+    ivmg::Image img(BENCH_DIM, BENCH_DIM, ivmg::ColorType::RGBA);
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<int> noise(-4, 4);
+    uint8_t* px = img.get_raw_handle();
+
+    for (unsigned y = 0; y < BENCH_DIM; y++) {
+        for (unsigned x = 0; x < BENCH_DIM; x++, px += 4) {
+            const double d = std::hypot(x - BENCH_DIM / 2.0, y - BENCH_DIM / 3.0);
+            px[0] = static_cast<uint8_t>(std::clamp(128 + 100 * std::sin(d / 40) + noise(rng), 0.0, 255.0));
+            px[1] = static_cast<uint8_t>((x + y) / 16);
+            px[2] = static_cast<uint8_t>(std::clamp(x * 255.0 / BENCH_DIM + noise(rng), 0.0, 255.0));
+            px[3] = 255;
+        }
+    }
+
+    return img;
+}
+
+
+/**
+ * @brief Flat panels and a few lines of text like strokes, as in screenshots
+ */
+ivmg::Image make_screenshot() {
+    ivmg::Image img(BENCH_DIM, BENCH_DIM, ivmg::ColorType::RGBA);
+    std::mt19937 rng(7);
+    uint8_t* px = img.get_raw_handle();
+
+    for (unsigned y = 0; y < BENCH_DIM; y++) {
+        for (unsigned x = 0; x < BENCH_DIM; x++, px += 4) {
+            const bool panel = (x / 256 + y / 192) % 3 == 0;
+            const bool text = (y % 24) < 12 && (x % 9) < 5 && rng() % 3 == 0;
+            const uint8_t v = text ? 30 : panel ? 240 : 200;
+            px[0] = v;
+            px[1] = v;
+            px[2] = static_cast<uint8_t>(panel ? 255 : v);
+            px[3] = 255;
+        }
+    }
+
+    return img;
+}
+
+
+template <typename F>
+double best_seconds(F&& fn) {
+    double best = 1e30;
+    for (int run = 0; run < BENCH_RUNS; run++) {
+        const auto start = std::chrono::steady_clock::now();
+        fn();
+        const auto end = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double>(end - start).count());
+    }
+    return best;
+}
+
+
+int main() {
+    std::println("Encoding and decoding {}x{} RGBA QOI images, best of {} runs", BENCH_DIM, BENCH_DIM, BENCH_RUNS);
+
+    ivmg::EncodeSession enc_session;
+    ivmg::DecodeSession dec_session;
+
+    for (const auto& [name, img] : { std::pair { "photo", make_photo() }, std::pair { "screenshot", make_screenshot() } }) {
+        const double mbytes = img.size_bytes() / 1e6;
+
+        std::vector<uint8_t> file;
+        const double enc_s = best_seconds([&] {
+            auto encoded = enc_session.encode(img, std::string(".qoi"));
+            file.assign(encoded->begin(), encoded->end());
+        });
+
+        unsigned w, h;
+        const double ref_s = best_seconds([&] { qoi_reference_decode(file.data(), file.size(), 4, w, h); });
+
+        std::vector<uint8_t> pixels(img.size_bytes());
+        const double ivmg_s = best_seconds([&] { dec_session.decode_into(file, pixels, BENCH_DIM * 4, ivmg::PixelFormat::RGBA8); });
+
+        std::println("{:>12} {:>10} bytes  encode {:>8.1f} MB/s  decode: reference {:>8.1f} MB/s  ivmg {:>8.1f} MB/s  x{:.2f}",
+                     name, file.size(), mbytes / enc_s, mbytes / ref_s, mbytes / ivmg_s, ref_s / ivmg_s);
+
+        // Segments of 64 rows, on every core
+        ivmg::EncodeOptions opts;
+        opts.qoi_segment_rows = 64;
+
+        const double seg_enc_s = best_seconds([&] {
+            auto encoded = enc_session.encode(img, std::string(".qoi"), opts);
+            file.assign(encoded->begin(), encoded->end());
+        });
+        const double seg_dec_s = best_seconds([&] { dec_session.decode_into(file, pixels, BENCH_DIM * 4, ivmg::PixelFormat::RGBA8); });
+
+        std::println("{:>12} {:>10} bytes  encode {:>8.1f} MB/s  decode {:>8.1f} MB/s  (segments of {} rows, {} threads)",
+                     "", file.size(), mbytes / seg_enc_s, mbytes / seg_dec_s, opts.qoi_segment_rows, std::thread::hardware_concurrency());
+    }
+
+    return 0;
+}
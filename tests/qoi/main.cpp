@@ -0,0 +1,290 @@
+#include "common.hpp"
+#include "reference.hpp"
+
+#include <ivmg/core/image.hpp>
+#include <ivmg/codecs/codecs.hpp>
+#include <ivmg/codecs/session.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+
+#define MAX_DIM 300
+
+bool check_decode(ivmg::EncodeSession& session, const ivmg::Image& img) {
+    auto encoded = session.encode(img, std::string(".qoi"));
+    if (!encoded.has_value()) {
+        std::cout << "Encoding failed";
+        return false;
+    }
+
+    const std::vector<uint8_t> file(encoded->begin(), encoded->end());
+    const unsigned channels = file[12];
+
+    unsigned w, h;
+    const std::vector<uint8_t> expected = qoi_reference_decode(file.data(), file.size(), channels, w, h);
+
+    auto decoded = ivmg::CodecRegistry::decode(file);
+    if (!decoded.has_value() || decoded->width() != w || decoded->height() != h || decoded->nb_chan() != channels
+        || std::memcmp(decoded->get_raw_handle(), expected.data(), expected.size()) != 0) {
+        std::cout << "Decoded " << img.width() << "x" << img.height() << " image with " << +img.nb_chan() << " channels differs from the reference";
+        return false;
+    }
+
+    // Rows with padding: runs cross the end of the rows
+    const size_t stride = w * 4 + 12;
+    std::vector<uint8_t> padded(stride * h);
+    if (!ivmg::CodecRegistry::decode_into(file, padded, stride, ivmg::PixelFormat::RGBA8).has_value()) {
+        std::cout << "decode_into failed";
+        return false;
+    }
+
+    std::vector<uint8_t> expected_rgba = qoi_reference_decode(file.data(), file.size(), 4, w, h);
+    for (size_t y = 0; y < h; y++) {
+        if (std::memcmp(padded.data() + y * stride, expected_rgba.data() + y * w * 4, w * 4) != 0) {
+            std::cout << "decode_into with a stride of " << stride << " differs on row " << y;
+            return false;
+        }
+    }
+
+    // Alpha dropped while decoding, whatever the channels of the file
+    const size_t rgb_stride = w * 3 + 5;
+    std::vector<uint8_t> rgb(rgb_stride * h);
+    if (!ivmg::CodecRegistry::decode_into(file, rgb, rgb_stride, ivmg::PixelFormat::RGB8).has_value()) {
+        std::cout << "decode_into RGB8 failed";
+        return false;
+    }
+
+    const std::vector<uint8_t> expected_rgb = qoi_reference_decode(file.data(), file.size(), 3, w, h);
+    for (size_t y = 0; y < h; y++) {
+        if (std::memcmp(rgb.data() + y * rgb_stride, expected_rgb.data() + y * w * 3, w * 3) != 0) {
+            std::cout << "decode_into RGB8 with a stride of " << rgb_stride << " differs on row " << y;
+            return false;
+        }
+    }
+
+    // 16 bits gray alpha goes through the conversion
+    std::vector<uint16_t> gray(static_cast<size_t>(w) * h * 2);
+    auto gray_res = ivmg::CodecRegistry::decode_into(file, std::span(reinterpret_cast<uint8_t*>(gray.data()), gray.size() * 2), w * 4, ivmg::PixelFormat::GRAYA16);
+    if (!gray_res.has_value()) {
+        std::cout << "decode_into GRAYA16 failed";
+        return false;
+    }
+
+    for (size_t i = 0; i < static_cast<size_t>(w) * h; i++) {
+        const uint8_t* px = expected_rgba.data() + i * 4;
+        const uint16_t luma = static_cast<uint16_t>(((77 * px[0] + 150 * px[1] + 29 * px[2] + 128) >> 8) * 257);
+        if (gray[i * 2] != luma || gray[i * 2 + 1] != px[3] * 257) {
+            std::cout << "GRAYA16 pixel " << i << " is wrong";
+            return false;
+        }
+    }
+
+    // A region, downscaled: averages of the blocks of the reference pixels
+    const ivmg::Rect roi { w / 4, h / 3, w / 2 + 1, h / 2 + 1 };
+    ivmg::DecodeOptions opts;
+    opts.roi = roi;
+    opts.scale = 2;
+    opts.force_rgba = true;
+
+    auto scaled = ivmg::CodecRegistry::decode(file, opts);
+    if (!scaled.has_value()) {
+        std::cout << "Decoding a region failed";
+        return false;
+    }
+
+    ivmg::Image reference(w, h);
+    std::memcpy(reference.get_raw_handle(), expected_rgba.data(), reference.size_bytes());
+    if (!check_downscaled(reference, roi, 2, *scaled))
+        return false;
+
+    // A truncated file is an error, not a crash
+    const std::vector<uint8_t> truncated(file.begin(), file.begin() + file.size() / 2);
+    if (file.size() > 40 && ivmg::CodecRegistry::decode(truncated).has_value()) {
+        std::cout << "Truncated file decoded";
+        return false;
+    }
+
+    return true;
+}
+
+
+/**
+ * @brief Segmented files decode to the pixels of plain ones, with ivmg and with a plain QOI decoder
+ */
+bool check_segments(ivmg::EncodeSession& session, const ivmg::Image& img, uint32_t segment_rows) {
+    auto plain = session.encode(img, std::string(".qoi"));
+    const std::vector<uint8_t> plain_file(plain->begin(), plain->end());
+    const unsigned channels = plain_file[12];
+
+    unsigned w, h;
+    const std::vector<uint8_t> expected = qoi_reference_decode(plain_file.data(), plain_file.size(), channels, w, h);
+
+    ivmg::EncodeOptions opts;
+    opts.qoi_segment_rows = segment_rows;
+
+    auto encoded = session.encode(img, std::string(".qoi"), opts);
+    if (!encoded.has_value()) {
+        std::cout << "Segmented encoding failed";
+        return false;
+    }
+
+    std::vector<uint8_t> file(encoded->begin(), encoded->end());
+    if (qoi_reference_decode(file.data(), file.size(), channels, w, h) != expected) {
+        std::cout << "Plain decoder reads segments of " << segment_rows << " rows wrong";
+        return false;
+    }
+
+    auto decoded = ivmg::CodecRegistry::decode(file);
+    if (!decoded.has_value() || std::memcmp(decoded->get_raw_handle(), expected.data(), expected.size()) != 0) {
+        std::cout << "Segments of " << segment_rows << " rows decoded wrong";
+        return false;
+    }
+
+    // Regions start from the segment holding their first row
+    ivmg::DecodeOptions region;
+    region.roi = ivmg::Rect { w / 3, h / 2, w / 2 + 1, h / 3 + 1 };
+    auto part = ivmg::CodecRegistry::decode(file, region);
+    if (!part.has_value()) {
+        std::cout << "Region of a segmented file failed";
+        return false;
+    }
+
+    const size_t row_size = part->width() * channels;
+    for (uint32_t y = 0; y < part->height(); y++) {
+        const uint8_t* src = expected.data() + ((region.roi->y + y) * static_cast<size_t>(w) + region.roi->x) * channels;
+        if (std::memcmp(part->get_raw_handle() + y * row_size, src, row_size) != 0) {
+            std::cout << "Region of a segmented file differs on row " << y;
+            return false;
+        }
+    }
+
+    // A table pointing to the wrong ops is ignored
+    if (file.size() > 40) {
+        file[file.size() - 21] ^= 1;
+        auto fallback = ivmg::CodecRegistry::decode(file);
+        if (!fallback.has_value() || std::memcmp(fallback->get_raw_handle(), expected.data(), expected.size()) != 0) {
+            std::cout << "Damaged segments table not ignored";
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+/**
+ * @brief A QOI file around hand written ops, which our encoder would not always produce
+ */
+std::vector<uint8_t> build_qoi(uint32_t width, uint32_t height, uint8_t channels, const std::vector<uint8_t>& ops) {
+    std::vector<uint8_t> file = { 'q', 'o', 'i', 'f' };
+    for (uint32_t v : { width, height })
+        for (size_t b = 4; b-- > 0;)
+            file.push_back(static_cast<uint8_t>(v >> (8 * b)));
+    file.insert(file.end(), { channels, 0 });
+    file.insert(file.end(), ops.begin(), ops.end());
+    file.insert(file.end(), { 0, 0, 0, 0, 0, 0, 0, 1 });
+    return file;
+}
+
+
+/**
+ * @brief Hand built op streams decode like the reference: the color cache is updated after every op, runs and indexes included
+ */
+bool check_hand_built(std::mt19937& rng) {
+    // A run of the initial pixel caches it in slot 53, which a zero initialized slot does not hold
+    std::vector<std::pair<std::array<uint32_t, 2>, std::vector<uint8_t>>> streams = { { { 2, 1 }, { 0xC0, 0x35 } } };
+
+    // Random ops of every kind, indexes into slots that were written or not
+    std::uniform_int_distribution<unsigned> dim(1, 40);
+    for (size_t n = 0; n < 500; n++) {
+        const uint32_t w = dim(rng), h = dim(rng);
+        std::vector<uint8_t> ops;
+        for (size_t pixels = 0; pixels < static_cast<size_t>(w) * h;) {
+            const uint8_t b = static_cast<uint8_t>(rng());
+            switch (rng() % 6) {
+                case 0: ops.push_back(b & 0x3F); break;
+                case 1: ops.push_back(0x40 | (b & 0x3F)); break;
+                case 2: ops.insert(ops.end(), { static_cast<uint8_t>(0x80 | (b & 0x3F)), static_cast<uint8_t>(rng()) }); break;
+                case 3: ops.push_back(0xC0 | (b % 62)); pixels += b % 62; break;
+                case 4: ops.insert(ops.end(), { 0xFE, static_cast<uint8_t>(rng()), static_cast<uint8_t>(rng()), static_cast<uint8_t>(rng()) }); break;
+                default: ops.insert(ops.end(), { 0xFF, static_cast<uint8_t>(rng()), static_cast<uint8_t>(rng()), static_cast<uint8_t>(rng()), static_cast<uint8_t>(rng()) }); break;
+            }
+            pixels++;
+        }
+        streams.push_back({ { w, h }, ops });
+    }
+
+    for (const auto& [size, ops] : streams) {
+        for (uint8_t channels : { 3, 4 }) {
+            const std::vector<uint8_t> file = build_qoi(size[0], size[1], channels, ops);
+            unsigned w, h;
+            const std::vector<uint8_t> expected = qoi_reference_decode(file.data(), file.size(), channels, w, h);
+
+            auto decoded = ivmg::CodecRegistry::decode(file);
+            if (!decoded.has_value() || decoded->nb_chan() != channels || decoded->size_bytes() != expected.size()
+                || std::memcmp(decoded->get_raw_handle(), expected.data(), expected.size()) != 0) {
+                std::cout << "Hand built " << w << "x" << h << " stream with " << +channels << " channels differs from the reference";
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+
+int main() {
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<unsigned> dim(1, MAX_DIM);
+    ivmg::EncodeSession session;
+
+    if (!check_hand_built(rng))
+        return 1;
+
+    for (ivmg::ColorType ct : { ivmg::ColorType::GRAY, ivmg::ColorType::GRAYA, ivmg::ColorType::RGB, ivmg::ColorType::RGBA }) {
+        for (size_t i = 0; i < 8; i++) {
+            ivmg::Image img(dim(rng), dim(rng), ct);
+            fill_image(img, rng);
+
+            if (!check_decode(session, img))
+                return 1;
+        }
+    }
+
+    // Lossless for RGB and RGBA, which keep their number of channels
+    for (ivmg::ColorType ct : { ivmg::ColorType::RGB, ivmg::ColorType::RGBA }) {
+        ivmg::Image img(123, 77, ct);
+        fill_image(img, rng);
+        auto encoded = session.encode(img, std::string(".qoi"));
+        auto decoded = ivmg::CodecRegistry::decode(*encoded);
+        if (!decoded.has_value() || decoded->color() != ct || std::memcmp(decoded->get_raw_handle(), img.get_raw_handle(), img.size_bytes()) != 0) {
+            std::cout << "Round trip failed for " << +img.nb_chan() << " channels";
+            return 1;
+        }
+    }
+
+    for (ivmg::ColorType ct : { ivmg::ColorType::GRAY, ivmg::ColorType::RGB, ivmg::ColorType::RGBA }) {
+        for (uint32_t segment_rows : { 1u, 7u, 64u, 1000u }) {
+            ivmg::Image img(dim(rng), dim(rng), ct);
+            fill_image(img, rng);
+
+            if (!check_segments(session, img, segment_rows))
+                return 1;
+        }
+    }
+
+    ivmg::Image img(123, 77, ivmg::ColorType::RGBA);
+    auto encoded = session.encode(img, std::string(".qoi"));
+
+    auto info = ivmg::CodecRegistry::probe(*encoded);
+    if (!info.has_value() || info->width != 123 || info->height != 77 || info->channels != 4 || info->format != "qoi") {
+        std::cout << "Wrong probe";
+        return 1;
+    }
+
+    return 0;
+}
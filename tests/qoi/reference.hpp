@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * @brief The decoding loop of the reference qoi.h, kept as is, as an oracle and a baseline
+ *
+ * @param bytes the QOI file
+ * @param size the size of the file
+ * @param channels the number of channels to output, 3 or 4
+ * @return the pixels, empty if the header is invalid
+ */
+inline std::vector<uint8_t> qoi_reference_decode(const uint8_t* bytes, size_t size, unsigned channels, unsigned& width, unsigned& height) {
+    union rgba_t {
+        struct { uint8_t r, g, b, a; } rgba;
+        uint32_t v;
+    };
+
+    constexpr size_t header_size = 14;
+    constexpr size_t padding = 8;
+    if (size < header_size + padding)
+        return {};
+
+    auto read_32 = [&](size_t p) {
+        return static_cast<uint32_t>(bytes[p] << 24 | bytes[p + 1] << 16 | bytes[p + 2] << 8 | bytes[p + 3]);
+    };
+
+    width = read_32(4);
+    height = read_32(8);
+    if (width == 0 || height == 0 || bytes[12] < 3 || bytes[12] > 4)
+        return {};
+
+    const size_t px_len = static_cast<size_t>(width) * height * channels;
+    std::vector<uint8_t> pixels(px_len);
+
+    rgba_t index[64] = {};
+    rgba_t px;
+    px.rgba = { 0, 0, 0, 255 };
+
+    const size_t chunks_len = size - padding;
+    size_t p = header_size;
+    int run = 0;
+
+    for (size_t px_pos = 0; px_pos < px_len; px_pos += channels) {
+        if (run > 0) {
+            run--;
+        }
+        else if (p < chunks_len) {
+            const int b1 = bytes[p++];
+
+            if (b1 == 0xFE) {
+                px.rgba.r = bytes[p++];
+                px.rgba.g = bytes[p++];
+                px.rgba.b = bytes[p++];
+            }
+            else if (b1 == 0xFF) {
+                px.rgba.r = bytes[p++];
+                px.rgba.g = bytes[p++];
+                px.rgba.b = bytes[p++];
+                px.rgba.a = bytes[p++];
+            }
+            else if ((b1 & 0xC0) == 0x00) {
+                px = index[b1];
+            }
+            else if ((b1 & 0xC0) == 0x40) {
+                px.rgba.r += ((b1 >> 4) & 0x03) - 2;
+                px.rgba.g += ((b1 >> 2) & 0x03) - 2;
+                px.rgba.b += (b1 & 0x03) - 2;
+            }
+            else if ((b1 & 0xC0) == 0x80) {
+                const int b2 = bytes[p++];
+                const int vg = (b1 & 0x3F) - 32;
+                px.rgba.r += vg - 8 + ((b2 >> 4) & 0x0F);
+                px.rgba.g += vg;
+                px.rgba.b += vg - 8 + (b2 & 0x0F);
+            }
+            else if ((b1 & 0xC0) == 0xC0) {
+                run = (b1 & 0x3F);
+            }
+
+            index[(px.rgba.r * 3 + px.rgba.g * 5 + px.rgba.b * 7 + px.rgba.a * 11) % 64] = px;
+        }
+
+        pixels[px_pos + 0] = px.rgba.r;
+        pixels[px_pos + 1] = px.rgba.g;
+        pixels[px_pos + 2] = px.rgba.b;
+        if (channels == 4)
+            pixels[px_pos + 3] = px.rgba.a;
+    }
+
+    return pixels;
+}